@@ -0,0 +1,317 @@
+/*
+ * In-process benchmark of the SFS engine: the FUSE handlers of sfs.c are called
+ * directly, without a mount or kernel round trips, on a fresh image made with
+ * mkfs.sfs. Each workload prints one line of JSON with its throughput and
+ * latency percentiles.
+ *
+ * Build and run with `make -f tools.mk bench` (optimized, without ASan).
+ */
+#define main sfs_main
+#include "sfs.c"
+#undef main
+
+#include <getopt.h>
+
+
+#define BENCH_BIG_SIZE (2u << 20)
+#define BENCH_NFILES 16
+
+/* Deepest file on the image, used for path lookups. */
+static const char bench_deep_path[] = "/d0/d1/d2/d3/d4/d5/d6/d7/file";
+
+struct bench_opts {
+    const char *img;
+    const char *mkfs;
+    unsigned nops;
+    unsigned seed;
+    int cold;
+};
+
+struct workload {
+    const char *name;
+    void (*setup)(size_t arg);
+    void (*op)(unsigned i, size_t arg);
+    size_t arg;
+};
+
+static struct fuse_file_info big_fi;
+static char *bench_buf;
+static uint64_t *lat_ns;
+static uint64_t rand_state;
+
+
+/* xorshift64*, so runs with the same seed do the same accesses. */
+static uint64_t bench_rand(void)
+{
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 2685821657736338717ull;
+}
+
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "bench: %s failed\n", what);
+        exit(1);
+    }
+}
+
+
+/* Create the image, with a large file, a deep path and a full directory. */
+static void bench_mkfs(const struct bench_opts *o)
+{
+    char data_path[] = "/tmp/sfs-bench-XXXXXX";
+    char cmd[4096];
+    int fd, len;
+
+    fd = mkstemp(data_path);
+    check(fd != -1, "creating file contents");
+    for (size_t i = 0; i < BENCH_BIG_SIZE; i++)
+        bench_buf[i] = bench_rand();
+    check(write(fd, bench_buf, BENCH_BIG_SIZE) == (ssize_t)BENCH_BIG_SIZE,
+          "creating file contents");
+    close(fd);
+
+    len = snprintf(cmd, sizeof(cmd), "%s -q -s %u '%s' /big:%s %s /r/",
+                   o->mkfs, o->seed, o->img, data_path, bench_deep_path);
+    for (unsigned i = 0; i < BENCH_NFILES; i++)
+        len += snprintf(cmd + len, sizeof(cmd) - len, " /r/f%02u", i);
+
+    check(system(cmd) == 0, cmd);
+    unlink(data_path);
+
+    /* A journal left by an earlier run would be replayed onto the image. */
+    snprintf(cmd, sizeof(cmd), "%s.journal", o->img);
+    unlink(cmd);
+}
+
+
+static void churn_op(unsigned i, size_t arg)
+{
+    struct fuse_file_info fi;
+    char path[32];
+
+    (void)arg;
+    snprintf(path, sizeof(path), "/churn%u", i % 32);
+    memset(&fi, 0, sizeof(fi));
+    check(sfs_oper.create(path, 0644, &fi) == 0, "create");
+    sfs_oper.release(path, &fi);
+    check(sfs_oper.unlink(path) == 0, "unlink");
+}
+
+
+static void getattr_op(unsigned i, size_t arg)
+{
+    struct stat st;
+
+    (void)i;
+    (void)arg;
+    check(sfs_oper.getattr(bench_deep_path, &st) == 0, "getattr");
+}
+
+
+static void read_setup(size_t arg)
+{
+    (void)arg;
+    memset(&big_fi, 0, sizeof(big_fi));
+    check(sfs_oper.open("/big", &big_fi) == 0, "open");
+}
+
+
+static void seq_read_op(unsigned i, size_t size)
+{
+    size_t nchunks = BENCH_BIG_SIZE / size;
+    off_t off = (off_t)(i % nchunks) * size;
+
+    check(sfs_oper.read("/big", bench_buf, size, off, &big_fi) == (int)size,
+          "sequential read");
+}
+
+
+static void rand_read_op(unsigned i, size_t size)
+{
+    off_t off = (off_t)(bench_rand() % (BENCH_BIG_SIZE / size)) * size;
+
+    (void)i;
+    check(sfs_oper.read("/big", bench_buf, size, off, &big_fi) == (int)size,
+          "random read");
+}
+
+
+static int count_filler(void *buf, const char *name, const struct stat *st,
+                        off_t off)
+{
+    (void)name;
+    (void)st;
+    (void)off;
+    (*(unsigned *)buf)++;
+    return 0;
+}
+
+
+static void readdir_op(unsigned i, size_t arg)
+{
+    unsigned n = 0;
+
+    (void)i;
+    (void)arg;
+    check(sfs_oper.readdir("/r", &n, count_filler, 0, NULL) == 0 &&
+          n == BENCH_NFILES + 2, "readdir");
+}
+
+
+static const struct workload workloads[] = {
+    { "create_unlink",  NULL,       churn_op,     0 },
+    { "getattr_deep",   NULL,       getattr_op,   0 },
+    { "seq_read_4k",    read_setup, seq_read_op,  4096 },
+    { "seq_read_64k",   read_setup, seq_read_op,  65536 },
+    { "seq_read_128k",  read_setup, seq_read_op,  131072 },
+    { "rand_read_512",  read_setup, rand_read_op, 512 },
+    { "rand_read_4k",   read_setup, rand_read_op, 4096 },
+    { "rand_read_64k",  read_setup, rand_read_op, 65536 },
+    { "readdir",        NULL,       readdir_op,   0 },
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static void run_workload(const struct workload *w, const struct bench_opts *o)
+{
+    unsigned nops = o->nops;
+    uint64_t start, total;
+
+    if (w->setup)
+        w->setup(w->arg);
+
+    /* Make the reads go to the device rather than the host's page cache. The
+     * block cache is only cold for the first workload of a run, though. */
+    if (o->cold) {
+        check(fdatasync(disk_fd()) == 0, "syncing the image");
+        posix_fadvise(disk_fd(), 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    start = now_ns();
+    for (unsigned i = 0; i < nops; i++) {
+        uint64_t t = now_ns();
+
+        w->op(i, w->arg);
+        lat_ns[i] = now_ns() - t;
+    }
+    total = now_ns() - start;
+
+    if (w->setup)
+        sfs_oper.release("/big", &big_fi);
+
+    qsort(lat_ns, nops, sizeof(uint64_t), cmp_u64);
+    printf("{\"workload\": \"%s\", \"ops\": %u, \"ops_per_sec\": %.0f, "
+           "\"p50_us\": %.3f, \"p99_us\": %.3f}\n",
+           w->name, nops, nops / (total / 1e9),
+           lat_ns[nops / 2] / 1e3, lat_ns[(size_t)nops * 99 / 100] / 1e3);
+    fflush(stdout);
+}
+
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options] [workload]...\n\n"
+           "Runs the given workloads (default: all) on a fresh image, and\n"
+           "prints one JSON object per workload.\n\n"
+           "    -i FILE     image to create and use (default: bench.img)\n"
+           "    -M PATH     mkfs.sfs to create it with (default: ./mkfs.sfs)\n"
+           "    -n N        operations per workload (default: 20000)\n"
+           "    -s SEED     seed for the image layout and random reads\n"
+           "    -m          use the mmap backend\n"
+           "    -u          use the io_uring backend\n"
+           "    -C          drop the image from the page cache before each\n"
+           "                workload\n"
+           "    -j          journal metadata changes\n"
+           "    -c MB       block cache size (default: %u)\n"
+           "    -d N        dentry cache size (default: %u)\n"
+           "    -r N        readahead window in blocks (default: %u)\n"
+           "    -w SECS     metadata writeback interval (default: 0)\n\n"
+           "workloads:",
+           progname, DEFAULT_CACHE_MB, DEFAULT_DCACHE, DEFAULT_READAHEAD);
+    for (size_t i = 0; i < NWORKLOADS; i++)
+        printf(" %s", workloads[i].name);
+    printf("\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    struct bench_opts o = {
+        .img = "bench.img",
+        .mkfs = "./mkfs.sfs",
+        .nops = 20000,
+        .seed = 1,
+    };
+    enum disk_mode mode = DISK_MODE_PREAD;
+    int c;
+
+    options.dcache = DEFAULT_DCACHE;
+    options.cache_mb = DEFAULT_CACHE_MB;
+    options.readahead = DEFAULT_READAHEAD;
+
+    while ((c = getopt(argc, argv, "i:M:n:s:muCjc:d:r:w:h")) != -1) {
+        switch (c) {
+        case 'i': o.img = optarg; break;
+        case 'M': o.mkfs = optarg; break;
+        case 'n': o.nops = strtoul(optarg, NULL, 0); break;
+        case 's': o.seed = strtoul(optarg, NULL, 0); break;
+        case 'm': mode = DISK_MODE_MMAP; break;
+        case 'u': mode = DISK_MODE_URING; break;
+        case 'C': o.cold = 1; break;
+        case 'j': options.journal = 1; break;
+        case 'c': options.cache_mb = strtoul(optarg, NULL, 0); break;
+        case 'd': options.dcache = strtoul(optarg, NULL, 0); break;
+        case 'r': options.readahead = strtoul(optarg, NULL, 0); break;
+        case 'w': options.writeback = strtoul(optarg, NULL, 0); break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (o.nops == 0)
+        o.nops = 1;
+
+    for (int j = optind; j < argc; j++) {
+        size_t i = 0;
+
+        while (i < NWORKLOADS && strcmp(argv[j], workloads[i].name) != 0)
+            i++;
+        if (i == NWORKLOADS) {
+            fprintf(stderr, "bench: unknown workload '%s'\n", argv[j]);
+            return 1;
+        }
+    }
+
+    bench_buf = malloc(BENCH_BIG_SIZE);
+    lat_ns = malloc(o.nops * sizeof(uint64_t));
+    check(bench_buf && lat_ns, "allocating buffers");
+    rand_state = o.seed * 0x9e3779b97f4a7c15ull + 1;
+
+    bench_mkfs(&o);
+    disk_open_image(o.img, mode);
+    sfs_oper.init(NULL);
+
+    for (size_t i = 0; i < NWORKLOADS; i++) {
+        int selected = optind == argc;
+
+        for (int j = optind; j < argc; j++)
+            selected |= strcmp(argv[j], workloads[i].name) == 0;
+        if (selected)
+            run_workload(&workloads[i], &o);
+    }
+
+    sfs_oper.destroy(NULL);
+    return 0;
+}
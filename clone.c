@@ -0,0 +1,113 @@
+/*
+ * Clone a file on a mounted sfs: DST (which is created if needed) is made to
+ * share all blocks of SRC, through the SFS_IOC_CLONE ioctl. Neither file is
+ * copied, and both stay independent: blocks are copied when either is changed.
+ *
+ * Build with `make -f tools.mk clone`.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "sfs.h"
+
+
+/* Return the path of `path` within the file system it is on, by looking for
+ * the highest directory above it on the same device. Returns NULL on error. */
+static char *fs_path(const char *path, dev_t *ret_dev)
+{
+    char *full = realpath(path, NULL);
+    struct stat st, parent;
+    size_t root, up;
+    int res;
+
+    if (!full || stat(full, &st) == -1) {
+        free(full);
+        return NULL;
+    }
+    *ret_dev = st.st_dev;
+
+    /* Go up for as long as the parent is on the same device. */
+    for (root = strlen(full); root > 0; root = up) {
+        char c;
+
+        for (up = root - 1; up > 0 && full[up] != '/'; up--)
+            ;
+        c = full[up];
+        full[up] = '\0';
+        res = stat(up ? full : "/", &parent);
+        full[up] = c;
+        if (res == -1 || parent.st_dev != st.st_dev)
+            break;
+    }
+
+    if (full[root] == '\0')
+        strcpy(full, "/");
+    else
+        memmove(full, full + root, strlen(full + root) + 1);
+    return full;
+}
+
+
+static void usage(const char *progname)
+{
+    printf("usage: %s SRC DST\n\n"
+           "Makes DST a clone of SRC, which shares its blocks until either of "
+           "them is\nchanged. Both have to be on the same mounted sfs.\n",
+           progname);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct sfs_clone_arg arg;
+    struct stat st;
+    char *path;
+    dev_t dev;
+    int fd;
+
+    if (argc == 2 && strcmp(argv[1], "-h") == 0) {
+        usage(argv[0]);
+        return 0;
+    }
+    if (argc != 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!(path = fs_path(argv[1], &dev))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (strlen(path) >= sizeof(arg.path)) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(ENAMETOOLONG));
+        return 1;
+    }
+    memset(&arg, 0, sizeof(arg));
+    strcpy(arg.path, path);
+    free(path);
+
+    fd = open(argv[2], O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_dev != dev) {
+        fprintf(stderr, "%s: %s\n", argv[2], strerror(EXDEV));
+        close(fd);
+        return 1;
+    }
+    if (ioctl(fd, SFS_IOC_CLONE, &arg) == -1) {
+        perror(argv[2]);
+        close(fd);
+        return 1;
+    }
+    return close(fd) == -1;
+}
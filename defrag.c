@@ -0,0 +1,95 @@
+/*
+ * Offline defragmentation of an image that is not mounted: fragmented files
+ * are moved to single runs of blocks by the same code as the --defrag thread
+ * of sfs, up to a total budget of data copied, and the fragmentation is
+ * reported before and after.
+ *
+ * Build with `make -f tools.mk defrag` (optimized, without ASan).
+ */
+#define main sfs_main
+#include "sfs.c"
+#undef main
+
+#include <getopt.h>
+
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options] IMAGE\n\n"
+           "Moves the fragmented files of IMAGE to contiguous blocks.\n\n"
+           "    -b MIB      copy at most MIB MiB of file data (default: no "
+           "limit)\n"
+           "    -n          only report the fragmentation\n"
+           "    -m          access the image through mmap\n"
+           "    -j          journal the changes (see sfs --journal)\n",
+           progname);
+}
+
+
+/* The fragmentation of `m`, in percent. */
+static double defrag_pct(const struct defrag_metric *m)
+{
+    if (m->blocks <= m->files)
+        return 0;
+    return 100.0 * (m->runs - m->files) / (m->blocks - m->files);
+}
+
+
+static void report(const char *what, const struct defrag_metric *m)
+{
+    printf("%s: %" PRIu64 " of %" PRIu64 " files fragmented, %" PRIu64
+           " runs in %" PRIu64 " blocks (%.1f%% fragmented)\n", what,
+           m->fragmented, m->files, m->runs, m->blocks, defrag_pct(m));
+}
+
+
+int main(int argc, char **argv)
+{
+    struct defrag_ctx ctx = { .budget = UINT64_MAX };
+    struct defrag_metric before;
+    enum disk_mode mode = DISK_MODE_PREAD;
+    unsigned long moved = 0;
+    uint64_t moved_bytes = 0;
+    unsigned passes = 0;
+    int c;
+
+    options.dcache = DEFAULT_DCACHE;
+    options.cache_mb = DEFAULT_CACHE_MB;
+
+    while ((c = getopt(argc, argv, "b:nmjh")) != -1) {
+        switch (c) {
+        case 'b': ctx.budget = strtoull(optarg, NULL, 0) << 20; break;
+        case 'n': ctx.budget = 0; break;
+        case 'm': mode = DISK_MODE_MMAP; break;
+        case 'j': options.journal = 1; break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    options.img = argv[optind];
+    disk_open_image(options.img, mode);
+    sfs_oper.init(NULL);
+
+    /* Moving files frees up runs for others, so repeat until nothing moves;
+     * a file that was moved is never moved again. */
+    do {
+        defrag_pass(&ctx);
+        if (!passes++)
+            before = ctx.before;
+        moved += ctx.moved;
+        moved_bytes += ctx.moved_bytes;
+    } while (ctx.moved);
+
+    report("before", &before);
+    report("after", &ctx.after);
+    printf("moved %lu files (%.1f MiB) in %u passes\n", moved,
+           moved_bytes / 1048576.0, passes);
+
+    sfs_oper.destroy(NULL);
+    return 0;
+}
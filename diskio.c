@@ -3,19 +3,116 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include "diskio.h"
 #include "sfs.h"
 
 
-const size_t disk_size = SFS_DATA_OFF + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
+static struct sfs_geom geom = {
+    .version = 1,
+    .block_size = SFS_BLOCK_SIZE,
+    .nblocks = SFS_BLOCKTBL_NENTRIES,
+    .rootdir_nentries = SFS_ROOTDIR_NENTRIES,
+    .rootdir_off = SFS_ROOTDIR_OFF,
+    .blocktbl_off = SFS_BLOCKTBL_OFF,
+    .data_off = SFS_DATA_OFF,
+    .blockidx_size = sizeof(uint16_t),
+    .filename_max = SFS_FILENAME_MAX,
+};
+static size_t disk_size = SFS_DATA_OFF + SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
 
 static int img_fd = -1;
+static enum disk_mode img_mode = DISK_MODE_PREAD;
+static char *img_map;
 
+static int journal_fd = -1;
+static char *journal_path;
 
-void disk_open_image(const char *filename)
+static struct disk_stats stats;
+
+
+static uint64_t now_ns(void)
 {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+/* Count `n` requests for `size` bytes in total, which were started at `start`
+ * (if `ns` is set). Callers run concurrently, hence the atomics. */
+static void stats_add(unsigned long *count, uint64_t *bytes, uint64_t *ns,
+                      unsigned long n, size_t size, uint64_t start)
+{
+    __atomic_fetch_add(count, n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(bytes, size, __ATOMIC_RELAXED);
+    if (ns)
+        __atomic_fetch_add(ns, now_ns() - start, __ATOMIC_RELAXED);
+}
+
+static void stats_rw(int write, unsigned long n, size_t size, uint64_t start)
+{
+    if (write)
+        stats_add(&stats.writes, &stats.write_bytes, &stats.write_ns, n, size,
+                  start);
+    else
+        stats_add(&stats.reads, &stats.read_bytes, &stats.read_ns, n, size,
+                  start);
+}
+
+
+/* mkfs only writes the image up to the last used block. Extend it (sparsely)
+ * to the full size, so every block can be read and mapped. */
+static void disk_extend_image(void)
+{
+    struct stat st;
+
+    if (fstat(img_fd, &st) == -1) {
+        perror("Could not stat disk image");
+        exit(1);
+    }
+
+    if ((size_t)st.st_size < disk_size && ftruncate(img_fd, disk_size) == -1) {
+        perror("Could not extend disk image");
+        exit(1);
+    }
+}
+
+
+static void disk_map_image(void)
+{
+    img_map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   img_fd, 0);
+    if (img_map == MAP_FAILED) {
+        perror("Could not map disk image");
+        exit(1);
+    }
+}
+
+
+static struct disk_ring *disk_ring_get(void);
+static unsigned disk_journal_scan(int replay);
+
+
+/* Open the image, and its journal if it exists. Returns the number of complete
+ * transactions in the journal, which are replayed if `replay` is set. */
+static unsigned disk_open(const char *filename, enum disk_mode mode,
+                          int replay)
+{
+    unsigned ntxns = 0;
+    char *real;
+
     if (img_fd != -1) {
         fprintf(stderr, "Opening disk image when one is already open.\n");
         exit(1);
@@ -28,13 +125,82 @@ void disk_open_image(const char *filename)
     }
 
     disk_verify_magic();
+    disk_extend_image();
+
+    /* Absolute, as the journal may only be created after the FUSE daemon has
+     * changed to the root directory. */
+    real = realpath(filename, NULL);
+    journal_path = real ? malloc(strlen(real) + sizeof(".journal")) : NULL;
+    if (!journal_path) {
+        perror("Could not open journal");
+        exit(1);
+    }
+    strcpy(journal_path, real);
+    strcat(journal_path, ".journal");
+    free(real);
+    journal_fd = open(journal_path, replay ? O_RDWR : O_RDONLY);
+    if (journal_fd != -1)
+        ntxns = disk_journal_scan(replay);
+    if (!replay && journal_fd != -1) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+
+    if (mode == DISK_MODE_MMAP)
+        disk_map_image();
+    img_mode = mode;
+
+    if (mode == DISK_MODE_URING && !disk_ring_get()) {
+        perror("Could not set up io_uring, using pread/pwrite instead");
+        img_mode = DISK_MODE_PREAD;
+    }
+    return ntxns;
+}
+
+
+void disk_open_image(const char *filename, enum disk_mode mode)
+{
+    disk_open(filename, mode, 1);
+}
+
+
+unsigned disk_open_image_pending(const char *filename, enum disk_mode mode)
+{
+    return disk_open(filename, mode, 0);
+}
+
+
+enum disk_mode disk_get_mode(void)
+{
+    return img_mode;
+}
+
+
+/* Abort on accesses that do not lie completely within the image. */
+static void disk_check_range(const char *what, size_t size, off_t offset)
+{
+    assert(offset >= 0);
+    if ((size_t)offset >= disk_size || size > disk_size - (size_t)offset) {
+        fprintf(stderr, "Error: %s outside of range of addressable "
+                "blocks: offset=%#lx size=%zu\n", what, offset, size);
+        abort();
+    }
 }
 
 
 void disk_read(void *buf, size_t size, off_t offset)
 {
+    uint64_t start = now_ns();
     ssize_t ret;
 
+    disk_check_range("read from disk", size, offset);
+
+    if (img_mode == DISK_MODE_MMAP) {
+        memcpy(buf, img_map + offset, size);
+        stats_rw(0, 1, size, start);
+        return;
+    }
+
     ret = pread(img_fd, buf, size, offset);
     if (ret == -1) {
         perror("Error reading from disk");
@@ -46,18 +212,21 @@ void disk_read(void *buf, size_t size, off_t offset)
                 size, ret);
         exit(1);
     }
+    stats_rw(0, 1, size, start);
 }
 
 
 void disk_write(const void *buf, size_t size, off_t offset)
 {
+    uint64_t start = now_ns();
     ssize_t ret;
 
-    assert(offset >= 0);
-    if ((size_t)offset >= disk_size) {
-        fprintf(stderr, "Error: write to disk outside of range of addressable "
-                "blocks: offset=%#lx size=%zu\n", offset, size);
-        assert((size_t)offset < disk_size);
+    disk_check_range("write to disk", size, offset);
+
+    if (img_mode == DISK_MODE_MMAP) {
+        memcpy(img_map + offset, buf, size);
+        stats_rw(1, 1, size, start);
+        return;
     }
 
     ret = pwrite(img_fd, buf, size, offset);
@@ -71,15 +240,696 @@ void disk_write(const void *buf, size_t size, off_t offset)
                 size, ret);
         exit(1);
     }
+    stats_rw(1, 1, size, start);
+}
+
+
+/* Maximum number of segments passed to a single preadv/pwritev. */
+#define DISK_IOV_MAX 1024
+
+
+/* Skip the first `n` bytes of the `*niov` buffers at `*iov`. */
+static void iov_skip(struct iovec **iov, int *niov, size_t n)
+{
+    while (*niov && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*niov)--;
+    }
+    if (*niov) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+
+/*
+ * Transfer the `niov` buffers of `iov` to or from the disk, starting at
+ * `offset`, and continuing after short transfers.
+ */
+static void disk_rw_iov(int write, struct iovec *iov, int niov, off_t offset,
+                        size_t total)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < total) {
+        uint64_t start = now_ns();
+
+        if (write)
+            ret = pwritev(img_fd, iov, niov, offset + done);
+        else
+            ret = preadv(img_fd, iov, niov, offset + done);
+
+        if (ret == -1) {
+            perror(write ? "Error writing to disk" : "Error reading from disk");
+            exit(1);
+        }
+        if (ret == 0) {
+            fprintf(stderr, "Could not %s %zu bytes %s disk, only did %zu\n",
+                    write ? "write" : "read", total, write ? "to" : "from",
+                    done);
+            exit(1);
+        }
+
+        stats_rw(write, 1, ret, start);
+        done += ret;
+        iov_skip(&iov, &niov, ret);
+    }
+}
+
+
+/*
+ * io_uring backend. Every thread gets a ring of its own the first time it
+ * does a vectored access, so threads never wait for each other's
+ * completions and no locking is needed. The rings are set up with raw system
+ * calls, so liburing is not needed.
+ */
+
+/* Number of submission queue entries per ring; the most accesses in flight
+ * for one call. */
+#define DISK_RING_ENTRIES 256u
+
+struct disk_ring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+/* One merged access: `niov` buffers starting at iov[`iov`], covering `total`
+ * bytes at disk address `offset`. */
+struct disk_run {
+    int iov, niov;
+    off_t offset;
+    size_t total;
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+
+static void disk_ring_free(void *arg)
+{
+    struct disk_ring *r = arg;
+
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_len);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    free(r);
+}
+
+
+static void disk_ring_key_init(void)
+{
+    pthread_key_create(&ring_key, disk_ring_free);
+}
+
+
+static void *disk_ring_mmap(int fd, size_t len, off_t what)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, what);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+
+/* Return the calling thread's ring, setting it up if needed. Returns NULL (with
+ * errno set) if io_uring cannot be used. */
+static struct disk_ring *disk_ring_get(void)
+{
+    struct io_uring_params p;
+    struct disk_ring *r;
+    char *sq, *cq;
+
+    pthread_once(&ring_key_once, disk_ring_key_init);
+    if ((r = pthread_getspecific(ring_key)))
+        return r;
+
+    if (!(r = calloc(1, sizeof(*r))))
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, DISK_RING_ENTRIES, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings with a single mmap. */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len)
+            r->sq_map_len = r->cq_map_len;
+        r->sq_map = r->cq_map = disk_ring_mmap(r->fd, r->sq_map_len,
+                                               IORING_OFF_SQ_RING);
+    } else {
+        r->sq_map = disk_ring_mmap(r->fd, r->sq_map_len, IORING_OFF_SQ_RING);
+        r->cq_map = disk_ring_mmap(r->fd, r->cq_map_len, IORING_OFF_CQ_RING);
+    }
+    r->sqes = disk_ring_mmap(r->fd, r->sqes_len, IORING_OFF_SQES);
+
+    if (!r->sq_map || !r->cq_map || !r->sqes) {
+        disk_ring_free(r);
+        return NULL;
+    }
+
+    sq = r->sq_map;
+    cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+
+/*
+ * Submit the `nruns` runs (at most DISK_RING_ENTRIES) as one batch, and wait
+ * until all of them have completed. Short transfers are finished with
+ * disk_rw_iov.
+ */
+static void disk_uring_rw(struct disk_ring *r, int write, struct iovec *iov,
+                          const struct disk_run *runs, unsigned nruns)
+{
+    unsigned tail = *r->sq_tail, head;
+    unsigned to_submit = nruns, done = 0;
+    uint64_t start = now_ns();
+    size_t total = 0;
+    int ret;
+
+    for (unsigned k = 0; k < nruns; k++) {
+        unsigned idx = tail++ & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = img_fd;
+        sqe->addr = (unsigned long)&iov[runs[k].iov];
+        sqe->len = runs[k].niov;
+        sqe->off = runs[k].offset;
+        sqe->user_data = k;
+        r->sq_array[idx] = idx;
+        total += runs[k].total;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (done < nruns) {
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, nruns - done,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            perror(write ? "Error writing to disk" : "Error reading from disk");
+            exit(1);
+        }
+        if (ret > 0)
+            to_submit -= ret;
+
+        head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head++ & *r->cq_mask];
+            const struct disk_run *run = &runs[cqe->user_data];
+            struct iovec *rest = &iov[run->iov];
+            int nrest = run->niov;
+
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                perror(write ? "Error writing to disk"
+                             : "Error reading from disk");
+                exit(1);
+            }
+            if ((size_t)cqe->res < run->total) {
+                iov_skip(&rest, &nrest, cqe->res);
+                disk_rw_iov(write, rest, nrest, run->offset + cqe->res,
+                            run->total - cqe->res);
+            }
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    stats_rw(write, nruns, total, start);
+}
+
+
+static void disk_rw_segs(int write, const struct disk_seg *segs,
+                         unsigned nsegs)
+{
+    struct disk_ring *ring = NULL;
+    struct iovec iov[DISK_IOV_MAX];
+    struct disk_run runs[DISK_RING_ENTRIES];
+    unsigned i = 0;
+
+    if (img_mode == DISK_MODE_URING)
+        ring = disk_ring_get();
+
+    while (i < nsegs) {
+        unsigned nruns = 0;
+        int n = 0;
+
+        /* Each run gathers the segments that continue where the previous one
+         * ended. Without a ring, each run is transferred before the next. */
+        do {
+            struct disk_run *run = &runs[nruns];
+
+            run->iov = n;
+            run->offset = segs[i].offset;
+            run->total = 0;
+
+            do {
+                disk_check_range(write ? "write to disk" : "read from disk",
+                                 segs[i].size, segs[i].offset);
+
+                if (img_mode == DISK_MODE_MMAP) {
+                    uint64_t start = now_ns();
+
+                    if (write)
+                        memcpy(img_map + segs[i].offset, segs[i].buf,
+                               segs[i].size);
+                    else
+                        memcpy(segs[i].buf, img_map + segs[i].offset,
+                               segs[i].size);
+                    stats_rw(write, 1, segs[i].size, start);
+                }
+
+                iov[n].iov_base = segs[i].buf;
+                iov[n].iov_len = segs[i].size;
+                run->total += segs[i].size;
+                n++;
+                i++;
+            } while (i < nsegs && n < DISK_IOV_MAX &&
+                     segs[i].offset == run->offset + (off_t)run->total);
+
+            run->niov = n - run->iov;
+            if (ring) {
+                nruns++;
+            } else {
+                if (img_mode != DISK_MODE_MMAP)
+                    disk_rw_iov(write, iov, n, run->offset, run->total);
+                n = 0;
+            }
+        } while (i < nsegs && n < DISK_IOV_MAX && nruns < DISK_RING_ENTRIES);
+
+        if (nruns)
+            disk_uring_rw(ring, write, iov, runs, nruns);
+    }
+}
+
+
+void disk_readv(const struct disk_seg *segs, unsigned nsegs)
+{
+    disk_rw_segs(0, segs, nsegs);
+}
+
+
+void disk_writev(const struct disk_seg *segs, unsigned nsegs)
+{
+    disk_rw_segs(1, segs, nsegs);
+}
+
+
+const void *disk_map(size_t size, off_t offset)
+{
+    if (img_mode != DISK_MODE_MMAP)
+        return NULL;
+
+    disk_check_range("map of disk", size, offset);
+    return img_map + offset;
+}
+
+
+int disk_fd(void)
+{
+    return img_fd;
+}
+
+
+/*
+ * The journal is a sequence of transactions, each a header followed by `len`
+ * bytes of records: a struct journal_rec and the `size` bytes it describes.
+ * A transaction only counts if it is complete and its checksum matches.
+ */
+#define JOURNAL_MAGIC 0x4a534653u  /* "SFSJ" */
+
+struct journal_txn {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t len;
+    uint32_t csum;
+};
+
+struct journal_rec {
+    uint64_t offset;
+    uint64_t size;
+};
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *journal_buf;           /* Records of the current transaction */
+static size_t journal_len, journal_cap;
+static size_t journal_end;          /* Size of the journal file */
+static unsigned journal_seq = 1;    /* Current transaction */
+static unsigned journal_done;       /* Last committed transaction */
+static unsigned journal_synced;     /* Last transaction on stable storage */
+
+
+static uint32_t journal_csum(const char *p, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--)
+        h = (h ^ (unsigned char)*p++) * 16777619u;
+    return h;
+}
+
+
+static void journal_truncate(void)
+{
+    if (ftruncate(journal_fd, 0) == -1 || fsync(journal_fd) == -1) {
+        perror("Error truncating journal");
+        exit(1);
+    }
+    journal_end = 0;
+}
+
+
+/* Count the complete transactions in the journal. If `replay` is set, also
+ * write their records to the disk, and empty the journal. */
+static unsigned disk_journal_scan(int replay)
+{
+    struct journal_txn txn;
+    struct journal_rec rec;
+    struct stat st;
+    unsigned ntxns = 0;
+    size_t pos = 0;
+    char *buf;
+
+    if (fstat(journal_fd, &st) == -1) {
+        perror("Could not stat journal");
+        exit(1);
+    }
+    if (st.st_size == 0)
+        return 0;
+
+    buf = malloc(st.st_size);
+    if (!buf || pread(journal_fd, buf, st.st_size, 0) != st.st_size) {
+        perror("Could not read journal");
+        exit(1);
+    }
+
+    while (pos + sizeof(txn) <= (size_t)st.st_size) {
+        memcpy(&txn, buf + pos, sizeof(txn));
+        pos += sizeof(txn);
+        if (txn.magic != JOURNAL_MAGIC || txn.len > st.st_size - pos ||
+                txn.csum != journal_csum(buf + pos, txn.len))
+            break;
+
+        for (size_t i = 0; replay && i + sizeof(rec) <= txn.len;
+             i += rec.size) {
+            memcpy(&rec, buf + pos + i, sizeof(rec));
+            i += sizeof(rec);
+            if (rec.size > txn.len - i)
+                break;
+            disk_check_range("journal replay", rec.size, rec.offset);
+            if (pwrite(img_fd, buf + pos + i, rec.size, rec.offset) !=
+                    (ssize_t)rec.size) {
+                perror("Error replaying journal");
+                exit(1);
+            }
+        }
+        pos += txn.len;
+        ntxns++;
+    }
+    free(buf);
+    if (!replay)
+        return ntxns;
+
+    if (ntxns) {
+        fprintf(stderr, "Replayed %u transactions from %s\n", ntxns,
+                journal_path);
+        if (fsync(img_fd) == -1) {
+            perror("Error syncing disk");
+            exit(1);
+        }
+    }
+    journal_truncate();
+    return ntxns;
+}
+
+
+void disk_journal_open(void)
+{
+    if (journal_fd == -1)
+        journal_fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+    if (journal_fd == -1) {
+        perror("Could not open journal");
+        exit(1);
+    }
+}
+
+
+unsigned disk_journal_add(const void *buf, size_t size, off_t offset)
+{
+    struct journal_rec rec = { .offset = offset, .size = size };
+    unsigned seq;
+
+    disk_check_range("journal record", size, offset);
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_len + sizeof(rec) + size > journal_cap) {
+        size_t cap = journal_cap ? journal_cap : 4096;
+
+        while (cap < journal_len + sizeof(rec) + size)
+            cap *= 2;
+        if (!(journal_buf = realloc(journal_buf, cap))) {
+            perror("Could not grow journal transaction");
+            exit(1);
+        }
+        journal_cap = cap;
+    }
+    memcpy(journal_buf + journal_len, &rec, sizeof(rec));
+    memcpy(journal_buf + journal_len + sizeof(rec), buf, size);
+    journal_len += sizeof(rec) + size;
+    seq = journal_seq;
+    pthread_mutex_unlock(&journal_lock);
+    return seq;
+}
+
+
+unsigned disk_journal_commit(void)
+{
+    struct journal_txn txn;
+    struct iovec iov[2];
+    unsigned done;
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_len) {
+        uint64_t start = now_ns();
+
+        txn = (struct journal_txn){
+            .magic = JOURNAL_MAGIC,
+            .seq = journal_seq,
+            .len = journal_len,
+            .csum = journal_csum(journal_buf, journal_len),
+        };
+        iov[0] = (struct iovec){ &txn, sizeof(txn) };
+        iov[1] = (struct iovec){ journal_buf, journal_len };
+        if (pwritev(journal_fd, iov, 2, journal_end) !=
+                (ssize_t)(sizeof(txn) + journal_len)) {
+            perror("Error writing journal");
+            exit(1);
+        }
+        stats_add(&stats.journal_commits, &stats.journal_bytes,
+                  &stats.journal_ns, 1, sizeof(txn) + journal_len, start);
+        journal_end += sizeof(txn) + journal_len;
+        journal_len = 0;
+        journal_done = journal_seq++;
+    }
+    done = journal_done;
+    pthread_mutex_unlock(&journal_lock);
+    return done;
+}
+
+
+unsigned disk_journal_committed(void)
+{
+    unsigned done;
+
+    pthread_mutex_lock(&journal_lock);
+    done = journal_done;
+    pthread_mutex_unlock(&journal_lock);
+    return done;
+}
+
+
+void disk_journal_sync(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    if (journal_synced != journal_done) {
+        uint64_t start = now_ns();
+
+        if (fdatasync(journal_fd) == -1) {
+            perror("Error syncing journal");
+            exit(1);
+        }
+        journal_synced = journal_done;
+        __atomic_fetch_add(&stats.journal_syncs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.journal_ns, now_ns() - start,
+                           __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+
+size_t disk_journal_size(void)
+{
+    size_t size;
+
+    pthread_mutex_lock(&journal_lock);
+    size = journal_end;
+    pthread_mutex_unlock(&journal_lock);
+    return size;
+}
+
+
+void disk_journal_reset(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    journal_truncate();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+
+void disk_sync(void)
+{
+    uint64_t start;
+    int ret;
+
+    if (journal_fd != -1)
+        disk_journal_sync();
+
+    start = now_ns();
+    if (img_mode == DISK_MODE_MMAP)
+        ret = msync(img_map, disk_size, MS_SYNC);
+    else
+        ret = fsync(img_fd);
+
+    if (ret == -1) {
+        perror("Error syncing disk");
+        exit(1);
+    }
+    __atomic_fetch_add(&stats.syncs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.sync_ns, now_ns() - start, __ATOMIC_RELAXED);
+}
+
+
+void disk_get_stats(struct disk_stats *st)
+{
+#define LOAD(field) \
+    st->field = __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+    LOAD(reads);
+    LOAD(writes);
+    LOAD(syncs);
+    LOAD(journal_commits);
+    LOAD(journal_syncs);
+    LOAD(read_bytes);
+    LOAD(write_bytes);
+    LOAD(journal_bytes);
+    LOAD(read_ns);
+    LOAD(write_ns);
+    LOAD(sync_ns);
+    LOAD(journal_ns);
+#undef LOAD
 }
 
 void disk_verify_magic(void)
 {
     char buf[SFS_MAGIC_SIZE];
+    struct sfs_superblock sb;
+    const char *err;
+
     disk_read(buf, sizeof(buf), 0);
     if (memcmp(buf, sfs_magic, SFS_MAGIC_SIZE)) {
         fprintf(stderr, "Invalid signature '%.*s', expected '%.*s'\n",
                 SFS_MAGIC_SIZE, buf, SFS_MAGIC_SIZE, sfs_magic);
         exit(1);
     }
+
+    disk_read(&sb, sizeof(sb), SFS_SB_OFF);
+    if (memcmp(sb.magic, SFS_SB_MAGIC, sizeof(sb.magic)) != 0)
+        return;
+    if ((err = disk_check_superblock(&sb))) {
+        fprintf(stderr, "Invalid superblock: %s\n", err);
+        exit(1);
+    }
+
+    geom = (struct sfs_geom){
+        .version = sb.version,
+        .block_size = sb.block_size,
+        .nblocks = sb.nblocks,
+        .rootdir_nentries = sb.rootdir_nentries,
+        .rootdir_off = sb.rootdir_off,
+        .blocktbl_off = sb.blocktbl_off,
+        .data_off = sb.data_off,
+        .refcnt_off = sb.refcnt_off,
+        .blockidx_size = sizeof(uint32_t),
+        .filename_max = SFS_V2_FILENAME_MAX,
+    };
+    disk_size = sb.data_off + (size_t)sb.nblocks * sb.block_size;
+}
+
+
+const char *disk_check_superblock(const struct sfs_superblock *sb)
+{
+    uint64_t rootdir_end = sb->rootdir_off +
+                           (uint64_t)sb->rootdir_nentries * SFS_ENTRY_SIZE;
+    uint64_t blocktbl_end = sb->blocktbl_off +
+                            (uint64_t)sb->nblocks * sizeof(uint32_t);
+    uint64_t refcnt_end = sb->refcnt_off +
+                          (uint64_t)sb->nblocks * sizeof(uint32_t);
+
+    if (sb->version != SFS_VERSION)
+        return "unsupported version";
+    if (sb->block_size < SFS_BLOCK_SIZE_MIN ||
+            sb->block_size > SFS_BLOCK_SIZE_MAX ||
+            (sb->block_size & (sb->block_size - 1)))
+        return "invalid block size";
+    if (sb->nblocks == 0 || sb->nblocks > SFS_V2_NBLOCKS_MAX)
+        return "invalid number of blocks";
+    if (sb->rootdir_nentries == 0 || sb->rootdir_nentries > 0xffff)
+        return "invalid number of root directory entries";
+    if (sb->rootdir_off < SFS_SB_OFF + sizeof(*sb) ||
+            sb->rootdir_off % SFS_ENTRY_SIZE ||
+            sb->blocktbl_off < rootdir_end ||
+            sb->data_off < blocktbl_end ||
+            sb->data_off % SFS_ENTRY_SIZE)
+        return "overlapping or misaligned regions";
+    if (sb->refcnt_off && (sb->refcnt_off < blocktbl_end ||
+                           sb->refcnt_off % sizeof(uint32_t) ||
+                           sb->data_off < refcnt_end))
+        return "overlapping or misaligned regions";
+    if (sb->rootdir_next != SFS_BLOCKIDX_END && sb->rootdir_next >= sb->nblocks)
+        return "invalid root directory chain";
+    return NULL;
+}
+
+
+void disk_get_geometry(struct sfs_geom *g)
+{
+    *g = geom;
 }
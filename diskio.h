@@ -1,8 +1,31 @@
 #ifndef DISKIO_H
 #define DISKIO_H
 
-/* Open a disk image for future disk operations. */
-void disk_open_image(const char *filename);
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct sfs_superblock;
+
+/* Backends for accessing the disk image. */
+enum disk_mode {
+    DISK_MODE_PREAD,    /* One pread/pwrite syscall per access (default). */
+    DISK_MODE_MMAP,     /* Whole image mapped into our address space. */
+    DISK_MODE_URING,    /* Vectored accesses batched through io_uring. */
+};
+
+/* Open a disk image for future disk operations, using backend `mode`. If
+ * DISK_MODE_URING is not supported by the kernel, DISK_MODE_PREAD is used.
+ * Transactions left in the image's journal (see below) are replayed first. */
+void disk_open_image(const char *filename, enum disk_mode mode);
+
+/* Like disk_open_image(), but leave the journal alone. Returns the number of
+ * transactions in it that disk_open_image() would replay. */
+unsigned disk_open_image_pending(const char *filename, enum disk_mode mode);
+
+/* The backend in use: the one asked for, unless that was DISK_MODE_URING and
+ * io_uring could not be set up. */
+enum disk_mode disk_get_mode(void);
 
 /* Read `size` bytes from address `offset` of the disk, into `buf`. */
 void disk_read(void *buf, size_t size, off_t offset);
@@ -10,7 +33,108 @@ void disk_read(void *buf, size_t size, off_t offset);
 /* Write `size` bytes from `buf` to disk at address `offset`. */
 void disk_write(const void *buf, size_t size, off_t offset);
 
-/* Verify this is an SFS partitiion by checking the magic bytes at the start. */
+/* One piece of a vectored disk access: `size` bytes at disk address `offset`,
+ * to be read into or written from `buf`. */
+struct disk_seg {
+    void *buf;
+    size_t size;
+    off_t offset;
+};
+
+/* Read each of the `nsegs` segments of `segs` from disk. Segments that follow
+ * each other on disk are merged into a single preadv. With DISK_MODE_URING,
+ * all of these are submitted at once and run in parallel. */
+void disk_readv(const struct disk_seg *segs, unsigned nsegs);
+
+/* Write each of the `nsegs` segments of `segs` to disk. Segments that follow
+ * each other on disk are merged into a single pwritev. With DISK_MODE_URING
+ * these run in parallel, so the segments must not overlap. */
+void disk_writev(const struct disk_seg *segs, unsigned nsegs);
+
+/* Return a pointer to `size` bytes of the disk at address `offset`, without
+ * copying them. This is only possible with DISK_MODE_MMAP; other backends
+ * return NULL, and the caller should fall back to disk_read. The pointer stays
+ * valid until the image is closed, and reflects later disk_write calls. */
+const void *disk_map(size_t size, off_t offset);
+
+/* Return the file descriptor of the open image, for handing out byte ranges of
+ * the disk (at the same addresses as above) to code that does its own I/O on
+ * it, such as fd-backed FUSE buffers. With DISK_MODE_MMAP the mapping is
+ * shared, so such I/O and the mapping see each other's changes. */
+int disk_fd(void);
+
+/*
+ * Metadata journal, kept next to the image in "<image>.journal". Changes are
+ * collected into a transaction with disk_journal_add(), and appended to the
+ * journal with disk_journal_commit() before they are written to the disk
+ * itself. After a crash, the transactions that were committed completely are
+ * replayed by disk_open_image().
+ */
+
+/* Start journaling, creating the journal if needed. */
+void disk_journal_open(void);
+
+/* Add `size` bytes of `buf`, to be written at disk address `offset`, to the
+ * current transaction. Returns the sequence number of the transaction. */
+unsigned disk_journal_add(const void *buf, size_t size, off_t offset);
+
+/* Append the current transaction to the journal, unless it is empty. Returns
+ * the sequence number of the last committed transaction. */
+unsigned disk_journal_commit(void);
+
+/* Return the sequence number of the last committed transaction. */
+unsigned disk_journal_committed(void);
+
+/* Flush the committed transactions to stable storage. */
+void disk_journal_sync(void);
+
+/* Return the size of the journal in bytes. */
+size_t disk_journal_size(void);
+
+/* Empty the journal, once all of it has been written to the disk and synced. */
+void disk_journal_reset(void);
+
+/* Flush all previous writes to stable storage (msync or fsync), including
+ * those to the journal. */
+void disk_sync(void);
+
+/* Counters of the accesses made through this interface since the image was
+ * opened. A request is one system call, io_uring entry or (with
+ * DISK_MODE_MMAP) copy; the times are how long callers waited for them. */
+struct disk_stats {
+    unsigned long reads, writes, syncs;
+    unsigned long journal_commits, journal_syncs;
+    uint64_t read_bytes, write_bytes, journal_bytes;
+    uint64_t read_ns, write_ns, sync_ns, journal_ns;
+};
+
+/* Store a copy of the counters in `st`. */
+void disk_get_stats(struct disk_stats *st);
+
+/* Verify this is an SFS partitiion by checking the magic bytes at the start,
+ * and read its geometry. */
 void disk_verify_magic(void);
 
+/* Geometry of the open image: the constants of sfs.h for a version 1 image,
+ * otherwise what its superblock records. */
+struct sfs_geom {
+    unsigned version;
+    uint32_t block_size;
+    uint32_t nblocks;
+    uint32_t rootdir_nentries;
+    off_t rootdir_off;
+    off_t blocktbl_off;
+    off_t data_off;
+    off_t refcnt_off;           /* Reference count table, or 0 if none */
+    unsigned blockidx_size;     /* Bytes per block table entry on disk */
+    unsigned filename_max;      /* Longest name, including the nul */
+};
+
+/* Store the geometry of the open image in `g`. */
+void disk_get_geometry(struct sfs_geom *g);
+
+/* Check the superblock `sb` of a version 2 image. Returns NULL if it is valid,
+ * otherwise what is wrong with it. */
+const char *disk_check_superblock(const struct sfs_superblock *sb);
+
 #endif
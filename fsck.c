@@ -0,0 +1,687 @@
+/*
+ * Consistency checker for version 1 and 2 images. The image is mapped, and its
+ * directory tree is walked by a pool of threads, one task per directory. Every
+ * chain that an entry refers to is claimed block by block in a shared bitmap,
+ * so a block that is claimed twice is either cross-linked (another chain owns
+ * it) or part of a cycle (the same chain does). A single pass over the block
+ * table afterwards finds the blocks that are in use but owned by nothing.
+ * Blocks that files share with their clones have a reference count, and may
+ * be claimed again by other files; those claims are counted, and checked
+ * against the reference counts at the end.
+ *
+ * With -r the problems are repaired: broken chains are cut where they go
+ * wrong (and the sizes of their files reduced to match), invalid entries are
+ * cleared, leaked blocks are freed, and wrong reference counts are set to the
+ * number of files that share their blocks. A journal left behind by a crash
+ * is replayed first; without -r it is left alone, and only reported.
+ *
+ * Build with `make -f tools.mk fsck`. Exits with 0 if the image is consistent,
+ * 1 if all problems were repaired, 4 if problems are left, and 8 on other
+ * errors.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "diskio.h"
+#include "sfs.h"
+
+
+#define FSCK_OK         0
+#define FSCK_REPAIRED   1
+#define FSCK_ERRORS     4
+#define FSCK_FAILED     8
+
+#define FSCK_MAX_THREADS 64
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+struct fsck_opts {
+    const char *img;
+    unsigned nthreads;
+    int repair;
+    int quiet;
+};
+
+static struct fsck_opts opts;
+static struct sfs_geom geom;
+
+/* The block table, with 32-bit indices (also for version 1 images). */
+static blockidx_t *block_table;
+
+/* One bit per block, set once a chain has claimed it. */
+static uint64_t *owned;
+
+/* The reference counts of the blocks (NULL if the image has none), and the
+ * number of times each block was claimed again by a file sharing it. */
+static uint32_t *refs, *seen;
+
+static unsigned dir_seg_nentries, dir_seg_blocks;
+static blockidx_t root_next = SFS_BLOCKIDX_END;
+
+#define ROOT_NEXT_OFF (SFS_SB_OFF + offsetof(struct sfs_superblock, rootdir_next))
+
+static unsigned long nerrors, nfixed, ndirs, nfiles;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Report a problem with `path`, which was repaired if `fixed`. */
+static void problem(const char *path, int fixed, const char *fmt, ...)
+{
+    va_list ap;
+
+    __atomic_fetch_add(&nerrors, 1, __ATOMIC_RELAXED);
+    if (fixed)
+        __atomic_fetch_add(&nfixed, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&out_lock);
+    printf("%s: ", path);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(fixed ? " (fixed)\n" : "\n");
+    pthread_mutex_unlock(&out_lock);
+}
+
+
+static blockidx_t entry_block(const struct sfs_entry *entry)
+{
+    uint16_t hi;
+
+    if (geom.version == 1)
+        return entry->first_block >= SFS_V1_BLOCKIDX_END
+               ? 0xffff0000u | entry->first_block : entry->first_block;
+    memcpy(&hi, &entry->filename[SFS_V2_FILENAME_MAX], sizeof(hi));
+    return (uint32_t)hi << 16 | entry->first_block;
+}
+
+static void entry_set_block(struct sfs_entry *entry, blockidx_t block)
+{
+    uint16_t hi = block >> 16;
+
+    entry->first_block = (uint16_t)block;
+    if (geom.version != 1)
+        memcpy(&entry->filename[SFS_V2_FILENAME_MAX], &hi, sizeof(hi));
+}
+
+static void entry_write(const struct sfs_entry *entry, off_t off)
+{
+    disk_write(entry, sizeof(*entry), off);
+}
+
+static void entry_clear(off_t off)
+{
+    struct sfs_entry empty;
+
+    memset(&empty, 0, sizeof(empty));
+    entry_set_block(&empty, SFS_BLOCKIDX_EMPTY);
+    entry_write(&empty, off);
+}
+
+static inline off_t block_off(blockidx_t block)
+{
+    return geom.data_off + (off_t)block * geom.block_size;
+}
+
+/* Point `block` at `next`, both in memory and on disk. Only done for blocks
+ * that the caller owns, or after the tree walk. */
+static void blocktbl_set(blockidx_t block, blockidx_t next)
+{
+    uint16_t v1 = (uint16_t)next;
+
+    block_table[block] = next;
+    if (geom.version == 1)
+        disk_write(&v1, sizeof(v1), geom.blocktbl_off + block * sizeof(v1));
+    else
+        disk_write(&next, sizeof(next),
+                   geom.blocktbl_off + (off_t)block * sizeof(next));
+}
+
+
+/* Claim `block`. Returns 0 if it was not owned yet. */
+static inline int claim(blockidx_t block)
+{
+    uint64_t bit = 1ull << (block % 64);
+
+    return !!(__atomic_fetch_or(&owned[block / 64], bit, __ATOMIC_RELAXED) &
+              bit);
+}
+
+static inline void unclaim(blockidx_t block)
+{
+    __atomic_fetch_and(&owned[block / 64], ~(1ull << (block % 64)),
+                       __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Claim the chain starting at `first` for `path`, following at most `max`
+ * blocks. If `run` is not 0, the chain has to consist of runs of `run`
+ * consecutive blocks (a run may be cut short by the end of the chain). If
+ * `share` is set, the chain belongs to a file, and may go on through blocks
+ * that are claimed already if they have a reference count.
+ *
+ * The chain stops at the first block that is out of range, free, already
+ * claimed or out of sequence, or after `max` blocks; with -r it is then cut
+ * there, or if no block was claimed the caller has to drop its reference to
+ * the chain. Returns the number of blocks that were claimed, and in `ret_last`
+ * the last of them (SFS_BLOCKIDX_END if none).
+ */
+static unsigned claim_chain(const char *path, const char *what,
+                            blockidx_t first, unsigned max, unsigned run,
+                            int share, blockidx_t *ret_last)
+{
+    blockidx_t prev = SFS_BLOCKIDX_END, b = first;
+    unsigned n = 0;
+    const char *err = NULL;
+
+    while (b != SFS_BLOCKIDX_END) {
+        if (n == max) {
+            err = "is longer than its file";
+            break;
+        }
+        if (b >= geom.nblocks) {
+            err = "points outside the data area";
+            break;
+        }
+        if (run && n % run && b != prev + 1) {
+            err = "is not contiguous";
+            break;
+        }
+        if (claim(b)) {
+            blockidx_t c = first;
+
+            /* The owner of a shared block checks it, and `max` ends the
+             * walk if the shared part is cyclic. */
+            if (share && refs && refs[b]) {
+                __atomic_fetch_add(&seen[b], 1, __ATOMIC_RELAXED);
+                prev = b;
+                b = block_table[b];
+                n++;
+                continue;
+            }
+
+            /* Cycles are rare, so only then walk the chain again. */
+            err = "is cross-linked with another chain";
+            for (unsigned i = 0; i < n && err; i++, c = block_table[c])
+                if (c == b)
+                    err = "is cyclic";
+            break;
+        }
+        /* Only read the table once the block is ours, as the chain that
+         * owns a block may be cut concurrently. */
+        if (block_table[b] == SFS_BLOCKIDX_EMPTY) {
+            unclaim(b);
+            err = "runs into a free block";
+            break;
+        }
+        prev = b;
+        b = block_table[b];
+        n++;
+    }
+
+    /* If nothing was claimed, the caller drops the reference instead. */
+    if (err) {
+        problem(path, opts.repair, "%s %s at block %u", what, err, b);
+        if (opts.repair && n)
+            blocktbl_set(prev, SFS_BLOCKIDX_END);
+    }
+    *ret_last = prev;
+    return n;
+}
+
+
+/* A directory to be checked, and the entry (if not the root) it belongs to. */
+struct fsck_task {
+    struct fsck_task *next;
+    char *path;
+    off_t entry_off;
+    struct sfs_entry entry;
+};
+
+static struct fsck_task *queue;
+static unsigned pending;            /* Queued and running tasks */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void task_push(struct fsck_task *t)
+{
+    pthread_mutex_lock(&queue_lock);
+    t->next = queue;
+    queue = t;
+    pending++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static char *path_join(const char *dir, const char *name)
+{
+    size_t n = strlen(dir) + strlen(name) + 2;
+    char *p = malloc(n);
+
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(FSCK_FAILED);
+    }
+    snprintf(p, n, "%s%s%s", dir, strcmp(dir, "/") ? "/" : "", name);
+    return p;
+}
+
+
+/* Check the blocks of the file of `entry` (at `off`), which is `path`. */
+static void check_file(const char *path, struct sfs_entry *entry, off_t off)
+{
+    struct sfs_entry orig = *entry;
+    size_t size = entry->size & SFS_SIZEMASK;
+    unsigned need = DIV_ROUND_UP(size, geom.block_size), have = 0;
+    blockidx_t first = entry_block(entry), last;
+
+    if (!(entry->size & SFS_EXTENTS)) {
+        if (first == SFS_BLOCKIDX_EMPTY)
+            first = SFS_BLOCKIDX_END;
+        have = claim_chain(path, "chain", first, need, 0, 1, &last);
+        if (have == 0)
+            entry_set_block(entry, SFS_BLOCKIDX_END);
+    } else {
+        unsigned per_block = geom.block_size / sizeof(struct sfs_extent);
+        blockidx_t lb = first;
+        unsigned nlist = claim_chain(path, "extent list", first, UINT32_MAX,
+                                     0, 0, &last);
+
+        /* The file keeps the extents up to the first one that is broken,
+         * which is cut to the blocks that are left of it. */
+        for (unsigned i = 0; i < nlist && have < need; i++) {
+            const struct sfs_extent *ext = disk_map(geom.block_size,
+                                                    block_off(lb));
+
+            for (unsigned j = 0; j < per_block && have < need; j++) {
+                struct sfs_extent e = ext[j];
+                unsigned len = e.len < need - have ? e.len : need - have;
+
+                if (e.len == 0)
+                    break;
+                e.len = claim_chain(path, "extent", e.start, len, len, 1,
+                                    &last);
+                have += e.len;
+                if (e.len == ext[j].len &&
+                        block_table[last] != SFS_BLOCKIDX_END) {
+                    problem(path, opts.repair,
+                            "extent continues past block %u", last);
+                    if (opts.repair)
+                        blocktbl_set(last, SFS_BLOCKIDX_END);
+                }
+                if (e.len != ext[j].len && opts.repair)
+                    disk_write(&e, sizeof(e),
+                               block_off(lb) + j * sizeof(e));
+                if (e.len < len) {
+                    i = nlist;
+                    break;
+                }
+            }
+            lb = block_table[lb];
+        }
+        if (nlist == 0)
+            entry_set_block(entry, SFS_BLOCKIDX_END);
+    }
+
+    if (have < need) {
+        problem(path, opts.repair, "%u of its %u blocks are missing",
+                need - have, need);
+        entry->size = (entry->size & ~SFS_SIZEMASK) |
+                      (uint32_t)have * geom.block_size;
+    }
+    if (opts.repair && memcmp(entry, &orig, sizeof(orig)) != 0)
+        entry_write(entry, off);
+}
+
+
+/* Check the entries of directory `t`, queueing its subdirectories. */
+static void check_dir(struct fsck_task *t)
+{
+    blockidx_t first = SFS_BLOCKIDX_END, last;
+    unsigned nblocks = 0, nsegs, nentries;
+    off_t *segs;
+    struct { uint32_t hash; off_t off; } *names;
+    unsigned nbuckets = 16;
+
+    if (t->entry_off < 0) {
+        /* The root directory: its region, then the chain at root_next. */
+        first = root_next;
+        nblocks = claim_chain(t->path, "root directory chain", first,
+                              UINT32_MAX, dir_seg_blocks, 0, &last);
+        if (nblocks == 0 && first != SFS_BLOCKIDX_END && opts.repair) {
+            root_next = SFS_BLOCKIDX_END;
+            disk_write(&root_next, sizeof(root_next), ROOT_NEXT_OFF);
+        }
+    } else {
+        first = entry_block(&t->entry);
+        nblocks = claim_chain(t->path, "directory chain", first,
+                              geom.version == 1 ? dir_seg_blocks : UINT32_MAX,
+                              dir_seg_blocks, 0, &last);
+        if (nblocks < dir_seg_blocks) {
+            /* Without its first segment, there is nothing left of it. */
+            problem(t->path, opts.repair, "directory has no valid blocks");
+            for (blockidx_t b = first; nblocks--; b++)
+                unclaim(b);
+            if (opts.repair)
+                entry_clear(t->entry_off);
+            return;
+        }
+    }
+
+    nsegs = nblocks / dir_seg_blocks + (t->entry_off < 0);
+    segs = malloc((nsegs + 1) * sizeof(*segs));
+    nentries = nblocks / dir_seg_blocks * dir_seg_nentries +
+               (t->entry_off < 0 ? geom.rootdir_nentries : 0);
+    while (nbuckets < 2 * nentries)
+        nbuckets *= 2;
+    names = calloc(nbuckets, sizeof(*names));
+    if (!segs || !names) {
+        fprintf(stderr, "Out of memory\n");
+        exit(FSCK_FAILED);
+    }
+
+    nsegs = 0;
+    last = SFS_BLOCKIDX_END;
+    if (t->entry_off < 0)
+        segs[nsegs++] = geom.rootdir_off;
+    for (blockidx_t b = first; nblocks >= dir_seg_blocks;
+         nblocks -= dir_seg_blocks) {
+        segs[nsegs++] = block_off(b);
+        for (unsigned i = 0; i < dir_seg_blocks; i++) {
+            last = b;
+            b = block_table[b];
+        }
+    }
+
+    /* Drop a segment that was cut short, which frees its blocks. */
+    if (nblocks) {
+        blockidx_t b = last < geom.nblocks ? block_table[last] : first;
+
+        problem(t->path, opts.repair, "directory segment is incomplete");
+        while (nblocks--)
+            unclaim(b++);
+        if (opts.repair && last < geom.nblocks) {
+            blocktbl_set(last, SFS_BLOCKIDX_END);
+        } else if (opts.repair) {
+            root_next = SFS_BLOCKIDX_END;
+            disk_write(&root_next, sizeof(root_next), ROOT_NEXT_OFF);
+        }
+    }
+
+    for (unsigned s = 0; s < nsegs; s++) {
+        unsigned n = s == 0 && t->entry_off < 0 ? geom.rootdir_nentries
+                                                : dir_seg_nentries;
+        const struct sfs_entry *entries = disk_map(n * SFS_ENTRY_SIZE,
+                                                   segs[s]);
+
+        for (unsigned i = 0; i < n; i++) {
+            struct sfs_entry entry = entries[i];
+            off_t off = segs[s] + (off_t)i * SFS_ENTRY_SIZE;
+            const char *bad = NULL;
+            uint32_t hash = 2166136261u;
+            unsigned bkt;
+            char *path;
+
+            if (entry.filename[0] == '\0')
+                continue;
+
+            if (!memchr(entry.filename, '\0', geom.filename_max))
+                bad = "name is not terminated";
+            else if (strchr(entry.filename, '/'))
+                bad = "name contains a '/'";
+            else if ((entry.size & SFS_EXTENTS) &&
+                     (geom.version == 1 || (entry.size & SFS_DIRECTORY)))
+                bad = "has invalid flags";
+            if (bad) {
+                problem(t->path, opts.repair, "entry %u of segment %u: %s",
+                        i, s, bad);
+                if (opts.repair)
+                    entry_clear(off);
+                continue;
+            }
+
+            /* Names are unique within a directory. */
+            for (const char *p = entry.filename; *p; p++)
+                hash = (hash ^ (unsigned char)*p) * 16777619u;
+            for (bkt = hash & (nbuckets - 1); names[bkt].off;
+                 bkt = (bkt + 1) & (nbuckets - 1)) {
+                const struct sfs_entry *other = disk_map(SFS_ENTRY_SIZE,
+                                                         names[bkt].off);
+
+                if (names[bkt].hash == hash &&
+                        strcmp(other->filename, entry.filename) == 0)
+                    break;
+            }
+            path = path_join(t->path, entry.filename);
+            if (names[bkt].off) {
+                problem(path, opts.repair, "duplicate entry");
+                if (opts.repair)
+                    entry_clear(off);
+                free(path);
+                continue;
+            }
+            names[bkt].hash = hash;
+            names[bkt].off = off;
+
+            if (entry.size & SFS_DIRECTORY) {
+                struct fsck_task *sub = malloc(sizeof(*sub));
+
+                if (!sub) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(FSCK_FAILED);
+                }
+                sub->path = path;
+                sub->entry_off = off;
+                sub->entry = entry;
+                task_push(sub);
+                __atomic_fetch_add(&ndirs, 1, __ATOMIC_RELAXED);
+            } else {
+                check_file(path, &entry, off);
+                free(path);
+                __atomic_fetch_add(&nfiles, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    free(segs);
+    free(names);
+}
+
+
+static void *worker(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        struct fsck_task *t;
+
+        pthread_mutex_lock(&queue_lock);
+        while (!queue && pending)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (!(t = queue)) {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        queue = t->next;
+        pthread_mutex_unlock(&queue_lock);
+
+        check_dir(t);
+        free(t->path);
+        free(t);
+
+        pthread_mutex_lock(&queue_lock);
+        if (--pending == 0)
+            pthread_cond_broadcast(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+
+static void load_metadata(void)
+{
+    size_t nwords = DIV_ROUND_UP((size_t)geom.nblocks, 64);
+
+    block_table = malloc(geom.nblocks * sizeof(blockidx_t));
+    owned = calloc(nwords, sizeof(uint64_t));
+    if (!block_table || !owned) {
+        fprintf(stderr, "Could not allocate metadata\n");
+        exit(FSCK_FAILED);
+    }
+
+    if (geom.version == 1) {
+        const uint16_t *v1 = disk_map(geom.nblocks * sizeof(uint16_t),
+                                      geom.blocktbl_off);
+
+        for (unsigned i = 0; i < geom.nblocks; i++)
+            block_table[i] = v1[i] >= SFS_V1_BLOCKIDX_END ? 0xffff0000u | v1[i]
+                                                          : v1[i];
+        dir_seg_nentries = SFS_DIR_NENTRIES;
+    } else {
+        disk_read(block_table, geom.nblocks * sizeof(blockidx_t),
+                  geom.blocktbl_off);
+        disk_read(&root_next, sizeof(root_next), ROOT_NEXT_OFF);
+        dir_seg_nentries = SFS_V2_DIR_NENTRIES(geom.block_size);
+    }
+    if (geom.refcnt_off) {
+        refs = malloc(geom.nblocks * sizeof(uint32_t));
+        seen = calloc(geom.nblocks, sizeof(uint32_t));
+        if (!refs || !seen) {
+            fprintf(stderr, "Could not allocate metadata\n");
+            exit(FSCK_FAILED);
+        }
+        disk_read(refs, geom.nblocks * sizeof(uint32_t), geom.refcnt_off);
+    }
+    dir_seg_blocks = DIV_ROUND_UP(dir_seg_nentries * SFS_ENTRY_SIZE,
+                                  geom.block_size);
+}
+
+
+/* Find the blocks that are in use, but were not claimed by any chain. */
+static void check_leaks(void)
+{
+    unsigned long nleaked = 0;
+
+    for (blockidx_t b = 0; b < geom.nblocks; b++) {
+        if (block_table[b] == SFS_BLOCKIDX_EMPTY ||
+                (owned[b / 64] >> (b % 64) & 1))
+            continue;
+        nleaked++;
+        if (opts.repair)
+            blocktbl_set(b, SFS_BLOCKIDX_EMPTY);
+    }
+    if (nleaked)
+        problem(opts.img, opts.repair, "%lu blocks are in use but not part "
+                "of any file", nleaked);
+}
+
+
+/* Check that every block is shared by as many files as its reference count
+ * says: once by its owner, and once more per count. */
+static void check_refs(void)
+{
+    unsigned long nwrong = 0;
+
+    for (blockidx_t b = 0; refs && b < geom.nblocks; b++) {
+        uint32_t want = owned[b / 64] >> (b % 64) & 1 ? seen[b] : 0;
+
+        if (refs[b] == want)
+            continue;
+        nwrong++;
+        if (opts.repair) {
+            refs[b] = want;
+            disk_write(&want, sizeof(want),
+                       geom.refcnt_off + (off_t)b * sizeof(want));
+        }
+    }
+    if (nwrong)
+        problem(opts.img, opts.repair, "%lu blocks have wrong reference "
+                "counts", nwrong);
+}
+
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options] IMAGE\n\n"
+           "Checks the consistency of an image.\n\n"
+           "    -r          replay the journal, and repair the problems that\n"
+           "                are found\n"
+           "    -j N        number of threads (default: number of CPUs)\n"
+           "    -q          only print problems\n",
+           progname);
+}
+
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[FSCK_MAX_THREADS];
+    struct fsck_task *root;
+    unsigned long used = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned ntxns;
+    int c;
+
+    opts.nthreads = ncpus > 0 ? ncpus : 1;
+    while ((c = getopt(argc, argv, "rj:qh")) != -1) {
+        switch (c) {
+        case 'r': opts.repair = 1; break;
+        case 'j': opts.nthreads = strtoul(optarg, NULL, 0); break;
+        case 'q': opts.quiet = 1; break;
+        case 'h': usage(argv[0]); return FSCK_OK;
+        default: usage(argv[0]); return FSCK_FAILED;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_FAILED;
+    }
+    opts.img = argv[optind];
+    if (opts.nthreads == 0)
+        opts.nthreads = 1;
+    if (opts.nthreads > FSCK_MAX_THREADS)
+        opts.nthreads = FSCK_MAX_THREADS;
+
+    if (opts.repair)
+        disk_open_image(opts.img, DISK_MODE_MMAP);
+    else if ((ntxns = disk_open_image_pending(opts.img, DISK_MODE_MMAP)))
+        problem(opts.img, 0, "journal holds %u transactions that are not "
+                "in the image yet", ntxns);
+    disk_get_geometry(&geom);
+    load_metadata();
+
+    root = calloc(1, sizeof(*root));
+    if (!root || !(root->path = strdup("/"))) {
+        fprintf(stderr, "Out of memory\n");
+        return FSCK_FAILED;
+    }
+    root->entry_off = -1;
+    task_push(root);
+
+    for (unsigned i = 0; i < opts.nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    for (unsigned i = 0; i < opts.nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    check_leaks();
+    check_refs();
+    if (opts.repair)
+        disk_sync();
+
+    for (size_t i = 0; i < DIV_ROUND_UP((size_t)geom.nblocks, 64); i++)
+        used += __builtin_popcountll(owned[i]);
+    if (!opts.quiet)
+        printf("%s: %lu directories, %lu files, %lu of %u blocks used, "
+               "%lu problems (%lu fixed)\n", opts.img, ndirs, nfiles, used,
+               geom.nblocks, nerrors, nfixed);
+
+    if (nerrors == 0)
+        return FSCK_OK;
+    return nfixed == nerrors ? FSCK_REPAIRED : FSCK_ERRORS;
+}
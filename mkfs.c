@@ -0,0 +1,212 @@
+/*
+ * Creation of empty version 2 images (see struct sfs_superblock), whose
+ * geometry is chosen at creation time. The images are sparse, so a multi-GB
+ * image only takes up the space of its metadata until it is filled.
+ *
+ * Build with `make -f tools.mk mkfs`. Version 1 images are still made with
+ * mkfs.sfs.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "diskio.h"
+#include "sfs.h"
+
+
+#define MKFS_DEFAULT_BLOCK_SIZE 4096u
+#define MKFS_DEFAULT_SIZE       (1ull << 30)
+
+struct mkfs_opts {
+    const char *img;
+    uint32_t block_size;
+    uint64_t size;          /* Of the data area, in bytes */
+    uint32_t nblocks;       /* Overrides size if set */
+    uint32_t rootdir_nentries;
+    int quiet;
+};
+
+
+/* Parse a size with an optional K, M, G or T suffix. Returns 0 if invalid. */
+static uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t n = strtoull(s, &end, 0);
+    unsigned shift = 0;
+
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+    }
+    if (*end || n > UINT64_MAX >> shift)
+        return 0;
+    return n << shift;
+}
+
+
+static void mkfs_layout(const struct mkfs_opts *o, struct sfs_superblock *sb)
+{
+    uint64_t nblocks = o->nblocks ? o->nblocks : o->size / o->block_size;
+    uint64_t end;
+
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->magic, SFS_SB_MAGIC, sizeof(sb->magic));
+    sb->version = SFS_VERSION;
+    sb->block_size = o->block_size;
+    sb->nblocks = nblocks > SFS_V2_NBLOCKS_MAX ? 0 : nblocks;
+    sb->rootdir_nentries = o->rootdir_nentries;
+    sb->rootdir_off = SFS_V2_ROOTDIR_OFF;
+    sb->blocktbl_off = sb->rootdir_off +
+                       (uint64_t)sb->rootdir_nentries * SFS_ENTRY_SIZE;
+
+    /* Keep the data blocks aligned to the block size on the host too. */
+    sb->refcnt_off = sb->blocktbl_off +
+                     (uint64_t)sb->nblocks * sizeof(uint32_t);
+    end = sb->refcnt_off + (uint64_t)sb->nblocks * sizeof(uint32_t);
+    sb->data_off = (end + o->block_size - 1) / o->block_size * o->block_size;
+    sb->rootdir_next = SFS_BLOCKIDX_END;
+}
+
+
+static int write_all(int fd, const void *buf, size_t size, off_t offset)
+{
+    const char *p = buf;
+
+    while (size) {
+        ssize_t n = pwrite(fd, p, size, offset);
+
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+
+/* Write the metadata of an empty file system. Returns 0 on success, < 0 on
+ * error. */
+static int mkfs_write(int fd, const struct sfs_superblock *sb)
+{
+    uint64_t size = sb->data_off + (uint64_t)sb->nblocks * sb->block_size;
+    struct sfs_entry empty = { .first_block = (uint16_t)SFS_BLOCKIDX_EMPTY };
+    uint16_t hi = SFS_BLOCKIDX_EMPTY >> 16;
+    struct sfs_entry *root;
+    uint32_t *tbl;
+    size_t tbl_n = 64 * 1024;
+    int res = 0;
+
+    memcpy(&empty.filename[SFS_V2_FILENAME_MAX], &hi, sizeof(hi));
+
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)
+        return -1;
+    if (write_all(fd, sfs_magic, SFS_MAGIC_SIZE, 0) ||
+            write_all(fd, sb, sizeof(*sb), SFS_SB_OFF))
+        return -1;
+
+    root = malloc(sb->rootdir_nentries * sizeof(struct sfs_entry));
+    tbl = malloc(tbl_n * sizeof(uint32_t));
+    if (!root || !tbl) {
+        fprintf(stderr, "Could not allocate metadata buffers\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < sb->rootdir_nentries; i++)
+        root[i] = empty;
+    for (size_t i = 0; i < tbl_n; i++)
+        tbl[i] = SFS_BLOCKIDX_EMPTY;
+
+    if (write_all(fd, root, sb->rootdir_nentries * sizeof(struct sfs_entry),
+                  sb->rootdir_off))
+        res = -1;
+    for (uint64_t i = 0; !res && i < sb->nblocks; i += tbl_n) {
+        size_t n = sb->nblocks - i < tbl_n ? sb->nblocks - i : tbl_n;
+
+        if (write_all(fd, tbl, n * sizeof(uint32_t),
+                      sb->blocktbl_off + i * sizeof(uint32_t)))
+            res = -1;
+    }
+
+    /* The reference counts are all 0, as the image already reads. */
+    free(root);
+    free(tbl);
+    return res ? res : fsync(fd);
+}
+
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options] IMAGE\n\n"
+           "Creates an empty version 2 image.\n\n"
+           "    -b BYTES    block size, a power of two from %u to %u "
+           "(default: %u)\n"
+           "    -s SIZE     size of the data area, with an optional K, M, G "
+           "or T suffix\n"
+           "                (default: 1G)\n"
+           "    -n N        number of blocks (overrides -s)\n"
+           "    -r N        initial root directory entries (default: %u)\n"
+           "    -q          do not print the resulting geometry\n",
+           progname, SFS_BLOCK_SIZE_MIN, SFS_BLOCK_SIZE_MAX,
+           MKFS_DEFAULT_BLOCK_SIZE, SFS_ROOTDIR_NENTRIES);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct mkfs_opts o = {
+        .block_size = MKFS_DEFAULT_BLOCK_SIZE,
+        .size = MKFS_DEFAULT_SIZE,
+        .rootdir_nentries = SFS_ROOTDIR_NENTRIES,
+    };
+    struct sfs_superblock sb;
+    const char *err;
+    int c, fd;
+
+    while ((c = getopt(argc, argv, "b:s:n:r:qh")) != -1) {
+        switch (c) {
+        case 'b': o.block_size = strtoul(optarg, NULL, 0); break;
+        case 's': o.size = parse_size(optarg); break;
+        case 'n': o.nblocks = strtoul(optarg, NULL, 0); break;
+        case 'r': o.rootdir_nentries = strtoul(optarg, NULL, 0); break;
+        case 'q': o.quiet = 1; break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    o.img = argv[optind];
+
+    mkfs_layout(&o, &sb);
+    if ((err = disk_check_superblock(&sb))) {
+        fprintf(stderr, "Invalid geometry: %s\n", err);
+        return 1;
+    }
+
+    fd = open(o.img, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror(o.img);
+        return 1;
+    }
+    if (mkfs_write(fd, &sb) < 0) {
+        perror(o.img);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    if (!o.quiet)
+        printf("%s: %u blocks of %u bytes, %u root entries, "
+               "data at offset %llu\n", o.img, sb.nblocks, sb.block_size,
+               sb.rootdir_nentries, (unsigned long long)sb.data_off);
+    return 0;
+}
@@ -0,0 +1,613 @@
+/*
+ * Offline builder of images with the contents of a directory tree on the host,
+ * without going through FUSE. The tree is scanned first, so that the whole
+ * image can be laid out in memory: the blocks of all directories (and extent
+ * lists) come first, followed by the data of every file in one contiguous run
+ * of blocks. The metadata is then written once, and the file data is copied
+ * into place with copy_file_range where the kernel supports it.
+ *
+ * Build with `make -f tools.mk pack`. Both version 1 images (-1) and version 2
+ * images, with a geometry chosen as with sfs-mkfs, can be built.
+ */
+#define _GNU_SOURCE         /* copy_file_range */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "diskio.h"
+#include "sfs.h"
+
+
+#define PACK_DEFAULT_BLOCK_SIZE 4096u
+#define PACK_DEFAULT_SIZE       (1ull << 30)
+
+/* Reserved in the root directory by the statistics files of sfs. */
+#define PACK_STATS_NAME         ".sfs_stats"
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+struct pack_opts {
+    const char *src;
+    const char *img;
+    int v1;
+    uint32_t block_size;
+    uint64_t size;          /* Of the data area, in bytes (0: large enough) */
+    uint32_t nblocks;       /* Overrides size if set */
+    uint32_t rootdir_nentries;
+    int extents;
+    int quiet;
+};
+
+/* A file or directory of the tree being packed. */
+struct pack_node {
+    char *path;                 /* On the host */
+    const char *name;           /* Within path */
+    int is_dir;
+    uint64_t size;              /* Of a file */
+    struct pack_node **children;
+    unsigned nchildren, children_cap;
+    blockidx_t first_block;     /* Of the entry (chain or extent list) */
+    blockidx_t data;            /* First data block of a file */
+    unsigned nsegs;             /* Segments of a directory (root: extra) */
+};
+
+static struct pack_opts opts;
+static struct sfs_geom geom;
+
+static unsigned dir_seg_nentries, dir_seg_blocks;
+static uint32_t nblocks_used;
+static unsigned long ndirs, nfiles;
+
+static blockidx_t *block_table;
+static char *meta;          /* Directory segments and extent lists */
+static uint32_t meta_blocks;
+
+
+static void __attribute__((noreturn, format(printf, 1, 2)))
+fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (!p)
+        fail("Out of memory");
+    return p;
+}
+
+
+/* Parse a size with an optional K, M, G or T suffix. Returns 0 if invalid. */
+static uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t n = strtoull(s, &end, 0);
+    unsigned shift = 0;
+
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+    }
+    if (*end || n > UINT64_MAX >> shift)
+        return 0;
+    return n << shift;
+}
+
+
+static int node_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct pack_node *const *)a)->name,
+                  (*(struct pack_node *const *)b)->name);
+}
+
+/* Add the contents of the host directory of `dir` to it, recursively. Names
+ * are sorted, so that images of the same tree are identical. */
+static void scan_dir(struct pack_node *dir, int is_root)
+{
+    DIR *d = opendir(dir->path);
+    struct dirent *de;
+
+    if (!d)
+        fail("%s: %s", dir->path, strerror(errno));
+
+    while ((de = readdir(d))) {
+        size_t plen = strlen(dir->path), nlen = strlen(de->d_name);
+        struct pack_node *n;
+        struct stat st;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        n = xmalloc(sizeof(*n));
+        memset(n, 0, sizeof(*n));
+        n->path = xmalloc(plen + nlen + 2);
+        memcpy(n->path, dir->path, plen);
+        n->path[plen] = '/';
+        memcpy(n->path + plen + 1, de->d_name, nlen + 1);
+        n->name = n->path + plen + 1;
+
+        if (lstat(n->path, &st) == -1)
+            fail("%s: %s", n->path, strerror(errno));
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "%s: not a regular file or directory, skipped\n",
+                    n->path);
+            free(n->path);
+            free(n);
+            continue;
+        }
+        if (is_root && strcmp(n->name, PACK_STATS_NAME) == 0)
+            fail("%s: name is reserved in the root directory", n->path);
+        if (nlen >= geom.filename_max)
+            fail("%s: name is longer than %u bytes", n->path,
+                 geom.filename_max - 1);
+
+        n->is_dir = S_ISDIR(st.st_mode);
+        if (!n->is_dir && (uint64_t)st.st_size > SFS_SIZEMASK)
+            fail("%s: file is larger than %u bytes", n->path, SFS_SIZEMASK);
+        n->size = n->is_dir ? 0 : st.st_size;
+
+        if (dir->nchildren == dir->children_cap) {
+            dir->children_cap = dir->children_cap ? dir->children_cap * 2 : 16;
+            dir->children = realloc(dir->children,
+                                    dir->children_cap * sizeof(n));
+            if (!dir->children)
+                fail("Out of memory");
+        }
+        dir->children[dir->nchildren++] = n;
+    }
+    closedir(d);
+
+    qsort(dir->children, dir->nchildren, sizeof(*dir->children), node_cmp);
+    for (unsigned i = 0; i < dir->nchildren; i++) {
+        if (dir->children[i]->is_dir) {
+            ndirs++;
+            scan_dir(dir->children[i], 0);
+        } else {
+            nfiles++;
+        }
+    }
+}
+
+
+/* Reserve the next `n` blocks as one ascending chain. */
+static blockidx_t alloc_run(uint32_t n)
+{
+    blockidx_t first = nblocks_used;
+
+    nblocks_used += n;
+    return first;
+}
+
+/* Number of blocks needed by `dir` itself: its segments, and the extent lists
+ * of its files. Also sets dir->nsegs. */
+static uint32_t dir_meta_blocks(struct pack_node *dir, int is_root)
+{
+    uint32_t n = 0, in_dir = is_root ? geom.rootdir_nentries : 0;
+
+    if (dir->nchildren > in_dir)
+        dir->nsegs = DIV_ROUND_UP(dir->nchildren - in_dir, dir_seg_nentries);
+    if (!is_root && dir->nsegs == 0)
+        dir->nsegs = 1;
+    n += dir->nsegs * dir_seg_blocks;
+
+    for (unsigned i = 0; opts.extents && i < dir->nchildren; i++)
+        if (!dir->children[i]->is_dir && dir->children[i]->size)
+            n++;
+    return n;
+}
+
+/* Lay out the blocks of the directories and extent lists under `dir`, in the
+ * same (depth-first) order as their data will be. */
+static void layout_meta(struct pack_node *dir, int is_root)
+{
+    uint32_t n = dir_meta_blocks(dir, is_root);
+    blockidx_t b;
+
+    if (geom.version == 1 && !is_root && dir->nsegs > 1)
+        fail("%s: more than %u entries in a directory", dir->path,
+             SFS_DIR_NENTRIES);
+    if (geom.version == 1 && is_root && dir->nsegs)
+        fail("%s: more than %u entries in the root directory", dir->path,
+             SFS_ROOTDIR_NENTRIES);
+    if ((uint64_t)nblocks_used + n > geom.nblocks)
+        fail("%s: the tree does not fit in %u blocks", opts.src,
+             geom.nblocks);
+
+    b = alloc_run(n);
+    dir->first_block = dir->nsegs ? b : SFS_BLOCKIDX_END;
+    b += dir->nsegs * dir_seg_blocks;
+    for (unsigned i = 0; opts.extents && i < dir->nchildren; i++)
+        if (!dir->children[i]->is_dir && dir->children[i]->size)
+            dir->children[i]->first_block = b++;
+
+    for (unsigned i = 0; i < dir->nchildren; i++)
+        if (dir->children[i]->is_dir)
+            layout_meta(dir->children[i], 0);
+}
+
+/* Lay out the data of the files under `dir`, one contiguous run each. */
+static void layout_data(struct pack_node *dir)
+{
+    for (unsigned i = 0; i < dir->nchildren; i++) {
+        struct pack_node *n = dir->children[i];
+        uint32_t len = DIV_ROUND_UP(n->size, geom.block_size);
+
+        if (n->is_dir) {
+            layout_data(n);
+            continue;
+        }
+        if ((uint64_t)nblocks_used + len > geom.nblocks)
+            fail("%s: the tree does not fit in %u blocks", opts.src,
+                 geom.nblocks);
+        n->data = len ? alloc_run(len) : SFS_BLOCKIDX_END;
+        if (!opts.extents || !len)
+            n->first_block = n->data;
+    }
+}
+
+
+/* Chain blocks [first, first + n) in ascending order. */
+static void chain_run(blockidx_t first, uint32_t n)
+{
+    for (uint32_t i = 0; i + 1 < n; i++)
+        block_table[first + i] = first + i + 1;
+    if (n)
+        block_table[first + n - 1] = SFS_BLOCKIDX_END;
+}
+
+static void entry_set_block(struct sfs_entry *entry, blockidx_t block)
+{
+    uint16_t hi = block >> 16;
+
+    entry->first_block = (uint16_t)block;
+    if (geom.version != 1)
+        memcpy(&entry->filename[SFS_V2_FILENAME_MAX], &hi, sizeof(hi));
+}
+
+static void *meta_block(blockidx_t block)
+{
+    return meta + (size_t)block * geom.block_size;
+}
+
+/* Fill in the entries, segments, extent lists and block table for the tree
+ * under `dir`, whose first `in_dir` entries go to `root` (the root directory
+ * entries, or NULL). */
+static void fill_dir(struct pack_node *dir, struct sfs_entry *root,
+                     unsigned in_dir)
+{
+    chain_run(dir->first_block, dir->nsegs * dir_seg_blocks);
+
+    for (unsigned i = 0; i < dir->nchildren; i++) {
+        struct pack_node *n = dir->children[i];
+        struct sfs_entry *entry;
+
+        if (i < in_dir)
+            entry = &root[i];
+        else
+            entry = (struct sfs_entry *)meta_block(dir->first_block) +
+                    (i - in_dir);
+
+        strcpy(entry->filename, n->name);
+        entry_set_block(entry, n->first_block);
+        if (n->is_dir) {
+            entry->size = SFS_DIRECTORY;
+            fill_dir(n, NULL, 0);
+            continue;
+        }
+
+        entry->size = n->size | (opts.extents ? SFS_EXTENTS : 0);
+        if (n->data != SFS_BLOCKIDX_END) {
+            uint32_t len = DIV_ROUND_UP(n->size, geom.block_size);
+
+            chain_run(n->data, len);
+            if (opts.extents) {
+                struct sfs_extent *ext = meta_block(n->first_block);
+
+                /* The rest of the list is empty, which ends it. */
+                memset(ext, 0, geom.block_size);
+                ext->start = n->data;
+                ext->len = len;
+                chain_run(n->first_block, 1);
+            }
+        }
+    }
+}
+
+
+static void write_all(int fd, const void *buf, size_t size, off_t offset)
+{
+    const char *p = buf;
+
+    while (size) {
+        ssize_t n = pwrite(fd, p, size, offset);
+
+        if (n <= 0)
+            fail("%s: %s", opts.img, n ? strerror(errno) : "short write");
+        p += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+/* Copy the data of file `n` to its blocks on the image. */
+static void copy_data(int img, const struct pack_node *n)
+{
+    static char *buf;
+    static const size_t buf_size = 1 << 20;
+    static int no_copy_range;
+    off_t out = geom.data_off + (off_t)n->data * geom.block_size;
+    uint64_t left = n->size;
+    int fd = open(n->path, O_RDONLY);
+
+    if (fd == -1)
+        fail("%s: %s", n->path, strerror(errno));
+
+    while (left && !no_copy_range) {
+        ssize_t r = copy_file_range(fd, NULL, img, &out, left, 0);
+
+        if (r == -1 && (errno == ENOSYS || errno == EXDEV ||
+                        errno == EINVAL || errno == EOPNOTSUPP)) {
+            no_copy_range = 1;
+            break;
+        }
+        if (r <= 0)
+            fail("%s: %s", n->path, r ? strerror(errno)
+                                      : "file shrank while packing");
+        left -= r;
+    }
+
+    if (left && !buf)
+        buf = xmalloc(buf_size);
+    while (left) {
+        ssize_t r = pread(fd, buf, left < buf_size ? left : buf_size,
+                          n->size - left);
+
+        if (r <= 0)
+            fail("%s: %s", n->path, r ? strerror(errno)
+                                      : "file shrank while packing");
+        write_all(img, buf, r, out);
+        out += r;
+        left -= r;
+    }
+    close(fd);
+}
+
+static void copy_tree(int img, const struct pack_node *dir)
+{
+    for (unsigned i = 0; i < dir->nchildren; i++) {
+        if (dir->children[i]->is_dir)
+            copy_tree(img, dir->children[i]);
+        else if (dir->children[i]->size)
+            copy_data(img, dir->children[i]);
+    }
+}
+
+
+/* Set up the geometry (and for version 2 the superblock `sb`) of the image,
+ * which has to hold at least `need` data blocks. */
+static void pack_layout(struct sfs_superblock *sb, uint64_t need)
+{
+    const char *err;
+    uint64_t nblocks, end;
+
+    if (opts.v1) {
+        geom = (struct sfs_geom){
+            .version = 1,
+            .block_size = SFS_BLOCK_SIZE,
+            .nblocks = SFS_BLOCKTBL_NENTRIES,
+            .rootdir_nentries = SFS_ROOTDIR_NENTRIES,
+            .rootdir_off = SFS_ROOTDIR_OFF,
+            .blocktbl_off = SFS_BLOCKTBL_OFF,
+            .data_off = SFS_DATA_OFF,
+            .blockidx_size = sizeof(uint16_t),
+            .filename_max = SFS_FILENAME_MAX,
+        };
+        dir_seg_nentries = SFS_DIR_NENTRIES;
+        dir_seg_blocks = SFS_DIR_SIZE / SFS_BLOCK_SIZE;
+        return;
+    }
+
+    nblocks = opts.nblocks ? opts.nblocks : opts.size / opts.block_size;
+    if (!opts.nblocks && !opts.size)
+        nblocks = need > PACK_DEFAULT_SIZE / opts.block_size
+                  ? need : PACK_DEFAULT_SIZE / opts.block_size;
+
+    memset(sb, 0, sizeof(*sb));
+    memcpy(sb->magic, SFS_SB_MAGIC, sizeof(sb->magic));
+    sb->version = SFS_VERSION;
+    sb->block_size = opts.block_size;
+    sb->nblocks = nblocks > SFS_V2_NBLOCKS_MAX ? 0 : nblocks;
+    sb->rootdir_nentries = opts.rootdir_nentries;
+    sb->rootdir_off = SFS_V2_ROOTDIR_OFF;
+    sb->blocktbl_off = sb->rootdir_off +
+                       (uint64_t)sb->rootdir_nentries * SFS_ENTRY_SIZE;
+    sb->refcnt_off = sb->blocktbl_off +
+                     (uint64_t)sb->nblocks * sizeof(uint32_t);
+    end = sb->refcnt_off + (uint64_t)sb->nblocks * sizeof(uint32_t);
+    sb->data_off = (end + opts.block_size - 1) / opts.block_size *
+                   opts.block_size;
+    sb->rootdir_next = SFS_BLOCKIDX_END;
+    if ((err = disk_check_superblock(sb)))
+        fail("Invalid geometry: %s", err);
+
+    geom = (struct sfs_geom){
+        .version = SFS_VERSION,
+        .block_size = sb->block_size,
+        .nblocks = sb->nblocks,
+        .rootdir_nentries = sb->rootdir_nentries,
+        .rootdir_off = sb->rootdir_off,
+        .blocktbl_off = sb->blocktbl_off,
+        .data_off = sb->data_off,
+        .refcnt_off = sb->refcnt_off,
+        .blockidx_size = sizeof(uint32_t),
+        .filename_max = SFS_V2_FILENAME_MAX,
+    };
+    dir_seg_nentries = SFS_V2_DIR_NENTRIES(geom.block_size);
+    dir_seg_blocks = dir_seg_nentries * SFS_ENTRY_SIZE / geom.block_size;
+}
+
+/* Count the blocks the tree under `dir` needs, for sizing the image. */
+static uint64_t tree_blocks(struct pack_node *dir, int is_root)
+{
+    uint64_t n = dir_meta_blocks(dir, is_root);
+
+    for (unsigned i = 0; i < dir->nchildren; i++) {
+        if (dir->children[i]->is_dir)
+            n += tree_blocks(dir->children[i], 0);
+        else
+            n += DIV_ROUND_UP(dir->children[i]->size, geom.block_size);
+    }
+    return n;
+}
+
+
+/* Write the image: first all of its metadata, then the file data. */
+static void pack_write(struct pack_node *root, const struct sfs_superblock *sb)
+{
+    struct sfs_entry empty, *rootdir;
+    uint64_t size = geom.data_off + (uint64_t)geom.nblocks * geom.block_size;
+    size_t tbl_size = (size_t)geom.nblocks * geom.blockidx_size;
+    int fd;
+
+    memset(&empty, 0, sizeof(empty));
+    entry_set_block(&empty, SFS_BLOCKIDX_EMPTY);
+
+    rootdir = xmalloc(geom.rootdir_nentries * sizeof(*rootdir));
+    for (uint32_t i = 0; i < geom.rootdir_nentries; i++)
+        rootdir[i] = empty;
+    meta = xmalloc((size_t)meta_blocks * geom.block_size);
+    for (size_t i = 0; i < (size_t)meta_blocks * geom.block_size /
+                           sizeof(empty); i++)
+        ((struct sfs_entry *)meta)[i] = empty;
+    block_table = xmalloc((size_t)geom.nblocks * sizeof(blockidx_t));
+    for (uint32_t i = 0; i < geom.nblocks; i++)
+        block_table[i] = SFS_BLOCKIDX_EMPTY;
+
+    fill_dir(root, rootdir, geom.rootdir_nentries);
+
+    /* Version 1 images have 16-bit block indices; narrow them in place. */
+    if (geom.version == 1)
+        for (uint32_t i = 0; i < geom.nblocks; i++)
+            ((uint16_t *)block_table)[i] = (uint16_t)block_table[i];
+
+    fd = open(opts.img, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+        fail("%s: %s", opts.img, strerror(errno));
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)
+        fail("%s: %s", opts.img, strerror(errno));
+
+    write_all(fd, sfs_magic, SFS_MAGIC_SIZE, 0);
+    if (geom.version != 1) {
+        struct sfs_superblock s = *sb;
+
+        if (root->nsegs)
+            s.rootdir_next = root->first_block;
+        write_all(fd, &s, sizeof(s), SFS_SB_OFF);
+    }
+    write_all(fd, rootdir, geom.rootdir_nentries * sizeof(*rootdir),
+              geom.rootdir_off);
+    write_all(fd, block_table, tbl_size, geom.blocktbl_off);
+    /* Nothing is shared yet, so the reference counts stay 0. */
+    write_all(fd, meta, (size_t)meta_blocks * geom.block_size,
+              geom.data_off);
+    copy_tree(fd, root);
+
+    if (fsync(fd) == -1)
+        fail("%s: %s", opts.img, strerror(errno));
+    close(fd);
+    free(rootdir);
+}
+
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options] DIR IMAGE\n\n"
+           "Creates an image with the contents of directory DIR.\n\n"
+           "    -1          create a version 1 image (ignores -b, -s, -n "
+           "and -r)\n"
+           "    -b BYTES    block size, a power of two from %u to %u "
+           "(default: %u)\n"
+           "    -s SIZE     size of the data area, with an optional K, M, G "
+           "or T suffix\n"
+           "                (default: 1G, or what the tree needs if more)\n"
+           "    -n N        number of blocks (overrides -s)\n"
+           "    -r N        initial root directory entries (default: %u)\n"
+           "    -e          map files by extents (version 2 only)\n"
+           "    -q          do not print a summary\n",
+           progname, SFS_BLOCK_SIZE_MIN, SFS_BLOCK_SIZE_MAX,
+           PACK_DEFAULT_BLOCK_SIZE, SFS_ROOTDIR_NENTRIES);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct pack_node root;
+    struct sfs_superblock sb;
+    int c;
+
+    opts.block_size = PACK_DEFAULT_BLOCK_SIZE;
+    opts.rootdir_nentries = SFS_ROOTDIR_NENTRIES;
+    while ((c = getopt(argc, argv, "1b:s:n:r:eqh")) != -1) {
+        switch (c) {
+        case '1': opts.v1 = 1; break;
+        case 'b': opts.block_size = strtoul(optarg, NULL, 0); break;
+        case 's':
+            if (!(opts.size = parse_size(optarg)))
+                fail("Invalid size: %s", optarg);
+            break;
+        case 'n': opts.nblocks = strtoul(optarg, NULL, 0); break;
+        case 'r': opts.rootdir_nentries = strtoul(optarg, NULL, 0); break;
+        case 'e': opts.extents = 1; break;
+        case 'q': opts.quiet = 1; break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    opts.src = argv[optind];
+    opts.img = argv[optind + 1];
+    if (opts.v1 && opts.extents)
+        fail("Extents need a version 2 image");
+
+    /* The geometry is needed for the name limits while scanning, and the
+     * size of the tree for the geometry, so lay out v2 images twice. */
+    memset(&root, 0, sizeof(root));
+    root.path = (char *)opts.src;
+    root.is_dir = 1;
+    pack_layout(&sb, 0);
+    scan_dir(&root, 1);
+    if (!opts.v1)
+        pack_layout(&sb, tree_blocks(&root, 1));
+
+    layout_meta(&root, 1);
+    meta_blocks = nblocks_used;
+    layout_data(&root);
+    pack_write(&root, &sb);
+
+    if (!opts.quiet)
+        printf("%s: %lu directories, %lu files, %u of %u blocks used\n",
+               opts.img, ndirs, nfiles, nblocks_used, geom.nblocks);
+    return 0;
+}
@@ -0,0 +1,572 @@
+/*
+ * Replay of a workload recorded with `sfs --record=FILE`: the operations of
+ * the trace are issued again through the same sfs_oper handlers the mount
+ * uses, on an image that should be a copy of the one recorded on, as it was
+ * when recording started (the replay modifies it).
+ *
+ * For each op it prints one line of JSON with the latency percentiles of the
+ * replay. Given the output of an earlier replay (say, of another build) with
+ * -b, it adds those and the change, so two builds can be compared on the same
+ * workload.
+ *
+ * Build with `make -f tools.mk replay` (optimized, without ASan).
+ */
+#define main sfs_main
+#include "sfs.c"
+#undef main
+
+#include <getopt.h>
+
+
+#define REPLAY_SKIPPED UINT64_MAX
+
+struct replay_opts {
+    const char *trace;
+    const char *img;
+    const char *base;
+    int threads;
+};
+
+/* An open file of the replay, by the handle it had in the recording. */
+struct replay_handle {
+    uint64_t fh;
+    struct fuse_file_info fi;
+};
+
+/* The records one thread replays, in order. */
+struct replay_thread {
+    pthread_t thread;
+    size_t n;
+    size_t *idx;
+};
+
+/* A line of a baseline (-b) file. */
+struct replay_base {
+    char op[TRACE_NAME_LEN];
+    double p50_us;
+    double p99_us;
+};
+
+static struct trace_ent *ents;
+static uint64_t *lat_ns;
+static int *mismatch;
+static char *replay_buf;
+static size_t replay_buf_size;
+static uint64_t trace_first, replay_epoch;
+static int replay_paced;
+
+static struct replay_handle **handles;
+static size_t nhandles, handles_cap;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "replay: %s failed\n", what);
+        exit(1);
+    }
+}
+
+
+/* The handle of the replay for recorded handle `fh`, or NULL. Called with
+ * handles_lock held; sets `*pos` to its position in handles[]. */
+static struct replay_handle *handle_find(uint64_t fh, size_t *pos)
+{
+    for (size_t i = 0; i < nhandles; i++) {
+        if (handles[i]->fh == fh) {
+            *pos = i;
+            return handles[i];
+        }
+    }
+    return NULL;
+}
+
+
+static struct replay_handle *handle_get(uint64_t fh)
+{
+    struct replay_handle *h;
+    size_t pos;
+
+    pthread_mutex_lock(&handles_lock);
+    h = fh ? handle_find(fh, &pos) : NULL;
+    pthread_mutex_unlock(&handles_lock);
+    return h;
+}
+
+
+static struct replay_handle *handle_add(uint64_t fh,
+                                        const struct fuse_file_info *fi)
+{
+    struct replay_handle *h = malloc(sizeof(*h));
+
+    check(h != NULL, "allocating a handle");
+    h->fh = fh;
+    h->fi = *fi;
+
+    pthread_mutex_lock(&handles_lock);
+    if (nhandles == handles_cap) {
+        handles_cap = handles_cap ? handles_cap * 2 : 64;
+        handles = realloc(handles, handles_cap * sizeof(*handles));
+        check(handles != NULL, "allocating handles");
+    }
+    handles[nhandles++] = h;
+    pthread_mutex_unlock(&handles_lock);
+    return h;
+}
+
+
+/* Forget recorded handle `fh`; the caller frees what is returned. */
+static struct replay_handle *handle_remove(uint64_t fh)
+{
+    struct replay_handle *h;
+    size_t pos;
+
+    pthread_mutex_lock(&handles_lock);
+    if (fh && (h = handle_find(fh, &pos)))
+        handles[pos] = handles[--nhandles];
+    else
+        h = NULL;
+    pthread_mutex_unlock(&handles_lock);
+    return h;
+}
+
+
+/* The handle to use for a record on the file at `path` with recorded handle
+ * `fh`. A file that was opened before recording started is opened here (not
+ * timed), and that handle is used from then on. */
+static struct fuse_file_info *handle_for(const char *path, uint64_t fh)
+{
+    struct replay_handle *h = handle_get(fh);
+    struct fuse_file_info fi;
+
+    if (h || !fh)
+        return h ? &h->fi : NULL;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+    if (sfs_oper.open(path, &fi) != 0)
+        return NULL;
+    return &handle_add(fh, &fi)->fi;
+}
+
+
+static int count_filler(void *buf, const char *name, const struct stat *st,
+                        off_t off)
+{
+    (void)name;
+    (void)st;
+    (void)off;
+    (*(unsigned *)buf)++;
+    return 0;
+}
+
+
+/* Issue record `e` again. Returns the result of the handler, and its latency
+ * in `*ns`, or REPLAY_SKIPPED if the record cannot be replayed. */
+static int replay_one(const struct trace_ent *e, char *buf, uint64_t *ns)
+{
+    const struct trace_rec *rec = &e->rec;
+    const struct trace_args *a = &e->x.args;
+    const char *path = e->x.path;
+    struct fuse_file_info fi, *fip = NULL;
+    struct fuse_bufvec wbuf = FUSE_BUFVEC_INIT(rec->size);
+    struct replay_handle *h = NULL;
+    struct stat st;
+    unsigned n = 0;
+    uint64_t start;
+    int res;
+
+    *ns = REPLAY_SKIPPED;
+    if (rec->op >= NOPS || (rec->flags & TRACE_INODE) || !a->path_len)
+        return 0;
+
+    memset(&fi, 0, sizeof(fi));
+    switch (rec->op) {
+    case OP_READ:
+    case OP_WRITE:
+    case OP_TRUNCATE:
+    case OP_FLUSH:
+    case OP_FSYNC:
+        fip = handle_for(path, a->fh);
+        break;
+    case OP_RELEASE:
+        if (!(h = handle_remove(a->fh)))
+            return 0;
+        fip = &h->fi;
+        break;
+    case OP_OPEN:
+        fi.flags = a->arg;
+        /* fall through */
+    case OP_CREATE:
+        fip = &fi;
+        break;
+    }
+    if ((rec->op == OP_READ || rec->op == OP_WRITE) && !fip)
+        return 0;
+
+    wbuf.buf[0].mem = buf;
+    start = now_ns();
+    switch (rec->op) {
+    case OP_GETATTR:
+        res = sfs_oper.getattr(path, &st);
+        break;
+    case OP_READDIR:
+        res = sfs_oper.readdir(path, &n, count_filler, 0, NULL);
+        break;
+    case OP_OPEN:
+        res = sfs_oper.open(path, fip);
+        break;
+    case OP_RELEASE:
+        res = sfs_oper.release(path, fip);
+        break;
+    case OP_READ:
+        res = sfs_oper.read(path, buf, rec->size, rec->offset, fip);
+        break;
+    case OP_WRITE:
+        res = a->arg ? sfs_oper.write_buf(path, &wbuf, rec->offset, fip)
+                     : sfs_oper.write(path, buf, rec->size, rec->offset, fip);
+        break;
+    case OP_CREATE:
+        res = sfs_oper.create(path, a->arg, fip);
+        break;
+    case OP_MKDIR:
+        res = sfs_oper.mkdir(path, a->arg);
+        break;
+    case OP_UNLINK:
+        res = sfs_oper.unlink(path);
+        break;
+    case OP_RMDIR:
+        res = sfs_oper.rmdir(path);
+        break;
+    case OP_TRUNCATE:
+        res = fip ? sfs_oper.ftruncate(path, rec->offset, fip)
+                  : sfs_oper.truncate(path, rec->offset);
+        break;
+    case OP_FLUSH:
+        res = sfs_oper.flush(path, fip ? fip : &fi);
+        break;
+    case OP_FSYNC:
+        res = sfs_oper.fsync(path, a->arg, fip ? fip : &fi);
+        break;
+    default:
+        return 0;
+    }
+    *ns = now_ns() - start;
+
+    if ((rec->op == OP_OPEN || rec->op == OP_CREATE) && res == 0)
+        handle_add(a->fh, fip);
+    free(h);
+    return res;
+}
+
+
+/* Wait until `rec` is as far into the replay as it was into the recording. */
+static void replay_pace(const struct trace_rec *rec)
+{
+    uint64_t t = replay_epoch + (rec->start - trace_first);
+    struct timespec ts = { t / 1000000000u, t % 1000000000u };
+
+    if (replay_paced && now_ns() < t)
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+
+static void replay_run(size_t n, const size_t *idx, char *buf)
+{
+    for (size_t i = 0; i < n; i++) {
+        const struct trace_ent *e = &ents[idx ? idx[i] : i];
+        size_t j = idx ? idx[i] : i;
+        int res;
+
+        if (e->rec.op == TRACE_DROPPED) {
+            lat_ns[j] = REPLAY_SKIPPED;
+            continue;
+        }
+        replay_pace(&e->rec);
+        res = replay_one(e, buf, &lat_ns[j]);
+        mismatch[j] = lat_ns[j] != REPLAY_SKIPPED && res != e->rec.res;
+    }
+}
+
+
+static void *replay_thread_main(void *arg)
+{
+    struct replay_thread *t = arg;
+    char *buf = malloc(replay_buf_size);
+
+    check(buf != NULL, "allocating a buffer");
+    replay_run(t->n, t->idx, buf);
+    free(buf);
+    return NULL;
+}
+
+
+/* Replay the records of each traced thread on a thread of its own, starting
+ * each operation no earlier than it started in the recording. */
+static void replay_threads(size_t n)
+{
+    static struct replay_thread threads[1 << 16];
+    unsigned nthreads = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        struct replay_thread *t = &threads[ents[i].rec.thread];
+
+        if (t->n++ == 0)
+            nthreads++;
+    }
+    for (unsigned id = 0; id < 1u << 16; id++) {
+        if (threads[id].n) {
+            threads[id].idx = malloc(threads[id].n * sizeof(size_t));
+            check(threads[id].idx != NULL, "allocating threads");
+            threads[id].n = 0;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct replay_thread *t = &threads[ents[i].rec.thread];
+
+        t->idx[t->n++] = i;
+    }
+
+    replay_paced = 1;
+    replay_epoch = now_ns();
+    for (unsigned id = 0; id < 1u << 16; id++) {
+        if (threads[id].n)
+            check(pthread_create(&threads[id].thread, NULL,
+                                 replay_thread_main, &threads[id]) == 0,
+                  "starting a thread");
+    }
+    for (unsigned id = 0; id < 1u << 16; id++) {
+        if (threads[id].n) {
+            pthread_join(threads[id].thread, NULL);
+            free(threads[id].idx);
+        }
+    }
+    fprintf(stderr, "replay: %u threads\n", nthreads);
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/* Read the lines of an earlier replay's output. Returns their number. */
+static size_t read_base(const char *path, struct replay_base *base)
+{
+    FILE *in = fopen(path, "r");
+    char line[512];
+    size_t n = 0;
+
+    check(in != NULL, path);
+    while (n < NOPS && fgets(line, sizeof(line), in)) {
+        struct replay_base *b = &base[n];
+
+        if (sscanf(line, "{\"op\": \"%15[^\"]\", \"ops\": %*u, "
+                   "\"p50_us\": %lf, \"p99_us\": %lf",
+                   b->op, &b->p50_us, &b->p99_us) == 3)
+            n++;
+    }
+    fclose(in);
+    return n;
+}
+
+
+/* The op of this build called `name`, or NOPS. */
+static uint8_t op_by_name(const char *name)
+{
+    uint8_t op = 0;
+
+    while (op < NOPS && strcmp(op_names[op], name) != 0)
+        op++;
+    return op;
+}
+
+
+static double pct(double now, double then)
+{
+    return then > 0 ? (now - then) / then * 100 : 0;
+}
+
+
+/* Print the latencies of the replayed records of each op. */
+static void report(size_t n, const struct replay_base *base, size_t nbase)
+{
+    uint64_t *lat = malloc(n * sizeof(uint64_t) + 1);
+    uint64_t *rec = malloc(n * sizeof(uint64_t) + 1);
+
+    check(lat && rec, "allocating latencies");
+    for (unsigned op = 0; op < NOPS; op++) {
+        const struct replay_base *b = NULL;
+        size_t m = 0, bad = 0;
+        uint64_t total = 0;
+        double p50, p99;
+
+        for (size_t i = 0; i < n; i++) {
+            if (ents[i].rec.op != op || lat_ns[i] == REPLAY_SKIPPED)
+                continue;
+            rec[m] = ents[i].rec.ns;
+            total += lat_ns[i];
+            bad += mismatch[i];
+            lat[m++] = lat_ns[i];
+        }
+        if (m == 0)
+            continue;
+
+        qsort(lat, m, sizeof(uint64_t), cmp_u64);
+        qsort(rec, m, sizeof(uint64_t), cmp_u64);
+        p50 = lat[m / 2] / 1e3;
+        p99 = lat[m * 99 / 100] / 1e3;
+        printf("{\"op\": \"%s\", \"ops\": %zu, \"p50_us\": %.3f, "
+               "\"p99_us\": %.3f, \"mean_us\": %.3f, "
+               "\"recorded_p50_us\": %.3f, \"mismatched\": %zu",
+               op_names[op], m, p50, p99, total / 1e3 / m, rec[m / 2] / 1e3,
+               bad);
+
+        for (size_t i = 0; i < nbase; i++)
+            if (strcmp(base[i].op, op_names[op]) == 0)
+                b = &base[i];
+        if (b)
+            printf(", \"base_p50_us\": %.3f, \"base_p99_us\": %.3f, "
+                   "\"delta_p50_pct\": %.1f, \"delta_p99_pct\": %.1f",
+                   b->p50_us, b->p99_us, pct(p50, b->p50_us),
+                   pct(p99, b->p99_us));
+        printf("}\n");
+    }
+    free(lat);
+    free(rec);
+}
+
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [options] TRACE IMAGE\n\n"
+           "Replays the operations recorded in TRACE (by sfs --record) on\n"
+           "IMAGE, which it modifies, and prints one JSON object per op.\n\n"
+           "    -t          replay each recorded thread on a thread of its\n"
+           "                own, with the original timing (default: all\n"
+           "                operations in order, on one thread)\n"
+           "    -b FILE     compare with the output of an earlier replay\n"
+           "    -m          use the mmap backend\n"
+           "    -u          use the io_uring backend\n"
+           "    -j          journal metadata changes\n"
+           "    -c MB       block cache size (default: %u)\n"
+           "    -d N        dentry cache size (default: %u)\n"
+           "    -r N        readahead window in blocks (default: %u)\n"
+           "    -w SECS     metadata writeback interval (default: 0)\n",
+           progname, DEFAULT_CACHE_MB, DEFAULT_DCACHE, DEFAULT_READAHEAD);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct replay_opts o = { 0 };
+    struct replay_base base[NOPS];
+    enum disk_mode mode = DISK_MODE_PREAD;
+    struct trace_header h;
+    char (*names)[TRACE_NAME_LEN];
+    size_t nbase = 0, skipped = 0, dropped = 0, bad = 0;
+    uint64_t start;
+    ssize_t n;
+    int c;
+
+    options.dcache = DEFAULT_DCACHE;
+    options.cache_mb = DEFAULT_CACHE_MB;
+    options.readahead = DEFAULT_READAHEAD;
+
+    while ((c = getopt(argc, argv, "tb:mujc:d:r:w:h")) != -1) {
+        switch (c) {
+        case 't': o.threads = 1; break;
+        case 'b': o.base = optarg; break;
+        case 'm': mode = DISK_MODE_MMAP; break;
+        case 'u': mode = DISK_MODE_URING; break;
+        case 'j': options.journal = 1; break;
+        case 'c': options.cache_mb = strtoul(optarg, NULL, 0); break;
+        case 'd': options.dcache = strtoul(optarg, NULL, 0); break;
+        case 'r': options.readahead = strtoul(optarg, NULL, 0); break;
+        case 'w': options.writeback = strtoul(optarg, NULL, 0); break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    o.trace = argv[optind];
+    o.img = argv[optind + 1];
+
+    if ((n = trace_load(o.trace, &h, &names, &ents)) < 0)
+        return 1;
+    if (!(h.flags & TRACE_ARGS)) {
+        fprintf(stderr, "replay: %s was not made with --record\n", o.trace);
+        return 1;
+    }
+    /* Ops are matched by name, so traces of builds that number them
+     * differently can be replayed. */
+    for (ssize_t i = 0; i < n; i++) {
+        uint8_t op = ents[i].rec.op;
+
+        if (op != TRACE_DROPPED)
+            ents[i].rec.op = op_by_name(names[op < h.nops ? op : h.nops]);
+    }
+    if (o.base)
+        nbase = read_base(o.base, base);
+
+    for (ssize_t i = 0; i < n; i++)
+        if (ents[i].rec.size > replay_buf_size)
+            replay_buf_size = ents[i].rec.size;
+    replay_buf_size = replay_buf_size ? replay_buf_size : 1;
+    replay_buf = calloc(1, replay_buf_size);
+    lat_ns = malloc((n + 1) * sizeof(uint64_t));
+    mismatch = calloc(n + 1, sizeof(int));
+    check(replay_buf && lat_ns && mismatch, "allocating buffers");
+    trace_first = n ? ents[0].rec.start : 0;
+
+    disk_open_image(o.img, mode);
+    sfs_oper.init(NULL);
+
+    start = now_ns();
+    if (o.threads)
+        replay_threads(n);
+    else
+        replay_run(n, NULL, replay_buf);
+    fprintf(stderr, "replay: %zd records in %.3f s\n", n,
+            (now_ns() - start) / 1e9);
+
+    /* Files still open at the end of the recording. */
+    for (size_t i = 0; i < nhandles; i++) {
+        sfs_oper.release("/", &handles[i]->fi);
+        free(handles[i]);
+    }
+    sfs_oper.destroy(NULL);
+
+    for (ssize_t i = 0; i < n; i++) {
+        if (ents[i].rec.op == TRACE_DROPPED)
+            dropped += ents[i].rec.offset;
+        else if (lat_ns[i] == REPLAY_SKIPPED)
+            skipped++;
+        bad += mismatch[i];
+    }
+    if (dropped)
+        fprintf(stderr, "replay: %zu operations were lost while recording\n",
+                dropped);
+    if (skipped)
+        fprintf(stderr, "replay: skipped %zu records without a path\n",
+                skipped);
+    if (bad)
+        fprintf(stderr, "replay: %zu results differ from the recording; was "
+                "the image a copy of the recorded one?\n", bad);
+
+    report(n, base, nbase);
+    free(handles);
+    free(ents);
+    free(names);
+    free(lat_ns);
+    free(mismatch);
+    free(replay_buf);
+    return 0;
+}
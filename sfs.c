@@ -2,598 +2,6482 @@
 
 #include <errno.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <assert.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "sfs.h"
 #include "diskio.h"
 
 
-static const char default_img[] = "test.img";
+static const char default_img[] = "test.img";
+
+#define DEFAULT_DCACHE 16384u
+#define DEFAULT_CACHE_MB 8u
+/* In blocks; as much as the kernel reads ahead by default with 4 KiB blocks.
+ * Without the block cache, or with a tiny one, there is no readahead. */
+#define DEFAULT_READAHEAD 32u
+
+struct options {
+    const char *img;
+    int background;
+    int verbose;
+    int mmap;
+    int uring;
+    int lowlevel;
+    int journal;
+    int extents;
+    unsigned defrag;
+    char *trace;
+    char *record;
+    char *dump_trace;
+    unsigned writeback;
+    unsigned dcache;
+    unsigned cache_mb;
+    unsigned readahead;
+    int show_help;
+    int show_fuse_help;
+} options;
+
+
+const char* __asan_default_options() { return "detect_leaks=0"; }
+
+
+/*
+ * libfuse runs operations on several threads at once. Shared state is
+ * protected by the following locks, which are always taken in this order:
+ *
+ *  ns_lock         held shared by every operation, and exclusively by rmdir,
+ *                  so no directory can disappear while a path through it is
+ *                  being resolved or used.
+ *  sfs_file.lock   per open file: shared while it is read, exclusive while its
+ *                  contents, block chain or size change. A clone holds two,
+ *                  which are taken in the order of their entries.
+ *  flush_lock      serializes meta_flush().
+ *  txn_lock        held shared while an operation modifies metadata, and
+ *                  exclusively while meta_flush() commits the changes to the
+ *                  journal, so a transaction never holds half an operation.
+ *  sfs_dir.lock    per directory: shared while names are looked up or listed,
+ *                  exclusive while entries are added or removed.
+ *  dir_locks       striped by directory block: shared while entries are
+ *                  read, exclusive while they are modified.
+ *  alloc_lock      the block table, reference counts, free space map and
+ *                  their dirty state.
+ *  bcache_lock     the block cache.
+ *  dcache_lock, dirs_lock, files_lock, sfs_file.idx_lock, trace_lock,
+ *  defrag_lock     the dentry cache, directory table, open file table,
+ *                  per-file chain index, list of trace rings and state of the
+ *                  defragmentation thread.
+ *
+ * Lookups, reads and readdir therefore only ever hold shared locks, apart from
+ * the short leaf locks around the caches.
+ */
+static pthread_rwlock_t ns_lock;
+
+
+/* Geometry of the mounted image, read by sfs_init(). Sizes and offsets come
+ * from here rather than from the constants of sfs.h, which only describe
+ * version 1 images. */
+static struct sfs_geom geom;
+
+#define ROOTDIR_SIZE ((size_t)geom.rootdir_nentries * sizeof(struct sfs_entry))
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* Entries per subdirectory segment, also set by meta_load(). */
+static unsigned dir_seg_nentries = SFS_DIR_NENTRIES;
+
+#define DIR_SEG_SIZE   ((size_t)dir_seg_nentries * sizeof(struct sfs_entry))
+#define DIR_SEG_BLOCKS DIV_ROUND_UP(DIR_SEG_SIZE, geom.block_size)
+
+
+/* The first block of `entry`. Version 2 images keep its upper half at the end
+ * of the name (see struct sfs_entry). */
+static inline blockidx_t entry_block(const struct sfs_entry *entry)
+{
+    uint16_t hi;
+
+    if (geom.version == 1)
+        return entry->first_block >= SFS_V1_BLOCKIDX_END
+               ? 0xffff0000u | entry->first_block : entry->first_block;
+    memcpy(&hi, &entry->filename[SFS_V2_FILENAME_MAX], sizeof(hi));
+    return (blockidx_t)hi << 16 | entry->first_block;
+}
+
+/* Set the first block of `entry`. Its name has to be set first. */
+static inline void entry_set_block(struct sfs_entry *entry, blockidx_t block)
+{
+    uint16_t hi = block >> 16;
+
+    /* The special values keep their meaning when cut to 16 bits. */
+    entry->first_block = (uint16_t)block;
+    if (geom.version != 1)
+        memcpy(&entry->filename[SFS_V2_FILENAME_MAX], &hi, sizeof(hi));
+}
+
+
+/*
+ * Return a pointer to `size` bytes of the disk at `offset`. When the image is
+ * memory-mapped this points directly into the mapping; otherwise the bytes are
+ * read into `scratch` (which must hold at least `size` bytes) and that is
+ * returned instead.
+ */
+static const void *disk_view(void *scratch, size_t size, off_t offset)
+{
+    const void *p = disk_map(size, offset);
+
+    if (p)
+        return p;
+    disk_read(scratch, size, offset);
+    return scratch;
+}
+
+
+/*
+ * Block cache: a fixed number of data-area blocks (options.cache_mb) kept in
+ * memory, looked up through a direct map from block index to slot. Slots are
+ * reused in CLOCK order. Without --writeback the cache is write-through;
+ * with it, written blocks stay dirty in the cache until bcache_flush() (on
+ * fsync, unmount, eviction or when the writeback interval expires).
+ * Partial writes of uncached blocks are then read-modify-written.
+ *
+ * Reads of both engines copy the data through blk_read(), so cached blocks
+ * are served from memory and blocks that missed are added once they arrive.
+ * Only write_buf bypasses the cache, and drops the cached copies of the
+ * blocks it writes.
+ *
+ * With --journal, directory blocks whose entries changed are kept dirty (and
+ * marked `meta`) until the next checkpoint; the changes themselves go to the
+ * journal. Such a block may only be evicted once the journal transaction that
+ * last changed it (`seq`) has been committed and synced.
+ *
+ * Disk I/O for a slot (loading a block, or writing back the block it evicts)
+ * is done without bcache_lock. The slot is marked `busy` meanwhile, and
+ * threads that look up either block wait on bcache_cond until it is
+ * published.
+ */
+struct bslot {
+    blockidx_t block;       /* SFS_BLOCKIDX_EMPTY if the slot is unused */
+    uint8_t ref;
+    uint8_t dirty;
+    uint8_t meta;
+    uint8_t busy;
+    unsigned seq;
+};
+
+#define BSLOT_NONE UINT32_MAX
+
+static struct bslot *bcache_slots;
+static char *bcache_data;
+static unsigned bcache_nslots;
+static unsigned bcache_hand;
+static unsigned bcache_ndirty;
+static unsigned bcache_nbusy;
+static unsigned bcache_nwriteback;  /* Evicted blocks being written back */
+static uint32_t *bcache_slot_of;  /* geom.nblocks slots */
+static unsigned *bcache_flush_order;
+static unsigned long bcache_hits, bcache_misses, bcache_evictions;
+static unsigned long bcache_readahead;  /* Blocks read by file_readahead */
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;
+
+
+static inline char *bslot_data(unsigned slot)
+{
+    return bcache_data + (size_t)slot * geom.block_size;
+}
+
+static inline off_t block_off(blockidx_t block)
+{
+    return geom.data_off + (off_t)block * geom.block_size;
+}
+
+
+static void bcache_init(void)
+{
+    bcache_nslots = ((size_t)options.cache_mb << 20) / geom.block_size;
+    if (bcache_nslots > geom.nblocks)
+        bcache_nslots = geom.nblocks;
+
+    bcache_slot_of = malloc(geom.nblocks * sizeof(uint32_t));
+    if (!bcache_slot_of) {
+        fprintf(stderr, "Could not allocate block cache index\n");
+        exit(1);
+    }
+    for (unsigned i = 0; i < geom.nblocks; i++)
+        bcache_slot_of[i] = BSLOT_NONE;
+
+    if (!bcache_nslots)
+        return;
+
+    bcache_slots = malloc(bcache_nslots * sizeof(struct bslot));
+    bcache_data = malloc((size_t)bcache_nslots * geom.block_size);
+    bcache_flush_order = malloc(bcache_nslots * sizeof(unsigned));
+    if (!bcache_slots || !bcache_data || !bcache_flush_order) {
+        fprintf(stderr, "Could not allocate %u MiB block cache\n",
+                options.cache_mb);
+        exit(1);
+    }
+
+    for (unsigned i = 0; i < bcache_nslots; i++)
+        bcache_slots[i] = (struct bslot){ .block = SFS_BLOCKIDX_EMPTY };
+}
+
+
+static void bcache_unmap(unsigned slot)
+{
+    struct bslot *s = &bcache_slots[slot];
+
+    if (s->dirty)
+        bcache_ndirty--;
+    bcache_slot_of[s->block] = BSLOT_NONE;
+    *s = (struct bslot){ .block = SFS_BLOCKIDX_EMPTY };
+}
+
+
+/* Return a busy slot for `block`, which bcache_find() has just not found,
+ * evicting another block if needed. The contents of the slot are undefined
+ * until the caller fills it in and calls bcache_publish(). Writing back a
+ * dirty block drops bcache_lock meanwhile; `block` is already mapped by then,
+ * so no other thread allocates it. */
+static unsigned bcache_alloc(blockidx_t block)
+{
+    unsigned slot, skipped = 0;
+    struct bslot old;
+
+    for (;;) {
+        struct bslot *s = &bcache_slots[bcache_hand];
+
+        slot = bcache_hand;
+        bcache_hand = (bcache_hand + 1) % bcache_nslots;
+        if (s->block == SFS_BLOCKIDX_EMPTY)
+            break;
+        if (s->busy)
+            continue;
+        if (s->ref) {
+            s->ref = 0;
+            continue;
+        }
+        /* Directory blocks with uncommitted changes are passed over, unless
+         * the cache holds nothing else. */
+        if (s->meta && s->seq > disk_journal_committed() &&
+                skipped++ < bcache_nslots)
+            continue;
+        if (!s->dirty)
+            bcache_unmap(slot);
+        bcache_evictions++;
+        break;
+    }
+
+    /* A dirty block stays mapped to the (busy) slot until it is written. */
+    old = bcache_slots[slot];
+    if (old.dirty)
+        bcache_ndirty--;
+    bcache_slots[slot] = (struct bslot){ .block = block, .ref = 1, .busy = 1 };
+    bcache_slot_of[block] = slot;
+    bcache_nbusy++;
+    if (!old.dirty)
+        return slot;
+
+    bcache_nwriteback++;
+    pthread_mutex_unlock(&bcache_lock);
+    if (old.meta)
+        disk_journal_sync();
+    disk_write(bslot_data(slot), geom.block_size, block_off(old.block));
+    pthread_mutex_lock(&bcache_lock);
+    bcache_slot_of[old.block] = BSLOT_NONE;
+    bcache_nwriteback--;
+    pthread_cond_broadcast(&bcache_cond);
+    return slot;
+}
+
+
+/* Make a slot returned by bcache_alloc() available to other threads. */
+static void bcache_publish(unsigned slot)
+{
+    bcache_slots[slot].busy = 0;
+    bcache_nbusy--;
+    pthread_cond_broadcast(&bcache_cond);
+}
+
+
+/* Return the slot `block` is mapped to, once it is published. Returns
+ * BSLOT_NONE if the block is not cached, once some slot is not busy, so that
+ * bcache_alloc() finds one. */
+static unsigned bcache_find(blockidx_t block)
+{
+    unsigned slot;
+
+    while ((slot = bcache_slot_of[block]) != BSLOT_NONE
+               ? bcache_slots[slot].busy : bcache_nbusy == bcache_nslots)
+        pthread_cond_wait(&bcache_cond, &bcache_lock);
+    return slot;
+}
+
+
+static unsigned bcache_lookup(blockidx_t block)
+{
+    unsigned slot = bcache_find(block);
+
+    if (slot == BSLOT_NONE) {
+        bcache_misses++;
+        return BSLOT_NONE;
+    }
+    bcache_hits++;
+    bcache_slots[slot].ref = 1;
+    return slot;
+}
+
+
+/* Read all of `block` from disk into a new slot, without holding bcache_lock
+ * during the read. */
+static unsigned bcache_load(blockidx_t block)
+{
+    unsigned slot = bcache_alloc(block);
+
+    pthread_mutex_unlock(&bcache_lock);
+    disk_read(bslot_data(slot), geom.block_size, block_off(block));
+    pthread_mutex_lock(&bcache_lock);
+    bcache_publish(slot);
+    return slot;
+}
+
+
+/* Add a clean copy of `block` to the cache, unless it is already there. */
+static void bcache_fill(blockidx_t block, const void *data)
+{
+    unsigned slot;
+
+    if (bcache_find(block) != BSLOT_NONE)
+        return;
+    slot = bcache_alloc(block);
+    memcpy(bslot_data(slot), data, geom.block_size);
+    bcache_publish(slot);
+}
+
+
+/* Forget `block` (it has been freed), dropping any unwritten data. */
+static void bcache_discard(blockidx_t block)
+{
+    if (!bcache_nslots)
+        return;
+
+    pthread_mutex_lock(&bcache_lock);
+    if (bcache_find(block) != BSLOT_NONE)
+        bcache_unmap(bcache_slot_of[block]);
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+
+/* Number of segments collected before a vectored disk access is issued. */
+#define SEG_BATCH 256u
+
+/*
+ * A vectored disk access under construction. For reads, whole blocks that
+ * missed the block cache are added to it once the data has arrived.
+ */
+struct seg_batch {
+    struct disk_seg segs[SEG_BATCH];
+    unsigned n;
+    int write;
+    struct {
+        blockidx_t block;
+        const void *data;
+    } fill[SEG_BATCH];
+    unsigned nfill;
+};
+
+static void seg_flush(struct seg_batch *b)
+{
+    if (b->write)
+        disk_writev(b->segs, b->n);
+    else
+        disk_readv(b->segs, b->n);
+    b->n = 0;
+
+    if (!b->nfill)
+        return;
+    pthread_mutex_lock(&bcache_lock);
+    for (unsigned i = 0; i < b->nfill; i++)
+        bcache_fill(b->fill[i].block, b->fill[i].data);
+    pthread_mutex_unlock(&bcache_lock);
+    b->nfill = 0;
+}
+
+/* Add `size` bytes at disk address `offset` to batch `b`, extending the last
+ * segment if both the disk range and the buffer continue it. */
+static void seg_add(struct seg_batch *b, void *buf, size_t size, off_t offset)
+{
+    struct disk_seg *last = b->n ? &b->segs[b->n - 1] : NULL;
+
+    if (last && last->offset + (off_t)last->size == offset &&
+            (char *)last->buf + last->size == buf) {
+        last->size += size;
+        return;
+    }
+
+    if (b->n == SEG_BATCH)
+        seg_flush(b);
+    b->segs[b->n++] = (struct disk_seg){ buf, size, offset };
+}
+
+
+/*
+ * Read `n` bytes at offset `in` of data block `block` into `dst`: from the
+ * block cache if possible, otherwise as part of batch `b` (which the caller
+ * has to flush before using `dst`).
+ */
+static void blk_read(struct seg_batch *b, blockidx_t block, size_t in,
+                     void *dst, size_t n)
+{
+    unsigned slot;
+
+    if (!bcache_nslots) {
+        seg_add(b, dst, n, block_off(block) + in);
+        return;
+    }
+
+    pthread_mutex_lock(&bcache_lock);
+    if ((slot = bcache_lookup(block)) == BSLOT_NONE && n < geom.block_size)
+        slot = bcache_load(block);
+    if (slot != BSLOT_NONE) {
+        memcpy(dst, bslot_data(slot) + in, n);
+        pthread_mutex_unlock(&bcache_lock);
+        return;
+    }
+    pthread_mutex_unlock(&bcache_lock);
+
+    /* Whole blocks are read as part of the batch, and cached afterwards. */
+    if (b->nfill == SEG_BATCH)
+        seg_flush(b);
+    seg_add(b, dst, n, block_off(block));
+    b->fill[b->nfill].block = block;
+    b->fill[b->nfill++].data = dst;
+}
+
+
+/*
+ * Write `n` bytes of `src` at offset `in` of data block `block`: into the
+ * block cache, and (unless the cache does write-back) as part of batch `b`.
+ */
+static void blk_write(struct seg_batch *b, blockidx_t block, size_t in,
+                      const void *src, size_t n)
+{
+    unsigned slot = BSLOT_NONE;
+
+    if (bcache_nslots) {
+        pthread_mutex_lock(&bcache_lock);
+        slot = bcache_lookup(block);
+        /* The lock is held until the slot is filled in below. */
+        if (slot == BSLOT_NONE && n == geom.block_size)
+            bcache_publish(slot = bcache_alloc(block));
+        else if (slot == BSLOT_NONE && options.writeback)
+            slot = bcache_load(block);
+
+        if (slot != BSLOT_NONE) {
+            memcpy(bslot_data(slot) + in, src, n);
+            if (options.writeback) {
+                if (!bcache_slots[slot].dirty)
+                    bcache_ndirty++;
+                bcache_slots[slot].dirty = 1;
+                pthread_mutex_unlock(&bcache_lock);
+                return;
+            }
+        }
+        pthread_mutex_unlock(&bcache_lock);
+    }
+
+    seg_add(b, (void *)src, n, block_off(block) + in);
+}
+
+
+/* Read or write `size` bytes at disk address `offset` in the data area, which
+ * may span several (consecutive) blocks, through the block cache. */
+static void data_rw(int write, void *buf, size_t size, off_t offset)
+{
+    struct seg_batch batch = { .write = write };
+    blockidx_t block = (offset - geom.data_off) / geom.block_size;
+    size_t in = (offset - geom.data_off) % geom.block_size;
+
+    for (size_t done = 0, n; done < size; done += n, block++, in = 0) {
+        n = geom.block_size - in < size - done ? geom.block_size - in
+                                              : size - done;
+        if (write)
+            blk_write(&batch, block, in, (char *)buf + done, n);
+        else
+            blk_read(&batch, block, in, (char *)buf + done, n);
+    }
+    seg_flush(&batch);
+}
+
+
+static int bslot_cmp(const void *a, const void *b)
+{
+    blockidx_t x = bcache_slots[*(const unsigned *)a].block;
+    blockidx_t y = bcache_slots[*(const unsigned *)b].block;
+
+    return (x > y) - (x < y);
+}
+
+/* Write all dirty blocks back, in block order so that runs of consecutive
+ * blocks are merged into single writes. Directory blocks held back for the
+ * journal are only included if `meta` is set. Only the cache slots are
+ * scanned, so the cost does not grow with the size of the disk. */
+static void bcache_flush(int meta)
+{
+    struct seg_batch batch = { .write = 1 };
+    unsigned n = 0;
+
+    pthread_mutex_lock(&bcache_lock);
+    /* Blocks that are being evicted are no longer dirty, but not written yet
+     * either. */
+    while (bcache_nwriteback)
+        pthread_cond_wait(&bcache_cond, &bcache_lock);
+    if (!bcache_ndirty) {
+        pthread_mutex_unlock(&bcache_lock);
+        return;
+    }
+
+    for (unsigned slot = 0; slot < bcache_nslots; slot++)
+        if (bcache_slots[slot].dirty && (meta || !bcache_slots[slot].meta))
+            bcache_flush_order[n++] = slot;
+    qsort(bcache_flush_order, n, sizeof(unsigned), bslot_cmp);
+
+    for (unsigned i = 0; i < n; i++) {
+        unsigned slot = bcache_flush_order[i];
+        blockidx_t block = bcache_slots[slot].block;
+
+        seg_add(&batch, bslot_data(slot), geom.block_size, block_off(block));
+        bcache_slots[slot].dirty = 0;
+        bcache_slots[slot].meta = 0;
+        bcache_ndirty--;
+    }
+    seg_flush(&batch);
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+
+/*
+ * Journal mode: store `size` bytes of `buf` at disk address `offset` (within
+ * one directory block) in the cache only, and log them in the journal. The
+ * block is written back at the next checkpoint.
+ */
+static void bcache_write_meta(const void *buf, size_t size, off_t offset)
+{
+    blockidx_t block = (offset - geom.data_off) / geom.block_size;
+    size_t in = (offset - geom.data_off) % geom.block_size;
+    struct bslot *s;
+    unsigned slot;
+
+    pthread_mutex_lock(&bcache_lock);
+    if ((slot = bcache_lookup(block)) == BSLOT_NONE)
+        slot = bcache_load(block);
+    s = &bcache_slots[slot];
+
+    memcpy(bslot_data(slot) + in, buf, size);
+    if (!s->dirty)
+        bcache_ndirty++;
+    s->dirty = 1;
+    s->meta = 1;
+    s->seq = disk_journal_add(buf, size, offset);
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+
+/* Write metadata that lives in the data area (subdirectory entries, extent
+ * lists) at disk address `offset`, within a single block: through the block
+ * cache, or with --journal into the journal. */
+static void meta_write(const void *buf, size_t size, off_t offset)
+{
+    if (options.journal)
+        bcache_write_meta(buf, size, offset);
+    else
+        data_rw(1, (void *)buf, size, offset);
+}
+
+
+/* Return the entries of the directory segment stored at disk address `off`,
+ * using `scratch` (of DIR_SEG_SIZE bytes) if they cannot be viewed in place. */
+static const struct sfs_entry *dir_view(struct sfs_entry *scratch, off_t off)
+{
+    if (!bcache_nslots)
+        return disk_view(scratch, DIR_SEG_SIZE, off);
+
+    data_rw(0, scratch, DIR_SEG_SIZE, off);
+    return scratch;
+}
+
+
+/*
+ * The root directory and block table are loaded once at mount and served from
+ * memory afterwards. Modifications go to these copies and are recorded in a
+ * dirty bitmap (one bit per entry), so that only the changed byte ranges have
+ * to be written back by meta_flush().
+ *
+ * In memory, block indices are always 32 bits wide. For version 1 images,
+ * whose block table holds 16-bit indices, a copy in that format is kept as
+ * well, and is what gets written back.
+ */
+static struct sfs_entry *root_dir;
+static blockidx_t *block_table;
+static uint16_t *block_table_v1;
+
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+static uint64_t *root_dir_dirty;
+static uint64_t *block_table_dirty;
+static time_t last_flush;
+
+/* With --journal: elements that were logged, but not yet written back. */
+static uint64_t *root_dir_logged;
+static uint64_t *block_table_logged;
+
+/* The reference count table (see struct sfs_superblock), on images that have
+ * one: how many more chains lead through each block than the first. */
+static uint32_t *block_refs;
+static uint64_t *block_refs_dirty;
+static uint64_t *block_refs_logged;
+
+/* The rootdir_next field of the superblock (version 2): where the root
+ * directory continues once it has grown. Protected by alloc_lock, and written
+ * back along with the block table. */
+static blockidx_t root_next = SFS_BLOCKIDX_END;
+static int root_next_dirty, root_next_logged;
+
+#define ROOT_NEXT_OFF (SFS_SB_OFF + offsetof(struct sfs_superblock, rootdir_next))
+
+/* A directory segment of unused entries, set up by meta_load(). */
+static struct sfs_entry *dir_seg_empty;
+
+/* End of the root directory on disk; entries before it are in root_dir. */
+#define ROOTDIR_END (geom.rootdir_off + (off_t)ROOTDIR_SIZE)
+
+/* The block table as it is stored on disk. */
+#define BLOCKTBL_DISK \
+    (block_table_v1 ? (void *)block_table_v1 : (void *)block_table)
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t txn_lock;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Directory entries are protected by a fixed set of rwlocks, picked by the
+ * data block the entries are stored in. The root directory region has a lock
+ * of its own, which also covers root_dir_dirty. A directory segment spans at
+ * most two blocks and thus two locks, which are always taken in index order.
+ */
+#define DIR_LOCKS 64u
+
+static pthread_rwlock_t dir_locks[DIR_LOCKS];
+
+static unsigned dir_lock_idx(off_t off)
+{
+    if (off < (off_t)geom.data_off)
+        return 0;
+    return 1 + (off - geom.data_off) / geom.block_size % (DIR_LOCKS - 1);
+}
+
+/* Lock the entries stored in [off, off + size), exclusively if `write`. */
+static void entries_lock(off_t off, size_t size, int write)
+{
+    unsigned a = dir_lock_idx(off), b = dir_lock_idx(off + size - 1);
+
+    if (a > b) {
+        unsigned t = a;
+        a = b;
+        b = t;
+    }
+    if (write) {
+        pthread_rwlock_wrlock(&dir_locks[a]);
+        if (b != a)
+            pthread_rwlock_wrlock(&dir_locks[b]);
+    } else {
+        pthread_rwlock_rdlock(&dir_locks[a]);
+        if (b != a)
+            pthread_rwlock_rdlock(&dir_locks[b]);
+    }
+}
+
+static void entries_unlock(off_t off, size_t size)
+{
+    unsigned a = dir_lock_idx(off), b = dir_lock_idx(off + size - 1);
+
+    pthread_rwlock_unlock(&dir_locks[a]);
+    if (b != a)
+        pthread_rwlock_unlock(&dir_locks[b]);
+}
+
+static inline void entry_lock(off_t entry_off, int write)
+{
+    entries_lock(entry_off, sizeof(struct sfs_entry), write);
+}
+
+static inline void entry_unlock(off_t entry_off)
+{
+    entries_unlock(entry_off, sizeof(struct sfs_entry));
+}
+
+
+static void locks_init(void)
+{
+    pthread_rwlockattr_t attr;
+
+    /* Prefer rmdir over new operations, so it cannot be starved. */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ns_lock, &attr);
+    pthread_rwlock_init(&txn_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    for (unsigned i = 0; i < DIR_LOCKS; i++)
+        pthread_rwlock_init(&dir_locks[i], NULL);
+}
+
+/* Clean gaps of up to this many bytes between dirty ranges are written along
+ * with them, which is cheaper than issuing another write. */
+#define DIRTY_MERGE_GAP 64u
+
+/* An unused entry; set up by meta_load(), as its encoding depends on the
+ * version of the image. */
+static struct sfs_entry empty_entry;
+
+
+static inline void mark_dirty(uint64_t *dirty, size_t idx)
+{
+    dirty[idx / 64] |= 1ull << (idx % 64);
+}
+
+static inline int is_dirty(const uint64_t *dirty, size_t idx)
+{
+    return (dirty[idx / 64] >> (idx % 64)) & 1;
+}
+
+
+/*
+ * Write the dirty elements of `base` (an array of `nelems` elements of
+ * `elem_size` bytes, stored on disk at `disk_off`) back to disk, and mark them
+ * clean again.
+ */
+static void flush_dirty(uint64_t *dirty, size_t nelems, const void *base,
+                        size_t elem_size, off_t disk_off)
+{
+    const char *p = base;
+    size_t max_gap = DIRTY_MERGE_GAP / elem_size;
+    size_t i = 0;
+
+    while (i < nelems) {
+        if (!dirty[i / 64] && i % 64 == 0) {
+            i += 64;
+            continue;
+        }
+        if (!is_dirty(dirty, i)) {
+            i++;
+            continue;
+        }
+
+        size_t start = i, end = i + 1, gap = 0;
+        for (i++; i < nelems && gap <= max_gap; i++) {
+            if (is_dirty(dirty, i)) {
+                end = i + 1;
+                gap = 0;
+            } else
+                gap++;
+        }
+        i = end;
+        disk_write(p + start * elem_size, (end - start) * elem_size,
+                   disk_off + start * elem_size);
+    }
+
+    memset(dirty, 0, BITMAP_WORDS(nelems) * sizeof(uint64_t));
+}
+
+
+/*
+ * Add the dirty elements of `base` (laid out as for flush_dirty) to the current
+ * journal transaction, one record per run of consecutive dirty elements, and
+ * move them from `dirty` to `logged`.
+ */
+static void log_dirty(uint64_t *dirty, uint64_t *logged, size_t nelems,
+                      const void *base, size_t elem_size, off_t disk_off)
+{
+    const char *p = base;
+    size_t i = 0;
+
+    while (i < nelems) {
+        if (!dirty[i / 64] && i % 64 == 0) {
+            i += 64;
+            continue;
+        }
+        if (!is_dirty(dirty, i)) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        for (; i < nelems && is_dirty(dirty, i); i++)
+            mark_dirty(logged, i);
+        disk_journal_add(p + start * elem_size, (i - start) * elem_size,
+                         disk_off + start * elem_size);
+    }
+
+    memset(dirty, 0, BITMAP_WORDS(nelems) * sizeof(uint64_t));
+}
+
+
+/* Once the journal holds this many bytes, its contents are checkpointed. */
+#define JOURNAL_CHECKPOINT_SIZE (4u << 20)
+
+/*
+ * meta_flush() with --journal: commit all metadata changes since the last
+ * flush as one journal transaction, instead of writing them to their home
+ * locations. Creating many files thus appends to the journal sequentially,
+ * rather than writing scattered entries and block table slots.
+ *
+ * If `checkpoint` is set, or the journal has grown too large, everything
+ * logged so far is then written back and the journal is emptied. The journal
+ * is synced first, so if that is interrupted the journal can still be
+ * replayed. Called with flush_lock held.
+ */
+static void meta_flush_journal(int checkpoint)
+{
+    pthread_rwlock_wrlock(&txn_lock);
+    bcache_flush(0);
+
+    entries_lock(geom.rootdir_off, ROOTDIR_SIZE, 0);
+    log_dirty(root_dir_dirty, root_dir_logged, geom.rootdir_nentries, root_dir,
+              sizeof(struct sfs_entry), geom.rootdir_off);
+    entries_unlock(geom.rootdir_off, ROOTDIR_SIZE);
+
+    pthread_mutex_lock(&alloc_lock);
+    log_dirty(block_table_dirty, block_table_logged, geom.nblocks,
+              BLOCKTBL_DISK, geom.blockidx_size, geom.blocktbl_off);
+    if (block_refs)
+        log_dirty(block_refs_dirty, block_refs_logged, geom.nblocks,
+                  block_refs, sizeof(uint32_t), geom.refcnt_off);
+    if (root_next_dirty) {
+        disk_journal_add(&root_next, sizeof(root_next), ROOT_NEXT_OFF);
+        root_next_logged = 1;
+        root_next_dirty = 0;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    disk_journal_commit();
+
+    if (checkpoint || disk_journal_size() >= JOURNAL_CHECKPOINT_SIZE) {
+        disk_journal_sync();
+        bcache_flush(1);
+        flush_dirty(root_dir_logged, geom.rootdir_nentries, root_dir,
+                    sizeof(struct sfs_entry), geom.rootdir_off);
+        flush_dirty(block_table_logged, geom.nblocks, BLOCKTBL_DISK,
+                    geom.blockidx_size, geom.blocktbl_off);
+        if (block_refs)
+            flush_dirty(block_refs_logged, geom.nblocks, block_refs,
+                        sizeof(uint32_t), geom.refcnt_off);
+        if (root_next_logged)
+            disk_write(&root_next, sizeof(root_next), ROOT_NEXT_OFF);
+        root_next_logged = 0;
+        disk_sync();
+        disk_journal_reset();
+    }
+    pthread_rwlock_unlock(&txn_lock);
+}
+
+
+/*
+ * Write back all modified parts of the root directory and block table. Dirty
+ * data blocks go first, so the metadata never refers to contents that did not
+ * reach the disk.
+ *
+ * Reference counts go before anything else, so a clone never shares blocks
+ * whose count on disk says they have a single user. A count that dropped can
+ * then reach the disk before the chain that stopped using the block does,
+ * which fsck reports; only --journal makes both changes atomic.
+ */
+static void meta_flush(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    if (options.journal) {
+        meta_flush_journal(0);
+        goto out;
+    }
+
+    if (block_refs) {
+        pthread_mutex_lock(&alloc_lock);
+        flush_dirty(block_refs_dirty, geom.nblocks, block_refs,
+                    sizeof(uint32_t), geom.refcnt_off);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    bcache_flush(0);
+
+    /* root_dir_dirty only changes under an exclusive lock, so a shared one
+     * suffices to write it back. */
+    entries_lock(geom.rootdir_off, ROOTDIR_SIZE, 0);
+    flush_dirty(root_dir_dirty, geom.rootdir_nentries, root_dir,
+                sizeof(struct sfs_entry), geom.rootdir_off);
+    entries_unlock(geom.rootdir_off, ROOTDIR_SIZE);
+
+    pthread_mutex_lock(&alloc_lock);
+    flush_dirty(block_table_dirty, geom.nblocks, BLOCKTBL_DISK,
+                geom.blockidx_size, geom.blocktbl_off);
+    if (root_next_dirty)
+        disk_write(&root_next, sizeof(root_next), ROOT_NEXT_OFF);
+    root_next_dirty = 0;
+    pthread_mutex_unlock(&alloc_lock);
+
+out:
+    last_flush = time(NULL);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+
+/* Like meta_flush(), but with --journal also write back everything that is
+ * only in the journal, and empty it. */
+static void meta_checkpoint(void)
+{
+    if (!options.journal) {
+        meta_flush();
+        return;
+    }
+
+    pthread_mutex_lock(&flush_lock);
+    meta_flush_journal(1);
+    last_flush = time(NULL);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+
+/*
+ * Called at the end of every modifying operation, once it has dropped its
+ * file and directory locks. By default metadata is written through
+ * immediately; with --writeback it is only flushed once the interval has
+ * passed (or on fsync/unmount).
+ */
+static void meta_commit(void)
+{
+    time_t last;
+
+    if (!options.writeback) {
+        meta_flush();
+        return;
+    }
+
+    pthread_mutex_lock(&flush_lock);
+    last = last_flush;
+    pthread_mutex_unlock(&flush_lock);
+    if (time(NULL) - last >= options.writeback)
+        meta_flush();
+}
+
+
+/* Called with alloc_lock held, like all allocator functions below. */
+static void blocktbl_set(blockidx_t block, blockidx_t next)
+{
+    assert(block < geom.nblocks);
+    block_table[block] = next;
+    if (block_table_v1)
+        block_table_v1[block] = next;
+    mark_dirty(block_table_dirty, block);
+}
+
+
+/*
+ * Free space index: one bit per block, set when the block is unused. It is
+ * rebuilt from the block table at mount and kept in sync by the allocator, so
+ * allocations never have to scan the block table itself.
+ */
+static uint64_t *free_map;
+static unsigned free_count;
+
+/* Number of blocks that more than one file uses. */
+static unsigned shared_count;
+
+
+/*
+ * Build free_map by comparing the block table against SFS_BLOCKIDX_EMPTY, 64
+ * entries (one bitmap word) at a time. The block table is padded to a multiple
+ * of 64 entries with SFS_BLOCKIDX_END, so the blocks past the end are never
+ * free.
+ */
+static void freemap_build(void)
+{
+    size_t i;
+
+    for (i = 0; i < geom.nblocks; i += 64) {
+        const blockidx_t *p = &block_table[i];
+        uint64_t bits = 0;
+#if defined(__AVX2__)
+        const __m256i empty = _mm256_set1_epi32((int)SFS_BLOCKIDX_EMPTY);
+        for (unsigned j = 0; j < 64; j += 16) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(p + j));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(p + j + 8));
+            __m256i m = _mm256_packs_epi32(_mm256_cmpeq_epi32(a, empty),
+                                           _mm256_cmpeq_epi32(b, empty));
+            /* packs interleaves the 128-bit lanes; put them back in order. */
+            m = _mm256_permute4x64_epi64(m, 0xd8);
+            m = _mm256_packs_epi16(m, m);
+            m = _mm256_permute4x64_epi64(m, 0xd8);
+            bits |= (uint64_t)((uint32_t)_mm256_movemask_epi8(m) & 0xffff)
+                    << j;
+        }
+#elif defined(__SSE2__)
+        const __m128i empty = _mm_set1_epi32((int)SFS_BLOCKIDX_EMPTY);
+        for (unsigned j = 0; j < 64; j += 16) {
+            __m128i a = _mm_packs_epi32(
+                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + j)),
+                                empty),
+                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + j + 4)),
+                                empty));
+            __m128i b = _mm_packs_epi32(
+                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + j + 8)),
+                                empty),
+                _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + j + 12)),
+                                empty));
+            __m128i m = _mm_packs_epi16(a, b);
+            bits |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << j;
+        }
+#else
+        for (unsigned j = 0; j < 64; j++)
+            bits |= (uint64_t)(p[j] == SFS_BLOCKIDX_EMPTY) << j;
+#endif
+        free_map[i / 64] = bits;
+    }
+
+    free_count = 0;
+    for (i = 0; i < BITMAP_WORDS(geom.nblocks); i++)
+        free_count += __builtin_popcountll(free_map[i]);
+}
+
+
+/* Return the first index in [i, end) whose free bit equals `set`, or end. */
+static unsigned freemap_next(unsigned i, unsigned end, int set)
+{
+    while (i < end) {
+        uint64_t w = set ? free_map[i / 64] : ~free_map[i / 64];
+
+        w &= ~0ull << (i % 64);
+        if (w) {
+            i = (i & ~63u) + __builtin_ctzll(w);
+            return i < end ? i : end;
+        }
+        i = (i & ~63u) + 64;
+    }
+    return end;
+}
+
+
+/* Find a run of `n` free blocks in [from, to); returns its start or `to`. */
+static unsigned freemap_find_run(unsigned n, unsigned from, unsigned to)
+{
+    unsigned i = from;
+
+    while ((i = freemap_next(i, to, 1)) < to) {
+        unsigned end = freemap_next(i, to, 0);
+        if (end - i >= n)
+            return i;
+        i = end;
+    }
+    return to;
+}
+
+
+/* Take the `n` blocks starting at `start` out of the free map, and chain them
+ * (ascending) onto `prev` if that is a valid block. */
+static void claim_run(blockidx_t prev, unsigned start, unsigned n)
+{
+    for (unsigned i = start; i < start + n; i++) {
+        free_map[i / 64] &= ~(1ull << (i % 64));
+        if (prev < geom.nblocks)
+            blocktbl_set(prev, i);
+        prev = i;
+    }
+    blocktbl_set(prev, SFS_BLOCKIDX_END);
+    free_count -= n;
+}
+
+
+/*
+ * Allocate `n` contiguous blocks, searching from `hint` onwards (wrapping
+ * around). Returns the first block, or SFS_BLOCKIDX_EMPTY if there is no such
+ * run.
+ */
+static blockidx_t alloc_run(unsigned n, blockidx_t hint)
+{
+    unsigned start;
+
+    if (n == 0 || n > free_count)
+        return SFS_BLOCKIDX_EMPTY;
+
+    start = freemap_find_run(n, hint, geom.nblocks);
+    if (start == geom.nblocks) {
+        /* A run may straddle `hint`, so overlap the second search with it. */
+        unsigned to = hint + n - 1 < geom.nblocks ?
+                      hint + n - 1 : geom.nblocks;
+        start = freemap_find_run(n, 0, to);
+        if (start == to)
+            return SFS_BLOCKIDX_EMPTY;
+    }
+
+    claim_run(SFS_BLOCKIDX_END, start, n);
+    return start;
+}
+
+
+/*
+ * Allocate the first free run at or after `hint` (wrapping around), but at
+ * most `n` blocks of it, chained like alloc_run() does. Returns its first
+ * block and stores its length in `ret_len`, or returns SFS_BLOCKIDX_EMPTY if
+ * the disk is full.
+ */
+static blockidx_t alloc_first_run(unsigned n, blockidx_t hint,
+                                  unsigned *ret_len)
+{
+    unsigned start, len;
+
+    if (n == 0 || free_count == 0)
+        return SFS_BLOCKIDX_EMPTY;
+    if (hint >= geom.nblocks)
+        hint = 0;
+
+    start = freemap_next(hint, geom.nblocks, 1);
+    if (start == geom.nblocks)
+        start = freemap_next(0, hint, 1);
+
+    len = freemap_next(start, geom.nblocks, 0) - start;
+    if (len > n)
+        len = n;
+
+    claim_run(SFS_BLOCKIDX_END, start, len);
+    *ret_len = len;
+    return start;
+}
+
+
+/*
+ * Allocate `n` blocks and chain them together in the block table, terminated
+ * with SFS_BLOCKIDX_END. A single contiguous run from `hint` onwards is
+ * preferred; if there is none the chain is assembled from the free runs
+ * following `hint`, unless `contiguous` is set. Returns the first block of the
+ * chain, or SFS_BLOCKIDX_EMPTY if the blocks could not be allocated.
+ */
+static blockidx_t alloc_blocks(unsigned n, blockidx_t hint, int contiguous)
+{
+    blockidx_t first, prev;
+
+    if (hint >= geom.nblocks)
+        hint = 0;
+
+    first = alloc_run(n, hint);
+    if (first != SFS_BLOCKIDX_EMPTY || contiguous || n == 0 || n > free_count)
+        return first;
+
+    first = prev = SFS_BLOCKIDX_END;
+    while (n > 0) {
+        unsigned len;
+        blockidx_t start = alloc_first_run(n, hint, &len);
+
+        if (prev < geom.nblocks)
+            blocktbl_set(prev, start);
+        else
+            first = start;
+        prev = start + len - 1;
+        n -= len;
+        hint = start + len;
+    }
+    return first;
+}
+
+
+static inline int block_shared(blockidx_t block)
+{
+    return block_refs && block_refs[block];
+}
+
+
+static void refs_set(blockidx_t block, uint32_t refs)
+{
+    __atomic_store_n(&shared_count, shared_count + (refs != 0) -
+                     (block_refs[block] != 0), __ATOMIC_RELAXED);
+    block_refs[block] = refs;
+    mark_dirty(block_refs_dirty, block);
+}
+
+
+/* Drop a reference to `block`, which is freed if no other file shares it. */
+static void block_release(blockidx_t block)
+{
+    if (block_shared(block)) {
+        refs_set(block, block_refs[block] - 1);
+        return;
+    }
+    blocktbl_set(block, SFS_BLOCKIDX_EMPTY);
+    bcache_discard(block);
+    free_map[block / 64] |= 1ull << (block % 64);
+    free_count++;
+}
+
+
+/* Release every block in the chain starting at `block`. */
+static void free_chain(blockidx_t block)
+{
+    while (block < geom.nblocks) {
+        blockidx_t next = block_table[block];
+
+        /* Stop at blocks that are already free, so a corrupted (cyclic)
+         * chain cannot loop forever or be counted twice. */
+        if (free_map[block / 64] & (1ull << (block % 64)))
+            break;
+        block_release(block);
+        block = next;
+    }
+}
+
+
+/*
+ * Add a reference to every block of the chain starting at `block`, for a file
+ * that is going to share it. Returns 0 on success, or -EMLINK (without
+ * changing anything) if a block cannot take another one.
+ */
+static int chain_ref(blockidx_t block)
+{
+    unsigned n = 0;
+
+    for (blockidx_t b = block; b < geom.nblocks && n < geom.nblocks;
+         b = block_table[b], n++)
+        if (block_refs[b] == UINT32_MAX)
+            return -EMLINK;
+    for (blockidx_t b = block; n--; b = block_table[b])
+        refs_set(b, block_refs[b] + 1);
+    return 0;
+}
+
+
+static void *meta_alloc(size_t size)
+{
+    void *p = calloc(1, size ? size : 1);
+
+    if (!p) {
+        fprintf(stderr, "Could not allocate metadata\n");
+        exit(1);
+    }
+    return p;
+}
+
+
+static void meta_load(void)
+{
+    size_t nwords = BITMAP_WORDS(geom.nblocks);
+
+    root_dir = meta_alloc(ROOTDIR_SIZE);
+    root_dir_dirty = meta_alloc(BITMAP_WORDS(geom.rootdir_nentries) * 8);
+    root_dir_logged = meta_alloc(BITMAP_WORDS(geom.rootdir_nentries) * 8);
+    block_table = meta_alloc(nwords * 64 * sizeof(blockidx_t));
+    block_table_dirty = meta_alloc(nwords * 8);
+    block_table_logged = meta_alloc(nwords * 8);
+    free_map = meta_alloc(nwords * 8);
+
+    disk_read(root_dir, ROOTDIR_SIZE, geom.rootdir_off);
+    if (geom.version == 1) {
+        block_table_v1 = meta_alloc(geom.nblocks * sizeof(uint16_t));
+        disk_read(block_table_v1, geom.nblocks * sizeof(uint16_t),
+                  geom.blocktbl_off);
+        for (unsigned i = 0; i < geom.nblocks; i++)
+            block_table[i] = block_table_v1[i] >= SFS_V1_BLOCKIDX_END
+                             ? 0xffff0000u | block_table_v1[i]
+                             : block_table_v1[i];
+    } else {
+        disk_read(block_table, geom.nblocks * sizeof(blockidx_t),
+                  geom.blocktbl_off);
+        disk_read(&root_next, sizeof(root_next), ROOT_NEXT_OFF);
+        dir_seg_nentries = SFS_V2_DIR_NENTRIES(geom.block_size);
+    }
+    for (size_t i = geom.nblocks; i < nwords * 64; i++)
+        block_table[i] = SFS_BLOCKIDX_END;
+
+    if (geom.refcnt_off) {
+        block_refs = meta_alloc(geom.nblocks * sizeof(uint32_t));
+        block_refs_dirty = meta_alloc(nwords * 8);
+        block_refs_logged = meta_alloc(nwords * 8);
+        disk_read(block_refs, geom.nblocks * sizeof(uint32_t),
+                  geom.refcnt_off);
+        for (unsigned i = 0; i < geom.nblocks; i++)
+            shared_count += block_refs[i] != 0;
+    }
+
+    entry_set_block(&empty_entry, SFS_BLOCKIDX_EMPTY);
+    dir_seg_empty = meta_alloc(DIR_SEG_SIZE);
+    for (unsigned i = 0; i < dir_seg_nentries; i++)
+        dir_seg_empty[i] = empty_entry;
+    freemap_build();
+    last_flush = time(NULL);
+}
+
+
+/*
+ * Dentry cache: maps full paths to the directory entry they resolve to and
+ * its disk offset, so repeated lookups do not have to walk the directory tree.
+ * Paths that do not exist are cached as well (negative entries).
+ *
+ * Positive entries are also hashed by their disk offset, so that put_entry
+ * can keep them up to date whenever an entry is modified or removed. Creating
+ * an entry replaces any negative entry for its path. The least recently used
+ * entry is evicted once the cache holds options.dcache entries.
+ *
+ * A lookup that missed the cache walks the directories without dcache_lock,
+ * so its result is only added if no entry changed in the meantime
+ * (dcache_gen is bumped on every change); otherwise it might be stale.
+ */
+struct dentry {
+    struct dentry *path_next;       /* Hash chain by path */
+    struct dentry *off_next;        /* Hash chain by entry_off (positive) */
+    struct dentry *lru_prev, *lru_next;
+    uint32_t hash;
+    int negative;
+    off_t entry_off;
+    struct sfs_entry entry;
+    char path[];
+};
+
+#define DCACHE_BUCKETS 4096u
+
+static struct dentry *dcache_path[DCACHE_BUCKETS];
+static struct dentry *dcache_off[DCACHE_BUCKETS];
+static struct dentry dcache_lru = { .lru_prev = &dcache_lru,
+                                    .lru_next = &dcache_lru };
+static unsigned dcache_count;
+static unsigned long dcache_gen;
+static unsigned long dcache_hits, dcache_misses;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+static inline unsigned off_bucket(off_t entry_off)
+{
+    return (entry_off / sizeof(struct sfs_entry)) % DCACHE_BUCKETS;
+}
+
+
+static void dcache_lru_unlink(struct dentry *d)
+{
+    d->lru_prev->lru_next = d->lru_next;
+    d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void dcache_lru_push(struct dentry *d)
+{
+    d->lru_next = dcache_lru.lru_next;
+    d->lru_prev = &dcache_lru;
+    dcache_lru.lru_next->lru_prev = d;
+    dcache_lru.lru_next = d;
+}
+
+
+static void dcache_off_unlink(struct dentry *d)
+{
+    struct dentry **pp = &dcache_off[off_bucket(d->entry_off)];
+
+    while (*pp != d)
+        pp = &(*pp)->off_next;
+    *pp = d->off_next;
+}
+
+
+static void dcache_remove(struct dentry *d)
+{
+    struct dentry **pp = &dcache_path[d->hash % DCACHE_BUCKETS];
+
+    while (*pp != d)
+        pp = &(*pp)->path_next;
+    *pp = d->path_next;
+
+    if (!d->negative)
+        dcache_off_unlink(d);
+    dcache_lru_unlink(d);
+    dcache_count--;
+    free(d);
+}
+
+
+static struct dentry *dcache_find(const char *path, uint32_t hash)
+{
+    struct dentry *d;
+
+    for (d = dcache_path[hash % DCACHE_BUCKETS]; d; d = d->path_next)
+        if (d->hash == hash && strcmp(d->path, path) == 0)
+            return d;
+    return NULL;
+}
+
+
+/*
+ * Look up `path` in the cache. On a hit, the result get_entry should return is
+ * stored in `ret_res` (with the entry itself for positive hits) and 1 is
+ * returned; on a miss the current generation is stored in `ret_gen`, for
+ * dcache_insert_result(), and 0 is returned.
+ */
+static int dcache_lookup(const char *path, struct sfs_entry *ret_entry,
+                         off_t *ret_entry_off, int *ret_res,
+                         unsigned long *ret_gen)
+{
+    struct dentry *d;
+
+    pthread_mutex_lock(&dcache_lock);
+    if (!(d = dcache_find(path, path_hash(path)))) {
+        *ret_gen = dcache_gen;
+        dcache_misses++;
+        pthread_mutex_unlock(&dcache_lock);
+        return 0;
+    }
+    dcache_hits++;
+
+    dcache_lru_unlink(d);
+    dcache_lru_push(d);
+
+    if (d->negative) {
+        *ret_res = -ENOENT;
+    } else {
+        *ret_entry = d->entry;
+        *ret_entry_off = d->entry_off;
+        *ret_res = 0;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return 1;
+}
+
+
+static void dcache_insert_locked(const char *path,
+                                 const struct sfs_entry *entry,
+                                 off_t entry_off)
+{
+    uint32_t hash = path_hash(path);
+    struct dentry *d;
+
+    if ((d = dcache_find(path, hash)))
+        dcache_remove(d);
+    if (dcache_count >= options.dcache)
+        dcache_remove(dcache_lru.lru_prev);
+
+    d = malloc(sizeof(*d) + strlen(path) + 1);
+    if (!d)
+        return;
+    strcpy(d->path, path);
+    d->hash = hash;
+    d->negative = entry == NULL;
+    d->path_next = dcache_path[hash % DCACHE_BUCKETS];
+    dcache_path[hash % DCACHE_BUCKETS] = d;
+
+    if (entry) {
+        d->entry = *entry;
+        d->entry_off = entry_off;
+        d->off_next = dcache_off[off_bucket(entry_off)];
+        dcache_off[off_bucket(entry_off)] = d;
+    }
+
+    dcache_lru_push(d);
+    dcache_count++;
+}
+
+
+/* Cache the lookup result for `path`: `entry` at `entry_off`, or a negative
+ * entry if `entry` is NULL. Replaces any previous entry for `path`. */
+static void dcache_insert(const char *path, const struct sfs_entry *entry,
+                          off_t entry_off)
+{
+    if (!options.dcache)
+        return;
+
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    dcache_insert_locked(path, entry, entry_off);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+/* Like dcache_insert(), for the result of a lookup that started when
+ * dcache_lookup() returned generation `gen`. */
+static void dcache_insert_result(const char *path,
+                                 const struct sfs_entry *entry,
+                                 off_t entry_off, unsigned long gen)
+{
+    if (!options.dcache)
+        return;
+
+    pthread_mutex_lock(&dcache_lock);
+    if (gen == dcache_gen)
+        dcache_insert_locked(path, entry, entry_off);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+/* The entry at `entry_off` was changed to `entry`: update the cached copy, or
+ * turn it into a negative entry if it was removed. */
+static void dcache_update(off_t entry_off, const struct sfs_entry *entry)
+{
+    struct dentry *d;
+
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    for (d = dcache_off[off_bucket(entry_off)]; d; d = d->off_next)
+        if (d->entry_off == entry_off)
+            break;
+
+    if (d && entry->filename[0] != '\0') {
+        d->entry = *entry;
+    } else if (d) {
+        dcache_off_unlink(d);
+        d->negative = 1;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+/*
+ * Store `entry` at disk offset `entry_off`, as returned by get_entry. Entries
+ * of the root directory are updated in memory, others are written directly
+ * (or journaled). The caller holds the entry's lock exclusively, and txn_lock
+ * shared.
+ */
+static void put_entry(off_t entry_off, const struct sfs_entry *entry)
+{
+    if (entry_off < ROOTDIR_END) {
+        unsigned idx = (entry_off - geom.rootdir_off) / sizeof(struct sfs_entry);
+
+        root_dir[idx] = *entry;
+        mark_dirty(root_dir_dirty, idx);
+    } else
+        meta_write(entry, sizeof(struct sfs_entry), entry_off);
+
+    dcache_update(entry_off, entry);
+}
+
+
+/* Read the entry at disk offset `entry_off`; the caller holds its lock. */
+static void entry_read(off_t entry_off, struct sfs_entry *entry)
+{
+    if (entry_off < ROOTDIR_END)
+        *entry = root_dir[(entry_off - geom.rootdir_off) /
+                          sizeof(struct sfs_entry)];
+    else
+        data_rw(0, entry, sizeof(struct sfs_entry), entry_off);
+}
+
+
+/*
+ * Read the entry at `entry_off` again, now that the caller holds the lock of
+ * the open file it belongs to, and check that it still is the entry called
+ * `name` (or any file, if `name` is NULL) that an earlier lookup found there;
+ * it may have been removed or replaced in the meantime.
+ * Returns 0 on success, < 0 on error.
+ */
+static int entry_reload(off_t entry_off, const char *name,
+                        struct sfs_entry *entry)
+{
+    entry_lock(entry_off, 0);
+    entry_read(entry_off, entry);
+    entry_unlock(entry_off);
+
+    if (entry->filename[0] == '\0' ||
+            (name && strcmp(entry->filename, name) != 0))
+        return -ENOENT;
+    return entry->size & SFS_DIRECTORY ? -EISDIR : 0;
+}
+
+
+/* Make room for element `n` of `arr`, which has room for `*cap` elements of
+ * `size` bytes. Returns the (possibly moved) array, or NULL if out of memory,
+ * in which case `arr` is left as it is. */
+static void *array_grow(void *arr, unsigned n, unsigned *cap, size_t size)
+{
+    unsigned new_cap = *cap ? *cap * 2 : 16;
+    void *p;
+
+    if (n < *cap)
+        return arr;
+    if ((p = realloc(arr, (size_t)new_cap * size)))
+        *cap = new_cap;
+    return p;
+}
+
+
+/*
+ * Directories consist of segments of entries, each stored in consecutive
+ * blocks: a subdirectory is a chain of segments of dir_seg_nentries entries,
+ * and the root directory is its region of the image, followed (on version 2
+ * images) by a chain of segments starting at root_next. A full directory
+ * grows by another segment on version 2 images; version 1 directories keep
+ * their fixed size.
+ *
+ * Rather than scanning all segments, names are looked up through an index that
+ * is built once per directory, on first use: a hash table of the used slots,
+ * and a stack of the unused ones. A slot is an entry's position in the
+ * directory, across its segments. The index only holds name hashes, so
+ * candidates are confirmed by reading their entry.
+ */
+#define DIR_SLOT_NONE UINT32_MAX
+
+struct sfs_dir {
+    struct sfs_dir *next;       /* Hash chain in dirs */
+    off_t off;                  /* Of the first segment, identifies the dir */
+    pthread_rwlock_t lock;
+    int built;
+    off_t *segs;                /* Disk offsets of the segments */
+    unsigned nsegs, segs_cap;
+    unsigned nslots, nused;
+    uint32_t *hashes;           /* By slot: hash of the name, if used */
+    uint32_t *chain;            /* By slot: next used slot in the bucket */
+    uint32_t *buckets;          /* First used slot, by hash */
+    unsigned nbuckets;          /* A power of two, at least nslots */
+    uint32_t *free;             /* Unused slots, the lowest on top */
+    unsigned nfree;
+};
+
+#define DIR_BUCKETS 256u
+
+static struct sfs_dir *dirs[DIR_BUCKETS];
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static inline unsigned dir_bucket(off_t off)
+{
+    return (off / sizeof(struct sfs_entry)) % DIR_BUCKETS;
+}
+
+/* Return the index of directory `off` (the disk offset of its first segment),
+ * which is only built once it is locked; NULL if out of memory. */
+static struct sfs_dir *dir_get(off_t off)
+{
+    struct sfs_dir *d;
+
+    pthread_mutex_lock(&dirs_lock);
+    for (d = dirs[dir_bucket(off)]; d; d = d->next)
+        if (d->off == off)
+            break;
+    if (!d && (d = calloc(1, sizeof(*d)))) {
+        d->off = off;
+        pthread_rwlock_init(&d->lock, NULL);
+        d->next = dirs[dir_bucket(off)];
+        dirs[dir_bucket(off)] = d;
+    }
+    pthread_mutex_unlock(&dirs_lock);
+    return d;
+}
+
+static void dir_free_index(struct sfs_dir *d)
+{
+    free(d->segs);
+    free(d->hashes);
+    free(d->chain);
+    free(d->buckets);
+    free(d->free);
+    d->segs = NULL;
+    d->hashes = d->chain = d->buckets = d->free = NULL;
+    d->nsegs = d->segs_cap = d->nslots = d->nused = d->nbuckets = 0;
+    d->nfree = 0;
+    d->built = 0;
+}
+
+/* Drop the index of directory `off`, which was removed. The caller holds
+ * ns_lock exclusively, so no one else uses it. */
+static void dir_forget(off_t off)
+{
+    struct sfs_dir **pp, *d;
+
+    pthread_mutex_lock(&dirs_lock);
+    for (pp = &dirs[dir_bucket(off)]; (d = *pp); pp = &d->next) {
+        if (d->off == off) {
+            *pp = d->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dirs_lock);
+
+    if (d) {
+        dir_free_index(d);
+        pthread_rwlock_destroy(&d->lock);
+        free(d);
+    }
+}
+
+
+static inline unsigned dir_seg_len(const struct sfs_dir *d, unsigned seg)
+{
+    return seg == 0 && d->off == geom.rootdir_off ? geom.rootdir_nentries
+                                                  : dir_seg_nentries;
+}
+
+/* The first slot in segment `seg` of `d`. */
+static inline unsigned dir_seg_first(const struct sfs_dir *d, unsigned seg)
+{
+    return seg == 0 ? 0 : dir_seg_len(d, 0) + (seg - 1) * dir_seg_nentries;
+}
+
+static inline unsigned dir_slot_seg(const struct sfs_dir *d, unsigned slot)
+{
+    unsigned n0 = dir_seg_len(d, 0);
+
+    return slot < n0 ? 0 : 1 + (slot - n0) / dir_seg_nentries;
+}
+
+static inline off_t dir_slot_off(const struct sfs_dir *d, unsigned slot)
+{
+    unsigned seg = dir_slot_seg(d, slot);
+
+    return d->segs[seg] +
+           (off_t)(slot - dir_seg_first(d, seg)) * sizeof(struct sfs_entry);
+}
+
+/* Lock segment `seg` of `d` for reading and return its entries, using
+ * `scratch` (of DIR_SEG_SIZE bytes) if they have to be read from disk. */
+static const struct sfs_entry *dir_seg_get(const struct sfs_dir *d,
+                                           unsigned seg,
+                                           struct sfs_entry *scratch)
+{
+    entries_lock(d->segs[seg], dir_seg_len(d, seg) * sizeof(struct sfs_entry),
+                 0);
+    if (d->segs[seg] == geom.rootdir_off)
+        return root_dir;
+    return dir_view(scratch, d->segs[seg]);
+}
+
+static void dir_seg_put(const struct sfs_dir *d, unsigned seg)
+{
+    entries_unlock(d->segs[seg],
+                   dir_seg_len(d, seg) * sizeof(struct sfs_entry));
+}
+
+
+/* Make room for `nslots` slots in the index of `d`, rehashing it if that
+ * needs more buckets. Returns 0 on success, < 0 on error. */
+static int dir_resize(struct sfs_dir *d, unsigned nslots)
+{
+    unsigned nbuckets = d->nbuckets ? d->nbuckets : 16;
+    uint32_t *p, *buckets;
+
+    if (!(p = realloc(d->hashes, nslots * sizeof(uint32_t))))
+        return -ENOMEM;
+    d->hashes = p;
+    if (!(p = realloc(d->chain, nslots * sizeof(uint32_t))))
+        return -ENOMEM;
+    d->chain = p;
+    if (!(p = realloc(d->free, nslots * sizeof(uint32_t))))
+        return -ENOMEM;
+    d->free = p;
+
+    while (nbuckets < nslots)
+        nbuckets *= 2;
+    if (nbuckets == d->nbuckets)
+        return 0;
+    if (!(buckets = malloc(nbuckets * sizeof(uint32_t))))
+        return -ENOMEM;
+    for (unsigned i = 0; i < nbuckets; i++)
+        buckets[i] = DIR_SLOT_NONE;
+
+    for (unsigned i = 0; i < d->nbuckets; i++) {
+        uint32_t slot = d->buckets[i];
+
+        while (slot != DIR_SLOT_NONE) {
+            uint32_t next = d->chain[slot];
+            uint32_t *head = &buckets[d->hashes[slot] & (nbuckets - 1)];
+
+            d->chain[slot] = *head;
+            *head = slot;
+            slot = next;
+        }
+    }
+    free(d->buckets);
+    d->buckets = buckets;
+    d->nbuckets = nbuckets;
+    return 0;
+}
+
+static void dir_insert(struct sfs_dir *d, uint32_t slot, uint32_t hash)
+{
+    uint32_t *head = &d->buckets[hash & (d->nbuckets - 1)];
+
+    d->hashes[slot] = hash;
+    d->chain[slot] = *head;
+    *head = slot;
+    d->nused++;
+}
+
+/* Add the segments from `seg` on, which are unused, to the free slots. */
+static void dir_add_free(struct sfs_dir *d, unsigned seg)
+{
+    for (unsigned slot = d->nslots; slot-- > dir_seg_first(d, seg); )
+        d->free[d->nfree++] = slot;
+}
+
+/* Read all segments of `d` into its index. The caller holds its lock
+ * exclusively. Returns 0 on success, < 0 on error. */
+static int dir_build(struct sfs_dir *d)
+{
+    struct sfs_entry *scratch = malloc(DIR_SEG_SIZE);
+    blockidx_t b;
+    unsigned nfree = 0;
+    int res = -ENOMEM;
+
+    if (!scratch || !(d->segs = array_grow(NULL, 0, &d->segs_cap,
+                                           sizeof(off_t))))
+        goto out;
+    d->segs[d->nsegs++] = d->off;
+
+    /* The chain continues after the first segment (of a subdirectory), and
+     * every segment ends in a link to the next one. */
+    if (d->off == geom.rootdir_off) {
+        b = root_next;
+    } else {
+        b = (d->off - geom.data_off) / geom.block_size;
+        for (unsigned i = 0; i < DIR_SEG_BLOCKS && b < geom.nblocks; i++)
+            b = block_table[b];
+    }
+    while (b < geom.nblocks && d->nsegs <= geom.nblocks) {
+        off_t *segs = array_grow(d->segs, d->nsegs, &d->segs_cap,
+                                 sizeof(off_t));
+
+        if (!segs)
+            goto out;
+        d->segs = segs;
+        d->segs[d->nsegs++] = block_off(b);
+        for (unsigned i = 0; i < DIR_SEG_BLOCKS && b < geom.nblocks; i++)
+            b = block_table[b];
+    }
+
+    d->nslots = dir_seg_first(d, d->nsegs);
+    if ((res = dir_resize(d, d->nslots)))
+        goto out;
+
+    for (unsigned seg = 0; seg < d->nsegs; seg++) {
+        const struct sfs_entry *entries = dir_seg_get(d, seg, scratch);
+        unsigned first = dir_seg_first(d, seg);
+
+        for (unsigned i = 0; i < dir_seg_len(d, seg); i++) {
+            if (entries[i].filename[0] != '\0')
+                dir_insert(d, first + i, path_hash(entries[i].filename));
+            else
+                d->free[nfree++] = first + i;
+        }
+        dir_seg_put(d, seg);
+    }
+
+    /* Hand out the lowest slots first, as a scan would. */
+    for (unsigned i = 0; i < nfree / 2; i++) {
+        uint32_t t = d->free[i];
+
+        d->free[i] = d->free[nfree - 1 - i];
+        d->free[nfree - 1 - i] = t;
+    }
+    d->nfree = nfree;
+    d->built = 1;
+
+out:
+    if (res)
+        dir_free_index(d);
+    free(scratch);
+    return res;
+}
+
+/*
+ * Lock `d`, exclusively if `write`, building its index first if this is its
+ * first use.
+ * Returns 0 on success, < 0 on error.
+ */
+static int dir_lock(struct sfs_dir *d, int write)
+{
+    int res = 0;
+
+    for (;;) {
+        if (write)
+            pthread_rwlock_wrlock(&d->lock);
+        else
+            pthread_rwlock_rdlock(&d->lock);
+        if (d->built)
+            return 0;
+
+        if (!write) {
+            pthread_rwlock_unlock(&d->lock);
+            pthread_rwlock_wrlock(&d->lock);
+        }
+        if (!d->built)
+            res = dir_build(d);
+        if (res || write) {
+            if (res)
+                pthread_rwlock_unlock(&d->lock);
+            return res;
+        }
+        pthread_rwlock_unlock(&d->lock);
+    }
+}
+
+static inline void dir_unlock(struct sfs_dir *d)
+{
+    pthread_rwlock_unlock(&d->lock);
+}
+
+
+/* Find the entry called `name` (with hash `hash`) in `d`, which is locked, and
+ * return it in `ret_entry` (if not NULL). Returns its slot, or DIR_SLOT_NONE. */
+static uint32_t dir_find(struct sfs_dir *d, const char *name, uint32_t hash,
+                         struct sfs_entry *ret_entry)
+{
+    uint32_t slot = d->buckets[hash & (d->nbuckets - 1)];
+    struct sfs_entry entry;
+
+    for (; slot != DIR_SLOT_NONE; slot = d->chain[slot]) {
+        off_t off = dir_slot_off(d, slot);
+
+        if (d->hashes[slot] != hash)
+            continue;
+        entry_lock(off, 0);
+        entry_read(off, &entry);
+        entry_unlock(off);
+        if (strcmp(entry.filename, name) == 0) {
+            if (ret_entry)
+                *ret_entry = entry;
+            return slot;
+        }
+    }
+    return DIR_SLOT_NONE;
+}
+
+/* Find the entry called `name` in `dir`. */
+static int dir_lookup(struct sfs_dir *dir, const char *name,
+                      struct sfs_entry *ret_entry, off_t *ret_entry_off)
+{
+    uint32_t slot;
+    int res;
+
+    if ((res = dir_lock(dir, 0)))
+        return res;
+    slot = dir_find(dir, name, path_hash(name), ret_entry);
+    if (slot != DIR_SLOT_NONE)
+        *ret_entry_off = dir_slot_off(dir, slot);
+    dir_unlock(dir);
+    return slot != DIR_SLOT_NONE ? 0 : -ENOENT;
+}
+
+/* Remove the entry at `entry_off`, called `name`, from the index of `d`, which
+ * is locked exclusively. */
+static void dir_unlink(struct sfs_dir *d, const char *name, off_t entry_off)
+{
+    uint32_t hash = path_hash(name);
+    uint32_t *pp = &d->buckets[hash & (d->nbuckets - 1)];
+
+    for (; *pp != DIR_SLOT_NONE; pp = &d->chain[*pp]) {
+        uint32_t slot = *pp;
+
+        if (dir_slot_off(d, slot) == entry_off) {
+            *pp = d->chain[slot];
+            d->free[d->nfree++] = slot;
+            d->nused--;
+            return;
+        }
+    }
+}
+
+/* Add another segment to `d`, which is locked exclusively, and is full.
+ * Returns 0 on success, < 0 on error. */
+static int dir_grow(struct sfs_dir *d)
+{
+    int root = d->off == geom.rootdir_off;
+    blockidx_t last = SFS_BLOCKIDX_END, first;
+    off_t *segs;
+    int res;
+
+    if (geom.version == 1)
+        return -ENOSPC;
+
+    if (!(segs = array_grow(d->segs, d->nsegs, &d->segs_cap, sizeof(off_t))))
+        return -ENOMEM;
+    d->segs = segs;
+    if ((res = dir_resize(d, d->nslots + dir_seg_nentries)))
+        return res;
+
+    if (!root || d->nsegs > 1)
+        last = (d->segs[d->nsegs - 1] - geom.data_off) / geom.block_size +
+               DIR_SEG_BLOCKS - 1;
+
+    pthread_mutex_lock(&alloc_lock);
+    first = alloc_blocks(DIR_SEG_BLOCKS, last + 1, 1);
+    if (first != SFS_BLOCKIDX_EMPTY && last < geom.nblocks) {
+        blocktbl_set(last, first);
+    } else if (first != SFS_BLOCKIDX_EMPTY) {
+        root_next = first;
+        root_next_dirty = 1;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (first == SFS_BLOCKIDX_EMPTY)
+        return -ENOSPC;
+    data_rw(1, dir_seg_empty, DIR_SEG_SIZE, block_off(first));
+
+    d->segs[d->nsegs++] = block_off(first);
+    d->nslots += dir_seg_nentries;
+    dir_add_free(d, d->nsegs - 1);
+    return 0;
+}
+
+/*
+ * Find an unused slot in `dir`, which is locked exclusively, growing it if it
+ * is full, and return it with the hash of `name`. Fails with -EEXIST if `dir`
+ * already holds an entry called `name`, which may have been created by a
+ * concurrent operation since the caller looked it up.
+ */
+static int dir_find_free(struct sfs_dir *dir, const char *name,
+                         uint32_t *ret_slot, uint32_t *ret_hash)
+{
+    int res;
+
+    *ret_hash = path_hash(name);
+    if (dir_find(dir, name, *ret_hash, NULL) != DIR_SLOT_NONE)
+        return -EEXIST;
+    if (!dir->nfree && (res = dir_grow(dir)))
+        return res;
+
+    *ret_slot = dir->free[dir->nfree - 1];
+    return 0;
+}
+
+
+/*
+ * Split `path` into its parent directory and final component. The returned
+ * parent path is allocated and has to be freed by the caller; `ret_name`
+ * points into `path`.
+ */
+static char *split_path(const char *path, const char **ret_name)
+{
+    char *parent = strdup(path);
+    char *end = strrchr(parent, '/');
+
+    *ret_name = path + (end - parent) + 1;
+    if (end == parent)
+        end[1] = '\0';
+    else
+        *end = '\0';
+    return parent;
+}
+
+
+static int get_entry_rec(const char *path, struct sfs_dir *dir,
+                         struct sfs_entry *ret_entry, off_t *ret_entry_off) {
+
+    if(!path || !dir) 
+        return -EINVAL;  
+
+    char *path_copy = strdup(path);  
+    char *current = strtok(path_copy, "/");  
+    char *next = strtok(NULL, ""); 
+    int res = -ENOENT;
+    struct sfs_entry found;
+
+    /* Only this directory is locked; it is released before descending. */
+    if(current) 
+        res = dir_lookup(dir, current, &found, ret_entry_off);
+
+    if(res == 0 && !next) 
+        *ret_entry = found;
+    else if(res == 0 && !(found.size & SFS_DIRECTORY)) 
+        res = -ENOTDIR;
+    else if(res == 0 && !(dir = dir_get(block_off(entry_block(&found))))) 
+        res = -ENOMEM;
+    else if(res == 0) 
+        res = get_entry_rec(next, dir, ret_entry, ret_entry_off);
+
+    free(path_copy);
+    return res;
+}
+
+
+static int get_entry(const char *path, struct sfs_entry *ret_entry,
+                     off_t *ret_entry_off)
+{
+    unsigned long gen;
+    int res;
+
+    if(dcache_lookup(path, ret_entry, ret_entry_off, &res, &gen)) 
+        return res;
+
+    struct sfs_dir *root = dir_get(geom.rootdir_off);
+
+    res = root ? get_entry_rec(path, root, ret_entry, ret_entry_off) : -ENOMEM;
+    dcache_insert_result(path, res == 0 ? ret_entry : NULL,
+                         res == 0 ? *ret_entry_off : 0, gen);
+    return res;
+}
+
+
+/* Look up the directory at `path` and return its index. */
+static int get_dir(const char *path, struct sfs_dir **ret_dir)
+{
+    struct sfs_entry entry;
+    off_t entry_off;
+    off_t off = geom.rootdir_off;
+
+    if (strcmp(path, "/") != 0) {
+        if (get_entry(path, &entry, &entry_off) != 0)
+            return -ENOENT;
+        if (!(entry.size & SFS_DIRECTORY))
+            return -ENOTDIR;
+        off = block_off(entry_block(&entry));
+    }
+
+    *ret_dir = dir_get(off);
+    return *ret_dir ? 0 : -ENOMEM;
+}
+
+
+/*
+ * Files with SFS_EXTENTS set are mapped by a list of extents rather than a
+ * chain. An open file holds the whole list in memory, with the logical block
+ * each extent starts at.
+ */
+struct file_extent {
+    blockidx_t start;
+    unsigned len;
+    unsigned lblk;
+};
+
+#define EXT_PER_BLOCK ((unsigned)(geom.block_size / sizeof(struct sfs_extent)))
+
+/*
+ * State shared by all open handles of a file; fi->fh points to it. It holds a
+ * flattened copy of the file's block chain, so any logical block can be found
+ * without walking the block table: blocks[i] is the i'th block of the file for
+ * i < nblocks. The array is extended lazily by file_block(), and is always a
+ * prefix of the chain currently in the block table. For files mapped by
+ * extents, `ext` holds the extent list instead, loaded on first use, and
+ * `list` the blocks it is stored in.
+ *
+ * Operations on the file's contents hold `lock`; since readers extend the
+ * chain index and update the readahead state too, those have a mutex of their
+ * own.
+ */
+struct sfs_file {
+    struct sfs_file *next;
+    off_t entry_off;
+    unsigned refcount;
+    pthread_rwlock_t lock;
+    pthread_mutex_t idx_lock;
+    blockidx_t first_block;
+    blockidx_t *blocks;
+    unsigned nblocks;
+    unsigned cap;
+    struct file_extent *ext;
+    unsigned nextents;
+    unsigned ext_cap;
+    unsigned ext_hint;      /* Extent the last lookup found its block in. */
+    blockidx_t *list;
+    unsigned nlist;
+    unsigned list_cap;
+    size_t ra_next;         /* Offset a sequential read would start at. */
+    unsigned ra_window;     /* Current readahead window in blocks, or 0. */
+    unsigned ra_end;        /* First logical block not read ahead yet. */
+};
+
+#define OPEN_FILE_BUCKETS 256u
+
+static struct sfs_file *open_files[OPEN_FILE_BUCKETS];
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static struct sfs_file *file_find(off_t entry_off)
+{
+    struct sfs_file *f = open_files[off_bucket(entry_off) % OPEN_FILE_BUCKETS];
+
+    while (f && f->entry_off != entry_off)
+        f = f->next;
+    return f;
+}
+
+
+/* Return the state of the file whose entry is at `entry_off`, creating it if
+ * it is not open yet. Every call has to be paired with file_put(). */
+static struct sfs_file *file_get(off_t entry_off)
+{
+    unsigned bucket = off_bucket(entry_off) % OPEN_FILE_BUCKETS;
+    struct sfs_file *f;
+
+    pthread_mutex_lock(&files_lock);
+    if (!(f = file_find(entry_off))) {
+        if (!(f = calloc(1, sizeof(*f))))
+            goto out;
+        f->entry_off = entry_off;
+        f->first_block = SFS_BLOCKIDX_EMPTY;
+        pthread_rwlock_init(&f->lock, NULL);
+        pthread_mutex_init(&f->idx_lock, NULL);
+        f->next = open_files[bucket];
+        open_files[bucket] = f;
+    }
+    f->refcount++;
+out:
+    pthread_mutex_unlock(&files_lock);
+    return f;
+}
+
+
+static void file_put(struct sfs_file *f)
+{
+    struct sfs_file **pp;
+
+    pthread_mutex_lock(&files_lock);
+    if (--f->refcount) {
+        pthread_mutex_unlock(&files_lock);
+        return;
+    }
+
+    pp = &open_files[off_bucket(f->entry_off) % OPEN_FILE_BUCKETS];
+    while (*pp != f)
+        pp = &(*pp)->next;
+    *pp = f->next;
+    pthread_mutex_unlock(&files_lock);
+
+    pthread_rwlock_destroy(&f->lock);
+    pthread_mutex_destroy(&f->idx_lock);
+    free(f->blocks);
+    free(f->ext);
+    free(f->list);
+    free(f);
+}
+
+
+/* Drop the cached chain of the file at `entry_off` (if it is open), because
+ * its blocks were released or relinked. */
+static void file_invalidate(off_t entry_off)
+{
+    struct sfs_file *f;
+
+    pthread_mutex_lock(&files_lock);
+    if ((f = file_find(entry_off))) {
+        pthread_mutex_lock(&f->idx_lock);
+        f->first_block = SFS_BLOCKIDX_EMPTY;
+        f->nblocks = 0;
+        pthread_mutex_unlock(&f->idx_lock);
+    }
+    pthread_mutex_unlock(&files_lock);
+}
+
+
+static const char zero_block[SFS_BLOCK_SIZE_MAX];
+
+
+/* Append block `lb` to the extent list blocks of `f`.
+ * Returns 0 on success, < 0 on error. */
+static int ext_push_list(struct sfs_file *f, blockidx_t lb)
+{
+    blockidx_t *list = array_grow(f->list, f->nlist, &f->list_cap,
+                                  sizeof(*list));
+
+    if (!list)
+        return -ENOMEM;
+    f->list = list;
+    f->list[f->nlist++] = lb;
+    return 0;
+}
+
+
+/* Append `e` to the extents of `f`. Returns 0 on success, < 0 on error. */
+static int ext_push(struct sfs_file *f, const struct file_extent *e)
+{
+    struct file_extent *ext = array_grow(f->ext, f->nextents, &f->ext_cap,
+                                         sizeof(*ext));
+
+    if (!ext)
+        return -ENOMEM;
+    f->ext = ext;
+    f->ext[f->nextents++] = *e;
+    return 0;
+}
+
+
+/*
+ * Load the extent list of file `f` (with entry `entry`), stopping once it
+ * covers the file's size. The blocks of the list are all collected, so that
+ * none are lost if the list is shortened. Called with f->idx_lock held.
+ * Returns 0 on success, < 0 on error.
+ */
+static int ext_load(struct sfs_file *f, const struct sfs_entry *entry)
+{
+    unsigned nblocks = DIV_ROUND_UP(entry->size & SFS_SIZEMASK,
+                                    geom.block_size);
+    unsigned have = 0, done = 0;
+    struct sfs_extent *buf = malloc(geom.block_size);
+    blockidx_t lb = entry_block(entry);
+
+    f->first_block = SFS_BLOCKIDX_EMPTY;
+    f->nextents = f->nlist = f->ext_hint = 0;
+    if (!buf)
+        return -ENOMEM;
+
+    /* A cyclic chain cannot be longer than the disk. */
+    while (lb < geom.nblocks && f->nlist < geom.nblocks) {
+        if (ext_push_list(f, lb))
+            goto fail;
+
+        if (have >= nblocks)
+            done = 1;
+        if (!done)
+            data_rw(0, buf, geom.block_size, block_off(lb));
+        for (unsigned i = 0; !done && i < EXT_PER_BLOCK; i++) {
+            struct file_extent e = { buf[i].start, buf[i].len, have };
+
+            if (have >= nblocks || e.len == 0 || e.start >= geom.nblocks ||
+                    e.len > geom.nblocks - e.start) {
+                done = 1;
+                break;
+            }
+            if (ext_push(f, &e))
+                goto fail;
+            have += e.len;
+        }
+        lb = block_table[lb];
+    }
+
+    free(buf);
+    f->first_block = entry_block(entry);
+    return 0;
+
+fail:
+    free(buf);
+    f->nextents = f->nlist = 0;
+    return -ENOMEM;
+}
+
+
+/* Return the index of the extent of `f` that holds logical block `idx`, or
+ * f->nextents if there is none. */
+static unsigned ext_find(struct sfs_file *f, unsigned idx)
+{
+    unsigned lo = 0, hi = f->nextents;
+
+    /* Sequential access stays in the same extent, or moves to the next. */
+    for (unsigned i = f->ext_hint; i < hi && i <= f->ext_hint + 1; i++)
+        if (f->ext[i].lblk <= idx && idx - f->ext[i].lblk < f->ext[i].len)
+            return i;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (f->ext[mid].lblk + f->ext[mid].len <= idx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < f->nextents && f->ext[lo].lblk <= idx ? lo : f->nextents;
+}
+
+
+/*
+ * Return logical block `idx` of file `f` with entry `entry`, or
+ * SFS_BLOCKIDX_END if the file has fewer blocks.
+ */
+static blockidx_t file_block(struct sfs_file *f, const struct sfs_entry *entry,
+                             unsigned idx)
+{
+    blockidx_t first_block = entry_block(entry);
+    blockidx_t block = SFS_BLOCKIDX_END;
+
+    pthread_mutex_lock(&f->idx_lock);
+    if (entry->size & SFS_EXTENTS) {
+        unsigned i;
+
+        if (first_block != f->first_block && ext_load(f, entry) < 0)
+            goto out;
+        if ((i = ext_find(f, idx)) < f->nextents) {
+            block = f->ext[i].start + (idx - f->ext[i].lblk);
+            f->ext_hint = i;
+        }
+        goto out;
+    }
+
+    if (first_block != f->first_block) {
+        f->first_block = first_block;
+        f->nblocks = 0;
+    }
+
+    while (f->nblocks <= idx) {
+        blockidx_t next = f->nblocks ? block_table[f->blocks[f->nblocks - 1]]
+                                     : first_block;
+
+        if (next >= geom.nblocks)
+            goto out;
+
+        blockidx_t *blocks = array_grow(f->blocks, f->nblocks, &f->cap,
+                                        sizeof(*blocks));
+        if (!blocks)
+            goto out;
+        f->blocks = blocks;
+        f->blocks[f->nblocks++] = next;
+    }
+    block = f->blocks[idx];
+out:
+    pthread_mutex_unlock(&f->idx_lock);
+    return block;
+}
+
+
+/*
+ * Write extents [from, to) of the list of `f` back to its blocks, where those
+ * from f->nextents on are written as empty ones, which ends the list.
+ */
+static void ext_write(struct sfs_file *f, unsigned from, unsigned to)
+{
+    struct sfs_extent buf[64];
+
+    if (to > f->nlist * EXT_PER_BLOCK)
+        to = f->nlist * EXT_PER_BLOCK;
+
+    while (from < to) {
+        unsigned n = EXT_PER_BLOCK - from % EXT_PER_BLOCK;
+
+        if (n > to - from)
+            n = to - from;
+        if (n > 64)
+            n = 64;
+
+        for (unsigned i = 0; i < n; i++) {
+            const struct file_extent *e = &f->ext[from + i];
+
+            buf[i] = from + i < f->nextents
+                     ? (struct sfs_extent){ e->start, e->len }
+                     : (struct sfs_extent){ 0, 0 };
+        }
+        meta_write(buf, n * sizeof(struct sfs_extent),
+                   block_off(f->list[from / EXT_PER_BLOCK]) +
+                   from % EXT_PER_BLOCK * sizeof(struct sfs_extent));
+        from += n;
+    }
+}
+
+
+/*
+ * Add the run of `len` blocks at `start` (chained on its own) to the end of
+ * the extents of `f`, merging it with the last extent if it follows that
+ * directly (and its chain can be extended, as it is not shared). The list
+ * gets another block if it is full. Called with alloc_lock held.
+ * Returns 0 on success, < 0 on error.
+ */
+static int ext_append(struct sfs_file *f, blockidx_t start, unsigned len)
+{
+    struct file_extent *last = f->nextents ? &f->ext[f->nextents - 1] : NULL;
+    struct file_extent e = { start, len, last ? last->lblk + last->len : 0 };
+
+    if (last && last->start + last->len == start &&
+            !block_shared(start - 1)) {
+        blocktbl_set(start - 1, start);
+        last->len += len;
+        return 0;
+    }
+
+    if (f->nextents == f->nlist * EXT_PER_BLOCK) {
+        blockidx_t lb = alloc_run(1, start + len);
+
+        if (lb == SFS_BLOCKIDX_EMPTY)
+            return -ENOSPC;
+        if (ext_push_list(f, lb)) {
+            free_chain(lb);
+            return -ENOMEM;
+        }
+        if (f->nlist > 1)
+            blocktbl_set(f->list[f->nlist - 2], lb);
+    }
+    return ext_push(f, &e);
+}
+
+
+/*
+ * Release the blocks of `f` from logical block `keep` on, and the blocks of
+ * its list that are no longer needed. Called with alloc_lock held.
+ */
+static void ext_truncate(struct sfs_file *f, unsigned keep)
+{
+    unsigned i = ext_find(f, keep), nlist;
+
+    if (i < f->nextents) {
+        struct file_extent *e = &f->ext[i];
+        unsigned off = keep - e->lblk;
+
+        for (unsigned j = i + 1; j < f->nextents; j++)
+            free_chain(f->ext[j].start);
+        if (off) {
+            blocktbl_set(e->start + off - 1, SFS_BLOCKIDX_END);
+            free_chain(e->start + off);
+            e->len = off;
+            f->nextents = i + 1;
+        } else {
+            free_chain(e->start);
+            f->nextents = i;
+        }
+    }
+    f->ext_hint = 0;
+
+    nlist = DIV_ROUND_UP(f->nextents, EXT_PER_BLOCK);
+    if (nlist < f->nlist) {
+        if (nlist)
+            blocktbl_set(f->list[nlist - 1], SFS_BLOCKIDX_END);
+        free_chain(f->list[nlist]);
+        f->nlist = nlist;
+    }
+}
+
+
+/*
+ * file_reserve() for files mapped by extents: allocate the blocks from `have`
+ * to `need` in as few runs as possible, preferably right after the last
+ * extent so that it simply grows. A new file gets its first list block before
+ * its data, so that the data can grow in place.
+ * Returns 0 on success, < 0 on error.
+ */
+static int ext_reserve(struct sfs_file *f, struct sfs_entry *entry,
+                       unsigned have, unsigned need)
+{
+    unsigned n = need - have, old = 0, len = n;
+    blockidx_t start, hint = 0;
+    int res = 0;
+
+    pthread_mutex_lock(&f->idx_lock);
+    if (entry_block(entry) != f->first_block &&
+            (res = ext_load(f, entry)) < 0)
+        goto out;
+    if (f->nextents) {
+        old = f->nextents - 1;
+        hint = f->ext[old].start + f->ext[old].len;
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+    if (n + !f->nlist > free_count) {
+        res = -ENOSPC;
+    } else if (!f->nlist) {
+        start = alloc_run(1, 0);
+        if ((res = ext_push_list(f, start)))
+            free_chain(start);
+        hint = start + 1;
+    }
+
+    start = res ? SFS_BLOCKIDX_EMPTY : alloc_run(n, hint);
+    while (res == 0 && n > 0) {
+        if (start == SFS_BLOCKIDX_EMPTY &&
+                (start = alloc_first_run(n, hint, &len)) == SFS_BLOCKIDX_EMPTY)
+            res = -ENOSPC;
+        else if ((res = ext_append(f, start, len)) < 0)
+            free_chain(start);
+        n -= len;
+        hint = start + len;
+        start = SFS_BLOCKIDX_EMPTY;
+    }
+    if (res)
+        ext_truncate(f, have);
+    pthread_mutex_unlock(&alloc_lock);
+
+    ext_write(f, old, f->nextents + 1);
+    entry_set_block(entry, f->nlist ? f->list[0] : SFS_BLOCKIDX_END);
+    f->first_block = entry_block(entry);
+out:
+    pthread_mutex_unlock(&f->idx_lock);
+    return res;
+}
+
+
+/*
+ * Make sure the chain of file `f` (with directory entry `entry`) has enough
+ * blocks to hold `size` bytes. Missing blocks are allocated in one batch,
+ * contiguous with the current last block if possible. Only the first block
+ * of `entry` is updated; the caller is responsible for the size and for
+ * writing the entry back.
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_reserve(struct sfs_file *f, struct sfs_entry *entry,
+                        size_t size)
+{
+    unsigned have = DIV_ROUND_UP(entry->size & SFS_SIZEMASK, geom.block_size);
+    unsigned need = DIV_ROUND_UP(size, geom.block_size);
+    blockidx_t last, first_new;
+
+    if (need <= have)
+        return 0;
+    if (entry->size & SFS_EXTENTS)
+        return ext_reserve(f, entry, have, need);
+
+    last = have ? file_block(f, entry, have - 1) : SFS_BLOCKIDX_END;
+
+    pthread_mutex_lock(&alloc_lock);
+    first_new = alloc_blocks(need - have, last + 1, 0);
+    if (first_new != SFS_BLOCKIDX_EMPTY && last < geom.nblocks)
+        blocktbl_set(last, first_new);
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (first_new == SFS_BLOCKIDX_EMPTY)
+        return -ENOSPC;
+    if (last >= geom.nblocks)
+        entry_set_block(entry, first_new);
+    return 0;
+}
+
+
+/*
+ * Release the blocks of file `f` beyond the first `size` bytes. Only the first
+ * block of `entry` is updated.
+ */
+static void file_shrink(struct sfs_file *f, struct sfs_entry *entry,
+                        size_t size)
+{
+    unsigned keep = DIV_ROUND_UP(size, geom.block_size);
+    blockidx_t last, rest;
+
+    if (entry->size & SFS_EXTENTS) {
+        pthread_mutex_lock(&f->idx_lock);
+        if (entry_block(entry) == f->first_block || ext_load(f, entry) == 0) {
+            pthread_mutex_lock(&alloc_lock);
+            ext_truncate(f, keep);
+            pthread_mutex_unlock(&alloc_lock);
+
+            /* The last extent that is kept may have been cut short. */
+            ext_write(f, f->nextents ? f->nextents - 1 : 0, f->nextents + 1);
+            entry_set_block(entry, f->nlist ? f->list[0] : SFS_BLOCKIDX_END);
+            f->first_block = entry_block(entry);
+        }
+        pthread_mutex_unlock(&f->idx_lock);
+        return;
+    }
+
+    if (keep == 0) {
+        pthread_mutex_lock(&alloc_lock);
+        free_chain(entry_block(entry));
+        pthread_mutex_unlock(&alloc_lock);
+        entry_set_block(entry, SFS_BLOCKIDX_END);
+        return;
+    }
+
+    last = file_block(f, entry, keep - 1);
+    if (last == SFS_BLOCKIDX_END)
+        return;
+
+    pthread_mutex_lock(&alloc_lock);
+    rest = block_table[last];
+    blocktbl_set(last, SFS_BLOCKIDX_END);
+    free_chain(rest);
+    pthread_mutex_unlock(&alloc_lock);
+
+    pthread_mutex_lock(&f->idx_lock);
+    if (f->nblocks > keep)
+        f->nblocks = keep;
+    pthread_mutex_unlock(&f->idx_lock);
+}
+
+
+/*
+ * Copy-on-write of the blocks that files share after a clone (see
+ * file_clone()). A file gets its own copy of such a block before it writes to
+ * it, or changes its successor in the block table. Since that successor is
+ * the same for every file that uses the block, shared blocks are always a tail
+ * of a chain (or of an extent), and copying a block means copying the chain
+ * from the first shared block on: the copies then link to the rest of the
+ * shared tail, which stays shared.
+ */
+
+/* Bytes copied at a time. */
+#define COW_CHUNK (1u << 20)
+
+/* Copy the `n` consecutive blocks at `from` to those at `to`, through `buf`
+ * of COW_CHUNK bytes. */
+static void run_copy(char *buf, blockidx_t from, blockidx_t to, unsigned n)
+{
+    unsigned per_chunk = COW_CHUNK / geom.block_size;
+
+    for (unsigned done = 0, len; done < n; done += len) {
+        len = n - done < per_chunk ? n - done : per_chunk;
+        data_rw(0, buf, (size_t)len * geom.block_size, block_off(from + done));
+        data_rw(1, buf, (size_t)len * geom.block_size, block_off(to + done));
+    }
+}
+
+
+/*
+ * Give the chain of file `f` (with entry `entry`) its own copies of the blocks
+ * it shares up to logical block `to`. The entry is written back if its first
+ * block changes. Returns 0 on success, < 0 on error.
+ */
+static int chain_unshare(struct sfs_file *f, struct sfs_entry *entry,
+                         unsigned to)
+{
+    blockidx_t *old = NULL, *copy = NULL, prev = SFS_BLOCKIDX_END, b;
+    unsigned lo = 0, hi = to + 1, n;
+    char *buf = NULL;
+    int res = 0;
+
+    if (file_block(f, entry, to) == SFS_BLOCKIDX_END)
+        return 0;
+
+    /* f->blocks now reaches `to`, and stays as it is under the file lock. */
+    pthread_mutex_lock(&f->idx_lock);
+    pthread_mutex_lock(&alloc_lock);
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (block_shared(f->blocks[mid]))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if ((n = to + 1 - lo) == 0)
+        goto out;
+
+    old = malloc(n * sizeof(*old));
+    copy = malloc(n * sizeof(*copy));
+    buf = malloc(COW_CHUNK);
+    if (!old || !copy || !buf) {
+        res = -ENOMEM;
+        goto out;
+    }
+    memcpy(old, &f->blocks[lo], n * sizeof(*old));
+    if (lo)
+        prev = f->blocks[lo - 1];
+    if ((b = alloc_blocks(n, prev + 1, 0)) == SFS_BLOCKIDX_EMPTY) {
+        res = -ENOSPC;
+        goto out;
+    }
+    for (unsigned i = 0; i < n; i++, b = block_table[b])
+        copy[i] = b;
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_mutex_unlock(&f->idx_lock);
+
+    for (unsigned i = 0, len; i < n; i += len) {
+        for (len = 1; i + len < n && old[i + len] == old[i] + len &&
+                      copy[i + len] == copy[i] + len; len++)
+            ;
+        run_copy(buf, old[i], copy[i], len);
+    }
+
+    pthread_mutex_lock(&f->idx_lock);
+    pthread_mutex_lock(&alloc_lock);
+    blocktbl_set(copy[n - 1], block_table[old[n - 1]]);
+    if (lo)
+        blocktbl_set(prev, copy[0]);
+    for (unsigned i = 0; i < n; i++)
+        block_release(old[i]);
+    memcpy(&f->blocks[lo], copy, n * sizeof(*copy));
+    if (!lo)
+        f->first_block = copy[0];
+out:
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_mutex_unlock(&f->idx_lock);
+
+    if (res == 0 && n && !lo) {
+        entry_set_block(entry, copy[0]);
+        entry_lock(f->entry_off, 1);
+        put_entry(f->entry_off, entry);
+        entry_unlock(f->entry_off);
+    }
+    free(old);
+    free(copy);
+    free(buf);
+    return res;
+}
+
+
+/*
+ * chain_unshare() for a file mapped by extents: give `f` its own copies of the
+ * blocks it shares among logical blocks [from, to], which take the place of
+ * the copied part of each extent as extents of their own. If `cut` is set,
+ * the file is going to end after block `to` instead, which only changes an
+ * extent that goes on past it. Returns 0 on success, < 0 on error.
+ */
+static int ext_unshare(struct sfs_file *f, struct sfs_entry *entry,
+                       unsigned from, unsigned to, int cut)
+{
+    struct file_extent *parts = NULL;
+    unsigned changed = UINT32_MAX;
+    char *buf = NULL;
+    int res = 0;
+
+    pthread_mutex_lock(&f->idx_lock);
+    if (entry_block(entry) != f->first_block &&
+            (res = ext_load(f, entry)) < 0)
+        goto out;
+
+    for (unsigned i = ext_find(f, from);
+         i < f->nextents && f->ext[i].lblk <= to; i++) {
+        struct file_extent e = f->ext[i];
+        unsigned last = to - e.lblk < e.len ? to - e.lblk : e.len - 1;
+        unsigned lo = 0, hi = last + 1, n, nparts = 0, nlist;
+
+        if (cut && last == e.len - 1)
+            continue;
+
+        pthread_mutex_lock(&alloc_lock);
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
+
+            if (block_shared(e.start + mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        n = last + 1 - lo;
+        pthread_mutex_unlock(&alloc_lock);
+        if (n == 0)
+            continue;
+
+        /* The extent becomes the part before the copy (if any), the runs of
+         * the copy, and the part after it (if any). Everything that might be
+         * needed is set up before blocks are allocated. */
+        free(parts);
+        nlist = DIV_ROUND_UP(f->nextents + n + 1, EXT_PER_BLOCK);
+        if (!(parts = malloc((n + 2) * sizeof(*parts))) ||
+                (!buf && !(buf = malloc(COW_CHUNK)))) {
+            res = -ENOMEM;
+            break;
+        }
+        while (f->ext_cap < f->nextents + n + 1) {
+            struct file_extent *ext = array_grow(f->ext, f->ext_cap,
+                                                 &f->ext_cap, sizeof(*ext));
+            if (!ext)
+                break;
+            f->ext = ext;
+        }
+        while (f->list_cap < nlist) {
+            blockidx_t *list = array_grow(f->list, f->list_cap, &f->list_cap,
+                                          sizeof(*list));
+            if (!list)
+                break;
+            f->list = list;
+        }
+        if (f->ext_cap < f->nextents + n + 1 || f->list_cap < nlist) {
+            res = -ENOMEM;
+            break;
+        }
+
+        pthread_mutex_lock(&alloc_lock);
+        if (n + (nlist > f->nlist ? nlist - f->nlist : 0) > free_count) {
+            pthread_mutex_unlock(&alloc_lock);
+            res = -ENOSPC;
+            break;
+        }
+        if (lo)
+            parts[nparts++] = (struct file_extent){ e.start, lo, e.lblk };
+        for (unsigned done = 0, len; done < n; done += len) {
+            blockidx_t start = alloc_run(n - done, e.start + e.len);
+
+            len = n - done;
+            if (start == SFS_BLOCKIDX_EMPTY)
+                start = alloc_first_run(n - done, e.start + e.len, &len);
+            parts[nparts++] = (struct file_extent){ start, len,
+                                                    e.lblk + lo + done };
+        }
+        if (last + 1 < e.len)
+            parts[nparts++] = (struct file_extent){
+                e.start + last + 1, e.len - last - 1, e.lblk + last + 1 };
+        while (f->nlist * EXT_PER_BLOCK < f->nextents + nparts - 1) {
+            blockidx_t lb = alloc_run(1, f->list[f->nlist - 1] + 1);
+
+            blocktbl_set(f->list[f->nlist - 1], lb);
+            f->list[f->nlist++] = lb;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+
+        for (unsigned k = !!lo, done = lo; done <= last;
+             done += parts[k].len, k++)
+            run_copy(buf, e.start + done, parts[k].start, parts[k].len);
+
+        pthread_mutex_lock(&alloc_lock);
+        if (lo)
+            blocktbl_set(e.start + lo - 1, SFS_BLOCKIDX_END);
+        for (unsigned b = lo; b <= last; b++)
+            block_release(e.start + b);
+        pthread_mutex_unlock(&alloc_lock);
+
+        memmove(&f->ext[i + nparts], &f->ext[i + 1],
+                (f->nextents - i - 1) * sizeof(*f->ext));
+        memcpy(&f->ext[i], parts, nparts * sizeof(*parts));
+        f->nextents += nparts - 1;
+        if (changed > i)
+            changed = i;
+        i += nparts - 1;
+    }
+
+    if (changed != UINT32_MAX) {
+        f->ext_hint = 0;
+        ext_write(f, changed, f->nextents + 1);
+    }
+out:
+    pthread_mutex_unlock(&f->idx_lock);
+    free(parts);
+    free(buf);
+    return res;
+}
+
+
+/*
+ * Give file `f` (with entry `entry`) its own copies of the blocks it shares
+ * that writing bytes [start, end) changes: those written, and the last block
+ * of a chain that grows, whose successor changes. The entry is written back
+ * if its first block changes. Returns 0 on success, < 0 on error.
+ */
+static int file_unshare(struct sfs_file *f, struct sfs_entry *entry,
+                        size_t start, size_t end)
+{
+    unsigned have = DIV_ROUND_UP(entry->size & SFS_SIZEMASK, geom.block_size);
+    unsigned from = start / geom.block_size, to;
+
+    if (!__atomic_load_n(&shared_count, __ATOMIC_RELAXED) || !have ||
+            start >= end)
+        return 0;
+    to = (end - 1) / geom.block_size < have ? (end - 1) / geom.block_size
+                                            : have - 1;
+    if (entry->size & SFS_EXTENTS)
+        return from <= to ? ext_unshare(f, entry, from, to, 0) : 0;
+    return chain_unshare(f, entry, to);
+}
+
+
+/* Like file_unshare(), for the blocks that cutting the file to `size` bytes
+ * changes: the new last block, which ends the chain (or its extent). */
+static int file_unshare_cut(struct sfs_file *f, struct sfs_entry *entry,
+                            size_t size)
+{
+    unsigned have = DIV_ROUND_UP(entry->size & SFS_SIZEMASK, geom.block_size);
+    unsigned keep = DIV_ROUND_UP(size, geom.block_size);
+
+    if (!__atomic_load_n(&shared_count, __ATOMIC_RELAXED) || !keep ||
+            keep >= have)
+        return 0;
+    if (entry->size & SFS_EXTENTS)
+        return ext_unshare(f, entry, keep - 1, keep - 1, 1);
+    return chain_unshare(f, entry, keep - 1);
+}
+
+
+/*
+ * Write `size` bytes of `buf` (or zeroes if `buf` is NULL) at byte `offset` of
+ * file `f`, whose blocks must already be allocated. The pieces are collected
+ * into one vectored write, so physically consecutive blocks of the chain reach
+ * the disk as a single pwritev. The disk accepts writes at any byte offset, so
+ * partial blocks are written in place and no block ever needs to be read first.
+ */
+static void file_pwrite(struct sfs_file *f, const struct sfs_entry *entry,
+                        const char *buf, size_t size, size_t offset)
+{
+    struct seg_batch batch = { .write = 1 };
+    unsigned idx = offset / geom.block_size;
+    size_t in_block = offset % geom.block_size;
+    size_t done = 0;
+
+    while (done < size) {
+        blockidx_t block = file_block(f, entry, idx++);
+        size_t n = geom.block_size - in_block;
+
+        assert(block != SFS_BLOCKIDX_END);
+        if (n > size - done)
+            n = size - done;
+
+        blk_write(&batch, block, in_block, buf ? buf + done : zero_block, n);
+        done += n;
+        in_block = 0;
+    }
+    seg_flush(&batch);
+}
+
+
+#define RA_MIN_WINDOW 4u
+
+/*
+ * Readahead for a read of `size` bytes at `offset` of file `f`, into the block
+ * cache. The kernel's own readahead on the image follows the disk layout, not
+ * the chain, so it prefetches the wrong blocks for fragmented files. Instead,
+ * a read that starts where the previous one ended is treated as part of a
+ * stream, and the blocks that follow it in the chain are read into the cache
+ * along with any of the read itself that were not read ahead yet: all that
+ * are not cached in one disk_readv(), so a stream of small reads turns into
+ * few large ones (which io_uring submits at once).
+ *
+ * The window starts small and doubles (up to --readahead blocks, and a
+ * quarter of the cache) each time it is renewed, which happens as soon as
+ * less than half a window is left ahead of the reader. Any other read ends
+ * the stream. Without the block cache there is nowhere to read ahead into,
+ * and a cache that cannot hold a few minimal windows would only thrash.
+ */
+static void file_readahead(struct sfs_file *f, const struct sfs_entry *entry,
+                           size_t size, size_t offset)
+{
+    unsigned first_idx = offset / geom.block_size;
+    unsigned next_idx = (offset + size - 1) / geom.block_size + 1;
+    unsigned max_window = options.readahead;
+    unsigned start = 0, end = 0, nread = 0;
+    struct seg_batch batch = { .write = 0 };
+    char *buf;
+
+    if (bcache_nslots / 4 < RA_MIN_WINDOW)
+        return;
+    if (max_window > bcache_nslots / 4)
+        max_window = bcache_nslots / 4;
+    if (!max_window || !size)
+        return;
+
+    pthread_mutex_lock(&f->idx_lock);
+    if (offset != f->ra_next) {
+        f->ra_window = 0;
+    } else if (!f->ra_window) {
+        f->ra_window = RA_MIN_WINDOW < max_window ? RA_MIN_WINDOW : max_window;
+        f->ra_end = first_idx;
+    }
+    f->ra_next = offset + size;
+
+    if (f->ra_window && f->ra_end <= next_idx + f->ra_window / 2) {
+        start = f->ra_end > first_idx ? f->ra_end : first_idx;
+        end = next_idx + f->ra_window;
+        f->ra_end = end;
+        if (f->ra_window < max_window)
+            f->ra_window = f->ra_window * 2 < max_window ? f->ra_window * 2
+                                                         : max_window;
+    }
+    pthread_mutex_unlock(&f->idx_lock);
+
+    if (!end || !(buf = malloc((size_t)(end - start) * geom.block_size)))
+        return;
+
+    for (unsigned idx = start; idx < end; idx++) {
+        blockidx_t block = file_block(f, entry, idx);
+        char *dst = buf + (size_t)nread * geom.block_size;
+        int cached;
+
+        if (block == SFS_BLOCKIDX_END)
+            break;
+        pthread_mutex_lock(&bcache_lock);
+        cached = bcache_slot_of[block] != BSLOT_NONE;
+        pthread_mutex_unlock(&bcache_lock);
+        /* A window that starts with a cached block is most likely being
+         * read again: the rest is left to the reads themselves. */
+        if (cached && idx == start)
+            break;
+        if (cached)
+            continue;
+
+        if (batch.nfill == SEG_BATCH)
+            seg_flush(&batch);
+        seg_add(&batch, dst, geom.block_size, block_off(block));
+        batch.fill[batch.nfill].block = block;
+        batch.fill[batch.nfill++].data = dst;
+        nread++;
+    }
+    seg_flush(&batch);
+    free(buf);
+
+    pthread_mutex_lock(&bcache_lock);
+    bcache_readahead += nread;
+    pthread_mutex_unlock(&bcache_lock);
+}
+
+
+/*
+ * Read up to `size` bytes at byte `offset` of file `f` (with entry `entry`),
+ * scattering the (partial) blocks straight into `buf`. Returns the number of
+ * bytes read, which is less than `size` only if the file's blocks end early.
+ */
+static size_t file_pread(struct sfs_file *f, const struct sfs_entry *entry,
+                         char *buf, size_t size, size_t offset)
+{
+    struct seg_batch batch = { .write = 0 };
+    unsigned idx = offset / geom.block_size;
+    size_t in_block = offset % geom.block_size;
+    size_t done = 0;
+
+    while (done < size) {
+        blockidx_t block = file_block(f, entry, idx++);
+        size_t n = geom.block_size - in_block;
+
+        if (block == SFS_BLOCKIDX_END)
+            break;
+        if (n > size - done)
+            n = size - done;
+
+        blk_read(&batch, block, in_block, buf + done, n);
+        done += n;
+        in_block = 0;
+    }
+    seg_flush(&batch);
+    return done;
+}
+
+
+/* Free a fuse_bufvec from file_bufvec(), along with any memory buffers. */
+static void bufvec_free(struct fuse_bufvec *v)
+{
+    if (!v)
+        return;
+    for (size_t i = 0; i < v->count; i++)
+        free(v->buf[i].mem);
+    free(v);
+}
+
+
+/*
+ * Describe `size` bytes at byte `offset` of file `f` (with entry `entry`) as
+ * segments of the image file, for libfuse to write the data of write_buf into
+ * itself: ideally with splice, without the data ever passing through our
+ * buffers. Physically consecutive blocks are merged into one segment. The data
+ * bypasses the cache, so any cached copies of the blocks are dropped.
+ * The blocks have to be allocated already (see file_reserve).
+ * Returns NULL if out of memory.
+ */
+static struct fuse_bufvec *file_bufvec(struct sfs_file *f,
+                                       const struct sfs_entry *entry,
+                                       size_t size, size_t offset)
+{
+    unsigned nblocks = DIV_ROUND_UP(offset % geom.block_size + size,
+                                    geom.block_size);
+    struct fuse_bufvec *v;
+    unsigned idx = offset / geom.block_size;
+    size_t in_block = offset % geom.block_size;
+
+    /* struct fuse_bufvec has room for one buffer itself, so this is one more
+     * than needed; an empty range still has a (zero-sized) buffer. */
+    v = calloc(1, sizeof(*v) + nblocks * sizeof(struct fuse_buf));
+    if (!v)
+        return NULL;
+
+    for (size_t done = 0, n; done < size; done += n, in_block = 0) {
+        blockidx_t block = file_block(f, entry, idx++);
+        struct fuse_buf *last = v->count ? &v->buf[v->count - 1] : NULL;
+        off_t pos = block_off(block) + in_block;
+
+        if (block == SFS_BLOCKIDX_END)
+            break;
+        n = geom.block_size - in_block < size - done ? geom.block_size - in_block
+                                                    : size - done;
+
+        bcache_discard(block);
+        if (last && last->pos + (off_t)last->size == pos) {
+            last->size += n;
+        } else {
+            v->buf[v->count++] = (struct fuse_buf){
+                .size = n,
+                .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+                .fd = disk_fd(),
+                .pos = pos,
+            };
+        }
+    }
+
+    if (!v->count)
+        v->count = 1;
+    return v;
+}
+
+
+/*
+ * Statistics. Every FUSE operation counts its calls and their latency in a
+ * histogram with power-of-two buckets: bucket i holds the calls that took
+ * [2^i, 2^(i+1)) ns, and the last one everything slower. The counters are only
+ * ever added to, with relaxed atomics, so recording costs two clock reads and
+ * a few uncontended adds per call.
+ *
+ * Together with the disk, cache and allocator counters they can be read from
+ * two synthetic read-only files in the root directory, STATS_NAME (text) and
+ * STATS_NAME ".json". These are not stored on disk, and shadow any entry of
+ * the same name.
+ */
+#define STATS_NAME ".sfs_stats"
+#define STATS_BUCKETS 32
+
+enum op {
+    OP_GETATTR,
+    OP_LOOKUP,
+    OP_READDIR,
+    OP_OPEN,
+    OP_RELEASE,
+    OP_READ,
+    OP_WRITE,
+    OP_CREATE,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_TRUNCATE,
+    OP_FLUSH,
+    OP_FSYNC,
+    OP_CLONE,
+    OP_DEFRAG,
+    NOPS
+};
+
+static const char *const op_names[NOPS] = {
+    [OP_GETATTR]    = "getattr",
+    [OP_LOOKUP]     = "lookup",
+    [OP_READDIR]    = "readdir",
+    [OP_OPEN]       = "open",
+    [OP_RELEASE]    = "release",
+    [OP_READ]       = "read",
+    [OP_WRITE]      = "write",
+    [OP_CREATE]     = "create",
+    [OP_MKDIR]      = "mkdir",
+    [OP_UNLINK]     = "unlink",
+    [OP_RMDIR]      = "rmdir",
+    [OP_TRUNCATE]   = "truncate",
+    [OP_FLUSH]      = "flush",
+    [OP_FSYNC]      = "fsync",
+    [OP_CLONE]      = "clone",
+    [OP_DEFRAG]     = "defrag",
+};
+
+struct op_stats {
+    unsigned long calls;
+    uint64_t total_ns;
+    unsigned long hist[STATS_BUCKETS];
+};
+
+static struct op_stats op_stats[NOPS];
+
+/* Which statistics file a path or low-level inode refers to, if any. */
+enum stats_format {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON,
+};
+
+/* A rendering of the statistics, kept in fi->fh while the file is open, so
+ * reads at increasing offsets see a consistent snapshot. */
+struct stats_snap {
+    size_t len;
+    char *data;
+};
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+/*
+ * Tracing. While tracing is on, every operation leaves a compact binary
+ * record (struct trace_rec) in a ring of its thread's own, so recording takes
+ * no locks and threads never write to each other's memory. A background
+ * thread drains the rings every TRACE_DRAIN_MS (or sooner, when one is half
+ * full), sorts the records by start time and writes them out: to the --trace
+ * file, which `sfs --dump-trace=FILE` decodes, or with -v decoded to stdout.
+ * When a ring is full its records are dropped, and only their number is
+ * kept, rather than making the operation wait.
+ *
+ * Tracing starts on with -v or --trace, and SIGUSR1 switches it on and off at
+ * any time; without either option the records go to "<img>.trace". While it
+ * is off, an operation only checks a flag.
+ *
+ * With --record=FILE, each record of a path-based operation also keeps what is
+ * needed to run it again (struct trace_args and the full path), so sfs-replay
+ * (replay.c) can replay the workload. These records are written out as they
+ * are drained, in order for each thread but not sorted across threads.
+ */
+#define TRACE_RING_RECS 8192u
+#define TRACE_DRAIN_MS 100
+#define TRACE_MAGIC "SFSTRACE"
+#define TRACE_NAME_LEN 16
+#define TRACE_DROPPED 0xff      /* Op of a record counting lost records */
+#define TRACE_INODE 0x1         /* Flag: the key is an inode number */
+#define TRACE_ARGS 0x1          /* Header flag: records have trace_args */
+#define TRACE_PATH_MAX 256
+
+struct trace_rec {
+    uint64_t start;             /* CLOCK_MONOTONIC, in ns */
+    uint64_t key;               /* FNV-1a hash of the path, or the inode */
+    uint64_t offset;            /* For TRACE_DROPPED, the number of records */
+    uint32_t size;
+    int32_t res;
+    uint32_t ns;                /* Duration, saturated at UINT32_MAX */
+    uint8_t op;
+    uint8_t flags;
+    uint16_t thread;
+};
+
+/* With TRACE_ARGS, what follows each record in the file, before `path_len`
+ * bytes of its path. Paths of TRACE_PATH_MAX bytes or more are left out. */
+struct trace_args {
+    uint64_t fh;                /* File handle used, or returned by open */
+    uint32_t arg;               /* Open flags, create or mkdir mode, fsync
+                                   datasync, 1 for write_buf */
+    uint16_t path_len;
+    uint16_t pad;
+};
+
+struct trace_extra {
+    struct trace_args args;
+    char path[TRACE_PATH_MAX];
+};
+
+/* A record read back from a file, with its arguments if it has any. */
+struct trace_ent {
+    struct trace_rec rec;
+    struct trace_extra x;
+};
+
+/* Start of a trace file, followed by `nops` op names of TRACE_NAME_LEN bytes,
+ * and then the records. */
+struct trace_header {
+    char magic[8];
+    uint32_t rec_size;
+    uint32_t nops;
+    uint32_t flags;
+    uint32_t args_size;
+};
+
+/* The records of one thread. Only that thread writes `head` and the records,
+ * and only the drain thread writes `tail`. */
+struct trace_ring {
+    struct trace_ring *next;
+    unsigned long head;
+    unsigned long dropped;
+    uint16_t id;
+    int dead;                   /* The thread has exited */
+    struct trace_extra *extra;  /* With --record, the arguments of recs[] */
+    unsigned long tail __attribute__((aligned(64)));
+    struct trace_rec recs[TRACE_RING_RECS];
+};
+
+static int trace_on;
+static int trace_record;
+static __thread struct trace_ring *trace_self;
+static pthread_key_t trace_key;
+
+/* trace_lock protects the list of rings and the output. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static struct trace_ring *trace_rings;
+static unsigned trace_nrings;
+static pthread_t trace_thread;
+static int trace_stopping;
+static char *trace_path;
+static FILE *trace_out;
+static int trace_text;
+static uint64_t trace_epoch;
+
+
+static inline int trace_enabled(void)
+{
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+}
+
+
+static void trace_ring_exit(void *arg)
+{
+    struct trace_ring *r = arg;
+
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+
+static struct trace_ring *trace_ring_new(void)
+{
+    struct trace_ring *r = calloc(1, sizeof(*r));
+
+    if (r && trace_record &&
+            !(r->extra = malloc(TRACE_RING_RECS * sizeof(*r->extra)))) {
+        free(r);
+        r = NULL;
+    }
+    if (!r)
+        return NULL;
+
+    pthread_mutex_lock(&trace_lock);
+    r->id = trace_nrings++;
+    r->next = trace_rings;
+    trace_rings = r;
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, r);
+    trace_self = r;
+    return r;
+}
+
+
+static void trace_add(struct trace_rec *rec, const char *path, uint64_t fh,
+                      uint32_t arg)
+{
+    struct trace_ring *r = trace_self ? trace_self : trace_ring_new();
+    unsigned long head, used;
+    struct trace_extra *x;
+    size_t len;
+
+    if (!r)
+        return;
+
+    head = r->head;
+    used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (used == TRACE_RING_RECS) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec->thread = r->id;
+    r->recs[head % TRACE_RING_RECS] = *rec;
+    if (r->extra) {
+        x = &r->extra[head % TRACE_RING_RECS];
+        len = path ? strnlen(path, TRACE_PATH_MAX) : 0;
+        if (len == TRACE_PATH_MAX)
+            len = 0;
+        x->args = (struct trace_args){ .fh = fh, .arg = arg,
+                                       .path_len = len };
+        if (len)
+            memcpy(x->path, path, len);
+    }
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    /* A lost wakeup only delays the drain until its timeout. */
+    if (used == TRACE_RING_RECS / 2)
+        pthread_cond_signal(&trace_cond);
+}
+
+
+static void trace_print(FILE *out, const struct trace_rec *rec,
+                        const struct trace_args *args, const char *path,
+                        const char *name, uint64_t epoch)
+{
+    double t = (int64_t)(rec->start - epoch) / 1e9;
+
+    if (rec->op == TRACE_DROPPED) {
+        fprintf(out, " # %12.6f [%u] dropped %" PRIu64 " records\n", t,
+                rec->thread, rec->offset);
+        return;
+    }
+    if (args && args->path_len)
+        fprintf(out, " # %12.6f [%u] %-8s %.*s fh=%#" PRIx64 " arg=%#" PRIo32,
+                t, rec->thread, name, (int)args->path_len, path, args->fh,
+                args->arg);
+    else
+        fprintf(out, " # %12.6f [%u] %-8s %s=%#" PRIx64, t, rec->thread, name,
+                rec->flags & TRACE_INODE ? "ino" : "path", rec->key);
+    fprintf(out, " offset=%" PRIu64 " size=%" PRIu32 " res=%" PRId32
+            " %.3f us\n", rec->offset, rec->size, rec->res, rec->ns / 1e3);
+}
+
+
+static int trace_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const struct trace_rec *)a)->start;
+    uint64_t y = ((const struct trace_rec *)b)->start;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Decide where the records go: to the --record or --trace file, or with
+ * neither option (and without -v) to "<img>.trace". The path is made absolute
+ * here, as the file is only opened by the drain thread, after the FUSE daemon
+ * has changed to the root directory.
+ */
+static void trace_set_path(void)
+{
+    const char *path = options.record ? options.record : options.trace;
+    const char *suffix = "";
+    char *cwd = NULL;
+
+    if (!path && options.verbose)
+        return;
+    if (!path) {
+        path = options.img ? options.img : "sfs";
+        suffix = ".trace";
+    }
+    if (path[0] != '/')
+        cwd = getcwd(NULL, 0);
+
+    trace_path = malloc((cwd ? strlen(cwd) + 1 : 0) + strlen(path) +
+                        strlen(suffix) + 1);
+    if (trace_path)
+        sprintf(trace_path, "%s%s%s%s", cwd ? cwd : "", cwd ? "/" : "", path,
+                suffix);
+    free(cwd);
+}
+
+
+/* Open where the records go. Called with trace_lock held. */
+static int trace_open(void)
+{
+    struct trace_header h = { .rec_size = sizeof(struct trace_rec),
+                              .nops = NOPS,
+                              .flags = trace_record ? TRACE_ARGS : 0,
+                              .args_size = sizeof(struct trace_args) };
+    char name[TRACE_NAME_LEN];
+
+    if (!trace_path)
+        trace_set_path();
+    if (!trace_path && options.verbose) {
+        trace_out = stdout;
+        trace_text = 1;
+        return 0;
+    }
+
+    if (trace_path)
+        trace_out = fopen(trace_path, "wb");
+    if (!trace_out) {
+        perror("Could not open trace file, not tracing");
+        __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    fwrite(&h, sizeof(h), 1, trace_out);
+    for (unsigned op = 0; op < NOPS; op++) {
+        memset(name, 0, sizeof(name));
+        strncpy(name, op_names[op], sizeof(name) - 1);
+        fwrite(name, sizeof(name), 1, trace_out);
+    }
+    return 0;
+}
+
+
+/* Write the records of ring `r` from `tail` up to `head` to the --record file,
+ * with their arguments, followed by one counting `dropped` lost records. */
+static void trace_write_args(struct trace_ring *r, unsigned long tail,
+                             unsigned long head, unsigned long dropped)
+{
+    static const struct trace_args none;
+    struct trace_rec lost = { .start = now_ns(), .offset = dropped,
+                              .op = TRACE_DROPPED, .thread = r->id };
+
+    if ((tail == head && !dropped) || (!trace_out && trace_open() != 0))
+        return;
+
+    for (; tail != head; tail++) {
+        const struct trace_extra *x = &r->extra[tail % TRACE_RING_RECS];
+
+        fwrite(&r->recs[tail % TRACE_RING_RECS], sizeof(struct trace_rec), 1,
+               trace_out);
+        fwrite(&x->args, sizeof(x->args), 1, trace_out);
+        fwrite(x->path, 1, x->args.path_len, trace_out);
+    }
+    if (dropped) {
+        fwrite(&lost, sizeof(lost), 1, trace_out);
+        fwrite(&none, sizeof(none), 1, trace_out);
+    }
+    fflush(trace_out);
+}
+
+
+/* Move the records of every ring to the output, and free the rings of threads
+ * that have exited. Called with trace_lock held. */
+static void trace_drain(void)
+{
+    static struct trace_rec *batch;
+    static size_t batch_cap;
+    struct trace_ring **pp = &trace_rings, *r;
+    size_t n = 0;
+
+    while ((r = *pp)) {
+        int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+        unsigned long tail = r->tail;
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long dropped = __atomic_exchange_n(&r->dropped, 0,
+                                                    __ATOMIC_RELAXED);
+
+        if (r->extra) {
+            trace_write_args(r, tail, head, dropped);
+            tail = head;
+            dropped = 0;
+        } else if (n + (head - tail) + 1 > batch_cap) {
+            size_t cap = batch_cap ? batch_cap : TRACE_RING_RECS;
+            struct trace_rec *b;
+
+            while (cap < n + (head - tail) + 1)
+                cap *= 2;
+            if ((b = realloc(batch, cap * sizeof(*b)))) {
+                batch = b;
+                batch_cap = cap;
+            } else {
+                dropped += head - tail;
+                tail = head;
+            }
+        }
+
+        for (; tail != head; tail++)
+            batch[n++] = r->recs[tail % TRACE_RING_RECS];
+        if (dropped && n < batch_cap)
+            batch[n++] = (struct trace_rec){ .start = now_ns(),
+                                             .offset = dropped,
+                                             .op = TRACE_DROPPED,
+                                             .thread = r->id };
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        if (dead) {
+            *pp = r->next;
+            free(r->extra);
+            free(r);
+        } else {
+            pp = &r->next;
+        }
+    }
+
+    if (!n || (!trace_out && trace_open() != 0))
+        return;
+
+    qsort(batch, n, sizeof(*batch), trace_cmp);
+    if (trace_text) {
+        for (size_t i = 0; i < n; i++)
+            trace_print(trace_out, &batch[i], NULL, NULL, batch[i].op < NOPS
+                        ? op_names[batch[i].op] : "?", trace_epoch);
+    } else {
+        fwrite(batch, sizeof(*batch), n, trace_out);
+    }
+    fflush(trace_out);
+}
+
+
+static void *trace_main(void *arg)
+{
+    struct timespec ts;
+
+    (void)arg;
+    pthread_mutex_lock(&trace_lock);
+    while (!trace_stopping) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += TRACE_DRAIN_MS * 1000000l;
+        ts.tv_sec += ts.tv_nsec / 1000000000l;
+        ts.tv_nsec %= 1000000000l;
+        pthread_cond_timedwait(&trace_cond, &trace_lock, &ts);
+        trace_drain();
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+
+/* Switch tracing on or off; the SIGUSR1 handler. */
+static void trace_toggle(int sig)
+{
+    (void)sig;
+    __atomic_xor_fetch(&trace_on, 1, __ATOMIC_RELAXED);
+}
+
+
+static void trace_start(void)
+{
+    trace_epoch = now_ns();
+    pthread_key_create(&trace_key, trace_ring_exit);
+    trace_record = options.record != NULL;
+    if (options.verbose || options.trace || options.record)
+        __atomic_store_n(&trace_on, 1, __ATOMIC_RELAXED);
+
+    if (pthread_create(&trace_thread, NULL, trace_main, NULL) != 0) {
+        perror("Could not start trace thread, not tracing");
+        __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+        signal(SIGUSR1, SIG_IGN);
+    }
+}
+
+
+/* Write out the last records, and stop the drain thread. */
+static void trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    trace_stopping = 1;
+    pthread_cond_signal(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_join(trace_thread, NULL);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_drain();
+    if (trace_out && trace_out != stdout)
+        fclose(trace_out);
+    trace_out = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+/* Read trace file `path`: its header into `h`, its op names into `*names`
+ * (followed by "?", for ops out of range), and its records into `*ents`,
+ * sorted by start time. Returns the number of records, or -1 on error. */
+static ssize_t trace_load(const char *path, struct trace_header *h,
+                          char (**names)[TRACE_NAME_LEN],
+                          struct trace_ent **ents)
+{
+    FILE *in = fopen(path, "rb");
+    struct trace_ent *e = NULL;
+    size_t n = 0, cap = 0;
+
+    *names = NULL;
+    if (!in) {
+        perror("Could not open trace file");
+        return -1;
+    }
+    if (fread(h, sizeof(*h), 1, in) != 1 ||
+            memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+            h->rec_size != sizeof(struct trace_rec) ||
+            h->args_size != sizeof(struct trace_args) ||
+            h->nops > TRACE_DROPPED) {
+        fprintf(stderr, "%s is not a trace file of this version\n", path);
+        goto err;
+    }
+    if (!(*names = calloc(h->nops + 1, TRACE_NAME_LEN)) ||
+            fread(*names, TRACE_NAME_LEN, h->nops, in) != h->nops) {
+        fprintf(stderr, "Could not read trace file %s\n", path);
+        goto err;
+    }
+    for (unsigned op = 0; op < h->nops; op++)
+        (*names)[op][TRACE_NAME_LEN - 1] = '\0';
+    strcpy((*names)[h->nops], "?");
+
+    for (;;) {
+        struct trace_args *a;
+
+        if (n == cap) {
+            struct trace_ent *r;
+
+            cap = cap ? cap * 2 : TRACE_RING_RECS;
+            if (!(r = realloc(e, cap * sizeof(*r)))) {
+                perror("Could not read trace file");
+                goto err;
+            }
+            e = r;
+        }
+        memset(&e[n].x.args, 0, sizeof(e[n].x.args));
+        if (fread(&e[n].rec, sizeof(e[n].rec), 1, in) != 1)
+            break;
+
+        a = &e[n].x.args;
+        if ((h->flags & TRACE_ARGS) &&
+                (fread(a, sizeof(*a), 1, in) != 1 ||
+                 a->path_len >= TRACE_PATH_MAX ||
+                 fread(e[n].x.path, 1, a->path_len, in) != a->path_len)) {
+            fprintf(stderr, "Trace file %s is truncated\n", path);
+            break;
+        }
+        e[n].x.path[a->path_len] = '\0';
+        n++;
+    }
+    fclose(in);
+
+    qsort(e, n, sizeof(*e), trace_cmp);
+    *ents = e;
+    return n;
+
+err:
+    free(e);
+    free(*names);
+    *names = NULL;
+    fclose(in);
+    return -1;
+}
+
+
+/* Print the records of trace file `path` as text, in order. */
+static int trace_dump(const char *path)
+{
+    struct trace_header h;
+    char (*names)[TRACE_NAME_LEN];
+    struct trace_ent *e;
+    ssize_t n = trace_load(path, &h, &names, &e);
+
+    if (n < 0)
+        return 1;
+
+    for (ssize_t i = 0; i < n; i++)
+        trace_print(stdout, &e[i].rec, &e[i].x.args, e[i].x.path,
+                    names[e[i].rec.op < h.nops ? e[i].rec.op : h.nops],
+                    e[0].rec.start);
+    free(e);
+    free(names);
+    return 0;
+}
+
+
+/* One operation, from OP_STATS until its handler returns. The arguments and
+ * result are only filled in if it is traced. */
+struct op_timer {
+    enum op op;
+    uint64_t start;
+    int trace;
+    int res;
+    uint8_t flags;
+    uint64_t key;
+    uint64_t offset;
+    size_t size;
+    const char *path;
+    struct fuse_file_info *fi;
+    uint64_t fh;
+    uint32_t arg;
+};
+
+static void op_timer_done(struct op_timer *t)
+{
+    struct op_stats *s = &op_stats[t->op];
+    uint64_t ns = now_ns() - t->start;
+    unsigned bucket = 63 - __builtin_clzll(ns | 1);
+
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+    __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->hist[bucket], 1, __ATOMIC_RELAXED);
+
+    if (t->trace) {
+        struct trace_rec rec = {
+            .start = t->start,
+            .key = t->key,
+            .offset = t->offset,
+            .size = t->size,
+            .res = t->res,
+            .ns = ns < UINT32_MAX ? ns : UINT32_MAX,
+            .op = t->op,
+            .flags = t->flags,
+        };
+
+        /* Open and create only fill in the handle as they return. */
+        trace_add(&rec, t->path, t->fh ? t->fh : t->fi ? t->fi->fh : 0,
+                  t->arg);
+    }
+}
+
+static inline void op_trace(struct op_timer *t, const char *path,
+                            fuse_ino_t ino, uint64_t offset, size_t size)
+{
+    if (!t->trace)
+        return;
+    t->flags = path ? 0 : TRACE_INODE;
+    t->key = path ? path_hash(path) : ino;
+    t->offset = offset;
+    t->size = size;
+    t->path = path;
+}
+
+static inline void op_trace_args(struct op_timer *t,
+                                 struct fuse_file_info *fi, uint32_t arg)
+{
+    if (!t->trace)
+        return;
+    t->fi = fi;
+    t->fh = fi ? fi->fh : 0;
+    t->arg = arg;
+}
+
+/* Time the rest of the enclosing handler (up to whichever return it takes) as
+ * a call of `o`, and trace it if tracing is on. */
+#define OP_STATS(o) \
+    struct op_timer op_timer __attribute__((cleanup(op_timer_done))) = \
+        { .op = (o), .start = now_ns(), .trace = trace_enabled() }
+
+/* Record the path (or inode) the operation works on, and its offset and size,
+ * for its trace record. */
+#define OP_TRACE(path, offset, size) \
+    op_trace(&op_timer, (path), 0, (offset), (size))
+#define OP_TRACE_INO(ino, offset, size) \
+    op_trace(&op_timer, NULL, (ino), (offset), (size))
+
+/* Record the file handle and the other argument of the operation (see struct
+ * trace_args), which --record keeps so it can be replayed. */
+#define OP_TRACE_ARGS(fi, arg) op_trace_args(&op_timer, (fi), (arg))
+
+/* Record `r` as the result of the operation; evaluates to `r`. */
+#define OP_RESULT(r) (op_timer.res = (r))
+
+
+/*
+ * Defragmentation: files whose blocks are scattered over the disk are moved to
+ * a single run of consecutive blocks, so that they are accessed with large
+ * reads and writes again. A file is moved with its lock held exclusively: its
+ * data is copied to a newly allocated run, which (along with the block table)
+ * reaches the disk before the entry or extent list is pointed at it and the
+ * old blocks are released. A crash in between leaks the new run at worst, and
+ * with --journal the switch is a single transaction anyway.
+ *
+ * The tree is walked by path, and each file is looked up again for every step,
+ * so ns_lock is held no longer than by an operation. The data copied is
+ * limited by a budget: the --defrag=MBPS thread copies at most MBPS MiB per
+ * second (on average), and sfs-defrag moves the files of an unmounted image up
+ * to a total number of bytes.
+ *
+ * Fragmentation is measured as the share of the steps from one block of a
+ * file to the next that do not go to the next block on disk: 0% if every file
+ * is a single run, 100% if no two consecutive blocks of a file are adjacent.
+ */
+
+/* Seconds between the passes of the background thread. */
+#define DEFRAG_INTERVAL 60
+
+/* Bytes copied at a time while a file is moved. */
+#define DEFRAG_CHUNK (1u << 20)
+
+struct defrag_metric {
+    uint64_t files;         /* Files with at least one block */
+    uint64_t fragmented;    /* Files in more than one run */
+    uint64_t blocks;
+    uint64_t runs;
+};
+
+/* State of one pass over the tree. */
+struct defrag_ctx {
+    uint64_t budget;        /* Bytes that may still be copied (without rate) */
+    uint64_t rate;          /* Bytes per second, or 0 */
+    int64_t tokens;         /* With a rate: bytes that may be copied now */
+    uint64_t last_ns;
+    struct defrag_metric before, after;
+    unsigned long moved;
+    uint64_t moved_bytes;
+};
+
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_cond = PTHREAD_COND_INITIALIZER;
+static int defrag_started, defrag_stopping;
+
+/* Results of the background thread, for the statistics. */
+static struct defrag_metric defrag_before, defrag_after;
+static unsigned long defrag_passes, defrag_moved;
+static uint64_t defrag_moved_bytes;
+
+
+static void defrag_count(struct defrag_metric *m, unsigned nblocks,
+                         unsigned runs)
+{
+    if (!nblocks)
+        return;
+    m->files++;
+    m->fragmented += runs > 1;
+    m->blocks += nblocks;
+    m->runs += runs;
+}
+
+
+/*
+ * Return the number of runs of consecutive blocks file `f` (with entry `entry`)
+ * is stored in, and its number of blocks in `ret_nblocks`. Called with f->lock
+ * held.
+ */
+static unsigned file_runs(struct sfs_file *f, const struct sfs_entry *entry,
+                          unsigned *ret_nblocks)
+{
+    unsigned need = DIV_ROUND_UP(entry->size & SFS_SIZEMASK, geom.block_size);
+    unsigned n = 0, runs = 0;
+    blockidx_t block, prev = SFS_BLOCKIDX_END;
+
+    if (need && (entry->size & SFS_EXTENTS)) {
+        /* Looking up a block loads the extent list. */
+        file_block(f, entry, 0);
+        pthread_mutex_lock(&f->idx_lock);
+        for (unsigned i = 0; i < f->nextents && n < need; i++) {
+            runs += f->ext[i].start != prev;
+            prev = f->ext[i].start + f->ext[i].len;
+            n += f->ext[i].len;
+        }
+        pthread_mutex_unlock(&f->idx_lock);
+    } else {
+        for (; n < need &&
+               (block = file_block(f, entry, n)) != SFS_BLOCKIDX_END; n++) {
+            runs += block != prev + 1;
+            prev = block;
+        }
+    }
+    *ret_nblocks = n < need ? n : need;
+    return runs;
+}
+
+
+/* Return whether the file shares blocks with a clone. The shared blocks are
+ * the tail of a chain, so only the last block of each chain is looked at. */
+static int file_shared(struct sfs_file *f, const struct sfs_entry *entry)
+{
+    blockidx_t block = entry_block(entry);
+    int shared = 0;
+
+    if (!__atomic_load_n(&shared_count, __ATOMIC_RELAXED) ||
+            block >= geom.nblocks)
+        return 0;
+
+    if (entry->size & SFS_EXTENTS) {
+        file_block(f, entry, 0);
+        pthread_mutex_lock(&f->idx_lock);
+        pthread_mutex_lock(&alloc_lock);
+        for (unsigned i = 0; i < f->nextents && !shared; i++)
+            shared = block_shared(f->ext[i].start + f->ext[i].len - 1);
+        pthread_mutex_unlock(&alloc_lock);
+        pthread_mutex_unlock(&f->idx_lock);
+    } else {
+        pthread_mutex_lock(&alloc_lock);
+        for (unsigned n = 0; block_table[block] < geom.nblocks &&
+             n < geom.nblocks; n++)
+            block = block_table[block];
+        shared = block_shared(block);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+    return shared;
+}
+
+
+/* Return the number of blocks of the file at `entry_off` called `name`, and
+ * the number of runs they are in in `ret_runs`. Called with ns_lock held. */
+static unsigned defrag_measure(off_t entry_off, const char *name,
+                               unsigned *ret_runs)
+{
+    struct sfs_file *f = file_get(entry_off);
+    struct sfs_entry entry;
+    unsigned n = 0;
+
+    *ret_runs = 0;
+    if (!f)
+        return 0;
+    pthread_rwlock_rdlock(&f->lock);
+    if (entry_reload(entry_off, name, &entry) == 0)
+        *ret_runs = file_runs(f, &entry, &n);
+    pthread_rwlock_unlock(&f->lock);
+    file_put(f);
+    return n;
+}
+
+
+/*
+ * Move the file at `entry_off` called `name` to a single run of blocks, unless
+ * it already is one, and return the number of bytes copied in `ret_bytes`.
+ * Called with ns_lock held.
+ * Returns 0 if the file was moved, 1 if it did not need to be, < 0 on error.
+ */
+static int defrag_move(off_t entry_off, const char *name, uint64_t *ret_bytes)
+{
+    struct sfs_file *f = file_get(entry_off);
+    struct sfs_entry entry;
+    blockidx_t start, old;
+    unsigned n;
+    size_t size;
+    char *buf = NULL;
+    int res;
+
+    if (!f)
+        return -ENOMEM;
+    pthread_rwlock_wrlock(&f->lock);
+    if ((res = entry_reload(entry_off, name, &entry)))
+        goto out;
+    /* Moving a clone would give it copies of the blocks it shares. */
+    if (file_runs(f, &entry, &n) <= 1 || file_shared(f, &entry)) {
+        res = 1;
+        goto out;
+    }
+
+    size = (size_t)n * geom.block_size;
+    if (!(buf = malloc(size < DEFRAG_CHUNK ? size : DEFRAG_CHUNK))) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    pthread_rwlock_rdlock(&txn_lock);
+    pthread_mutex_lock(&alloc_lock);
+    start = alloc_run(n, 0);
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_rwlock_unlock(&txn_lock);
+    if (start == SFS_BLOCKIDX_EMPTY) {
+        res = -ENOSPC;
+        goto out;
+    }
+
+    for (size_t done = 0, len; done < size; done += len) {
+        len = size - done < DEFRAG_CHUNK ? size - done : DEFRAG_CHUNK;
+        file_pread(f, &entry, buf, len, done);
+        data_rw(1, buf, len, block_off(start) + done);
+    }
+
+    /* Without the journal, the new run has to be on disk before anything
+     * refers to it. */
+    if (!options.journal)
+        meta_flush();
+
+    pthread_rwlock_rdlock(&txn_lock);
+    if (entry.size & SFS_EXTENTS) {
+        struct file_extent e = { start, n, 0 };
+
+        /* The list keeps its first block, and now holds a single extent. */
+        pthread_mutex_lock(&f->idx_lock);
+        pthread_mutex_lock(&alloc_lock);
+        for (unsigned i = 0; i < f->nextents; i++)
+            free_chain(f->ext[i].start);
+        if (f->nlist > 1) {
+            blocktbl_set(f->list[0], SFS_BLOCKIDX_END);
+            free_chain(f->list[1]);
+            f->nlist = 1;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+
+        f->ext[0] = e;
+        f->nextents = 1;
+        f->ext_hint = 0;
+        ext_write(f, 0, 2);
+        pthread_mutex_unlock(&f->idx_lock);
+    } else {
+        old = entry_block(&entry);
+        entry_set_block(&entry, start);
+        entry_lock(entry_off, 1);
+        put_entry(entry_off, &entry);
+        entry_unlock(entry_off);
+
+        pthread_mutex_lock(&alloc_lock);
+        free_chain(old);
+        pthread_mutex_unlock(&alloc_lock);
+        file_invalidate(entry_off);
+    }
+    pthread_rwlock_unlock(&txn_lock);
+    *ret_bytes = size;
+
+out:
+    pthread_rwlock_unlock(&f->lock);
+    file_put(f);
+    free(buf);
+    if (res == 0)
+        meta_commit();
+    return res;
+}
+
+
+static int defrag_stopped(void)
+{
+    return __atomic_load_n(&defrag_stopping, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take `bytes` from the budget of `ctx`. With a rate, this waits until enough
+ * of the budget has been refilled (a single file may overdraw it), and only
+ * fails if the thread is being stopped.
+ * Returns 0 if the copy may go ahead, < 0 if not.
+ */
+static int defrag_take(struct defrag_ctx *ctx, uint64_t bytes)
+{
+    int res = 0;
+
+    if (!ctx->rate) {
+        if (bytes > ctx->budget)
+            return -1;
+        ctx->budget -= bytes;
+        return 0;
+    }
+
+    pthread_mutex_lock(&defrag_lock);
+    for (;;) {
+        uint64_t now = now_ns(), dt = now - ctx->last_ns;
+        struct timespec ts;
+        uint64_t wait_ns;
+
+        /* At most a second's worth of budget is saved up. */
+        if (dt > 1000000000u)
+            dt = 1000000000u;
+        ctx->tokens += (int64_t)((double)dt * ctx->rate / 1e9);
+        if (ctx->tokens > (int64_t)ctx->rate)
+            ctx->tokens = ctx->rate;
+        ctx->last_ns = now;
+
+        if (defrag_stopping) {
+            res = -1;
+            break;
+        }
+        if (ctx->tokens >= 0)
+            break;
+
+        wait_ns = (uint64_t)((double)-ctx->tokens * 1e9 / ctx->rate) + 1;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait_ns / 1000000000u;
+        ts.tv_nsec += wait_ns % 1000000000u;
+        ts.tv_sec += ts.tv_nsec / 1000000000l;
+        ts.tv_nsec %= 1000000000l;
+        pthread_cond_timedwait(&defrag_cond, &defrag_lock, &ts);
+    }
+    if (res == 0)
+        ctx->tokens -= bytes;
+    pthread_mutex_unlock(&defrag_lock);
+    return res;
+}
+
+
+/* Measure the file at `path` called `name`, and move it if it is fragmented
+ * and the budget of `ctx` allows. */
+static void defrag_file(struct defrag_ctx *ctx, const char *path,
+                        const char *name)
+{
+    struct sfs_entry entry;
+    off_t entry_off;
+    unsigned n = 0, runs = 0;
+    uint64_t bytes = 0;
+    int res = 1;
+
+    pthread_rwlock_rdlock(&ns_lock);
+    if (get_entry(path, &entry, &entry_off) == 0 &&
+            !(entry.size & SFS_DIRECTORY))
+        n = defrag_measure(entry_off, name, &runs);
+    pthread_rwlock_unlock(&ns_lock);
+    if (!n)
+        return;
+
+    defrag_count(&ctx->before, n, runs);
+    if (runs > 1 &&
+            defrag_take(ctx, 2 * (uint64_t)n * geom.block_size) == 0) {
+        pthread_rwlock_rdlock(&ns_lock);
+        if (get_entry(path, &entry, &entry_off) == 0 &&
+                !(entry.size & SFS_DIRECTORY))
+            res = defrag_move(entry_off, name, &bytes);
+        pthread_rwlock_unlock(&ns_lock);
+    }
+
+    if (res == 0) {
+        n = bytes / geom.block_size;
+        runs = 1;
+        ctx->moved++;
+        ctx->moved_bytes += bytes;
+    }
+    defrag_count(&ctx->after, n, runs);
+}
+
+
+struct defrag_name {
+    char name[SFS_FILENAME_MAX];
+    int is_dir;
+};
+
+/* Defragment the files in the directory at `path`, and in its
+ * subdirectories. */
+static void defrag_dir(struct defrag_ctx *ctx, const char *path)
+{
+    struct sfs_entry *scratch = malloc(DIR_SEG_SIZE);
+    struct defrag_name *names = NULL;
+    unsigned n = 0, cap = 0;
+    size_t plen = strlen(path);
+    struct sfs_dir *dir;
+    char *sub;
+
+    if (!scratch)
+        return;
+
+    /* Only the names are collected while the directory is locked. */
+    pthread_rwlock_rdlock(&ns_lock);
+    if (get_dir(path, &dir) == 0 && dir_lock(dir, 0) == 0) {
+        for (unsigned seg = 0; seg < dir->nsegs; seg++) {
+            const struct sfs_entry *entries = dir_seg_get(dir, seg, scratch);
+
+            for (unsigned i = 0; i < dir_seg_len(dir, seg); i++) {
+                struct defrag_name *p;
+
+                if (entries[i].filename[0] == '\0')
+                    continue;
+                if (!(p = array_grow(names, n, &cap, sizeof(*names))))
+                    break;
+                names = p;
+                memcpy(names[n].name, entries[i].filename, geom.filename_max);
+                names[n].name[geom.filename_max - 1] = '\0';
+                names[n++].is_dir = !!(entries[i].size & SFS_DIRECTORY);
+            }
+            dir_seg_put(dir, seg);
+        }
+        dir_unlock(dir);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    free(scratch);
+
+    sub = malloc(plen + SFS_FILENAME_MAX + 2);
+    for (unsigned i = 0; sub && i < n && !defrag_stopped(); i++) {
+        sprintf(sub, "%s/%s", plen > 1 ? path : "", names[i].name);
+        if (names[i].is_dir)
+            defrag_dir(ctx, sub);
+        else
+            defrag_file(ctx, sub, names[i].name);
+    }
+    free(sub);
+    free(names);
+}
+
+
+/* Walk the whole tree once, moving fragmented files as far as the budget of
+ * `ctx` allows, and measure the fragmentation before and after. The pass is
+ * timed and traced like an operation, with the bytes and files it moved as
+ * its offset and size. */
+static void defrag_pass(struct defrag_ctx *ctx)
+{
+    OP_STATS(OP_DEFRAG);
+
+    memset(&ctx->before, 0, sizeof(ctx->before));
+    memset(&ctx->after, 0, sizeof(ctx->after));
+    ctx->moved = 0;
+    ctx->moved_bytes = 0;
+    ctx->tokens = ctx->rate;
+    ctx->last_ns = now_ns();
+    defrag_dir(ctx, "/");
+    OP_TRACE("/", ctx->moved_bytes, ctx->moved);
+}
+
+
+static void *defrag_main(void *arg)
+{
+    struct timespec ts;
+
+    (void)arg;
+    pthread_mutex_lock(&defrag_lock);
+    while (!defrag_stopping) {
+        struct defrag_ctx ctx = { .rate = (uint64_t)options.defrag << 20 };
+
+        pthread_mutex_unlock(&defrag_lock);
+        defrag_pass(&ctx);
+        pthread_mutex_lock(&defrag_lock);
+
+        if (!defrag_stopping) {
+            defrag_before = ctx.before;
+            defrag_after = ctx.after;
+            defrag_passes++;
+            defrag_moved += ctx.moved;
+            defrag_moved_bytes += ctx.moved_bytes;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += DEFRAG_INTERVAL;
+        while (!defrag_stopping &&
+               pthread_cond_timedwait(&defrag_cond, &defrag_lock, &ts) !=
+               ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&defrag_lock);
+    return NULL;
+}
+
+
+static void defrag_start(void)
+{
+    if (!options.defrag)
+        return;
+    if (pthread_create(&defrag_thread, NULL, defrag_main, NULL) != 0) {
+        perror("Could not start defragmentation thread");
+        return;
+    }
+    defrag_started = 1;
+}
+
+
+/* Stop the background thread, interrupting its pass. */
+static void defrag_stop(void)
+{
+    if (!defrag_started)
+        return;
+
+    pthread_mutex_lock(&defrag_lock);
+    __atomic_store_n(&defrag_stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&defrag_cond);
+    pthread_mutex_unlock(&defrag_lock);
+    pthread_join(defrag_thread, NULL);
+    defrag_started = 0;
+}
+
+
+static enum stats_format stats_name(const char *name)
+{
+    if (strcmp(name, STATS_NAME) == 0)
+        return STATS_TEXT;
+    if (strcmp(name, STATS_NAME ".json") == 0)
+        return STATS_JSON;
+    return STATS_NONE;
+}
+
+static enum stats_format stats_path(const char *path)
+{
+    return path[0] == '/' ? stats_name(path + 1) : STATS_NONE;
+}
+
+
+/* Upper bound of the latency of the `pct` percent fastest calls of `s`. */
+static uint64_t op_percentile(const struct op_stats *s, unsigned pct)
+{
+    unsigned long seen = 0;
+
+    for (unsigned i = 0; i < STATS_BUCKETS; i++) {
+        seen += s->hist[i];
+        if (seen * 100 >= s->calls * pct)
+            return 2ull << i;
+    }
+    return 2ull << (STATS_BUCKETS - 1);
+}
+
+
+struct stat_val {
+    const char *name;
+    uint64_t val;
+};
+
+static void stats_section(FILE *out, int json, const char *name,
+                          const struct stat_val *vals, size_t n)
+{
+    fprintf(out, json ? ",\n  \"%s\": {" : "\n%s:\n", name);
+    for (size_t i = 0; i < n; i++) {
+        if (json)
+            fprintf(out, "%s\"%s\": %" PRIu64, i ? ", " : "", vals[i].name,
+                    vals[i].val);
+        else
+            fprintf(out, "  %-18s %" PRIu64 "\n", vals[i].name, vals[i].val);
+    }
+    if (json)
+        fprintf(out, "}");
+}
+
+#define STATS_SECTION(out, json, name, ...) \
+    do { \
+        const struct stat_val vals[] = { __VA_ARGS__ }; \
+        stats_section(out, json, name, vals, sizeof(vals) / sizeof(vals[0])); \
+    } while (0)
+
+
+static void stats_ops(FILE *out, int json)
+{
+    fprintf(out, json ? "{\n  \"ops\": {" : "operations:\n");
+    for (unsigned op = 0; op < NOPS; op++) {
+        struct op_stats s;
+
+        s.calls = __atomic_load_n(&op_stats[op].calls, __ATOMIC_RELAXED);
+        s.total_ns = __atomic_load_n(&op_stats[op].total_ns,
+                                     __ATOMIC_RELAXED);
+        for (unsigned i = 0; i < STATS_BUCKETS; i++)
+            s.hist[i] = __atomic_load_n(&op_stats[op].hist[i],
+                                        __ATOMIC_RELAXED);
+
+        if (json) {
+            fprintf(out, "%s\n    \"%s\": {\"calls\": %lu, \"total_ns\": %"
+                    PRIu64 ", \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+                    ", \"hist\": [", op ? "," : "", op_names[op], s.calls,
+                    s.total_ns, s.calls ? op_percentile(&s, 50) : 0,
+                    s.calls ? op_percentile(&s, 99) : 0);
+            for (unsigned i = 0; i < STATS_BUCKETS; i++)
+                fprintf(out, "%s%lu", i ? ", " : "", s.hist[i]);
+            fprintf(out, "]}");
+            continue;
+        }
+
+        if (!s.calls)
+            continue;
+        fprintf(out, "  %-10s %10lu calls  avg %10.3f us  p50 < %" PRIu64
+                " us  p99 < %" PRIu64 " us\n", op_names[op], s.calls,
+                s.total_ns / 1e3 / s.calls,
+                (op_percentile(&s, 50) + 999) / 1000,
+                (op_percentile(&s, 99) + 999) / 1000);
+        fprintf(out, "  %-10s", "");
+        for (unsigned i = 0; i < STATS_BUCKETS; i++)
+            if (s.hist[i])
+                fprintf(out, " <%lluns:%lu", 2ull << i, s.hist[i]);
+        fprintf(out, "\n");
+    }
+    if (json)
+        fprintf(out, "\n  }");
+}
+
+
+/* Count the runs of free blocks, and the length of the longest one. */
+static void freemap_runs(unsigned *ret_runs, unsigned *ret_longest)
+{
+    unsigned i = 0, runs = 0, longest = 0;
+
+    while ((i = freemap_next(i, geom.nblocks, 1)) <
+           geom.nblocks) {
+        unsigned end = freemap_next(i, geom.nblocks, 0);
+
+        runs++;
+        if (end - i > longest)
+            longest = end - i;
+        i = end;
+    }
+    *ret_runs = runs;
+    *ret_longest = longest;
+}
+
+
+/* Render all statistics as text or JSON into a new snapshot. */
+static struct stats_snap *stats_render(enum stats_format format)
+{
+    int json = format == STATS_JSON;
+    struct stats_snap *snap = malloc(sizeof(*snap));
+    unsigned long bhits, bmisses, bevictions, breadahead, dhits, dmisses;
+    unsigned bused = 0, bdirty, dcount, nfree, nshared, runs, longest;
+    struct defrag_metric fbefore, fafter;
+    unsigned long fpasses, fmoved;
+    uint64_t fmoved_bytes;
+    struct disk_stats d;
+    FILE *out;
+
+    if (!snap)
+        return NULL;
+    if (!(out = open_memstream(&snap->data, &snap->len))) {
+        free(snap);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bcache_lock);
+    bhits = bcache_hits;
+    bmisses = bcache_misses;
+    bevictions = bcache_evictions;
+    breadahead = bcache_readahead;
+    bdirty = bcache_ndirty;
+    for (unsigned i = 0; i < bcache_nslots; i++)
+        bused += bcache_slots[i].block != SFS_BLOCKIDX_EMPTY;
+    pthread_mutex_unlock(&bcache_lock);
+
+    pthread_mutex_lock(&dcache_lock);
+    dhits = dcache_hits;
+    dmisses = dcache_misses;
+    dcount = dcache_count;
+    pthread_mutex_unlock(&dcache_lock);
+
+    pthread_mutex_lock(&alloc_lock);
+    nfree = free_count;
+    nshared = shared_count;
+    freemap_runs(&runs, &longest);
+    pthread_mutex_unlock(&alloc_lock);
+
+    pthread_mutex_lock(&defrag_lock);
+    fbefore = defrag_before;
+    fafter = defrag_after;
+    fpasses = defrag_passes;
+    fmoved = defrag_moved;
+    fmoved_bytes = defrag_moved_bytes;
+    pthread_mutex_unlock(&defrag_lock);
+
+    disk_get_stats(&d);
+
+    stats_ops(out, json);
+    STATS_SECTION(out, json, "disk",
+        { "reads", d.reads },
+        { "read_bytes", d.read_bytes },
+        { "read_ns", d.read_ns },
+        { "writes", d.writes },
+        { "write_bytes", d.write_bytes },
+        { "write_ns", d.write_ns },
+        { "syncs", d.syncs },
+        { "sync_ns", d.sync_ns });
+    STATS_SECTION(out, json, "block_cache",
+        { "slots", bcache_nslots },
+        { "used", bused },
+        { "dirty", bdirty },
+        { "hits", bhits },
+        { "misses", bmisses },
+        { "evictions", bevictions },
+        { "readahead", breadahead });
+    STATS_SECTION(out, json, "dentry_cache",
+        { "capacity", options.dcache },
+        { "entries", dcount },
+        { "hits", dhits },
+        { "misses", dmisses });
+    STATS_SECTION(out, json, "allocator",
+        { "blocks", geom.nblocks },
+        { "free", nfree },
+        { "shared", nshared },
+        { "free_runs", runs },
+        { "longest_free_run", longest });
+    STATS_SECTION(out, json, "defrag",
+        { "rate_mb", options.defrag },
+        { "passes", fpasses },
+        { "moved_files", fmoved },
+        { "moved_bytes", fmoved_bytes },
+        { "files", fafter.files },
+        { "blocks", fafter.blocks },
+        { "fragmented_before", fbefore.fragmented },
+        { "fragmented_after", fafter.fragmented },
+        { "runs_before", fbefore.runs },
+        { "runs_after", fafter.runs });
+    STATS_SECTION(out, json, "journal",
+        { "enabled", options.journal },
+        { "committed", options.journal ? disk_journal_committed() : 0 },
+        { "size", options.journal ? disk_journal_size() : 0 },
+        { "commits", d.journal_commits },
+        { "bytes", d.journal_bytes },
+        { "syncs", d.journal_syncs },
+        { "ns", d.journal_ns });
+    if (json)
+        fprintf(out, "\n}\n");
+
+    if (fclose(out) != 0) {
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+
+static void stats_free(struct stats_snap *snap)
+{
+    if (snap) {
+        free(snap->data);
+        free(snap);
+    }
+}
+
+
+/* Print the statistics, as STATS_NAME shows them, to `out`. */
+static void stats_print(FILE *out)
+{
+    struct stats_snap *snap = stats_render(STATS_TEXT);
+
+    if (snap)
+        fwrite(snap->data, 1, snap->len, out);
+    stats_free(snap);
+}
+
+
+/* Fill in `st` for a statistics file, sized to what reading it now gives. */
+static int stats_stat(enum stats_format format, struct stat *st)
+{
+    struct stats_snap *snap = stats_render(format);
+
+    if (!snap)
+        return -ENOMEM;
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = time(NULL);
+    st->st_mtime = time(NULL);
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = snap->len;
+    stats_free(snap);
+    return 0;
+}
+
+
+/* Open a statistics file, taking the snapshot its reads return. The size
+ * changes all the time, so the kernel is told not to cache or trust it. */
+static int stats_open(enum stats_format format, struct fuse_file_info *fi)
+{
+    struct stats_snap *snap;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    if (!(snap = stats_render(format)))
+        return -ENOMEM;
+    fi->fh = (uintptr_t)snap;
+    fi->direct_io = 1;
+    return 0;
+}
+
+
+/* Copy up to `size` bytes at `offset` of the snapshot of handle `fi`, or of a
+ * fresh one without a handle. */
+static int stats_read(enum stats_format format, struct fuse_file_info *fi,
+                      char *buf, size_t size, off_t offset)
+{
+    struct stats_snap *snap = fi ? (struct stats_snap *)(uintptr_t)fi->fh
+                                 : NULL;
+    struct stats_snap *tmp = NULL;
+
+    if (!snap && !(snap = tmp = stats_render(format)))
+        return -ENOMEM;
+
+    if ((size_t)offset >= snap->len) {
+        size = 0;
+    } else {
+        if (size > snap->len - offset)
+            size = snap->len - offset;
+        memcpy(buf, snap->data + offset, size);
+    }
+    stats_free(tmp);
+    return size;
+}
+
+
+/*
+ * The operations below work on an entry's disk offset rather than on a path,
+ * and are shared by the path-based handlers and the inode-based ones
+ * (sfs_ll_*). Callers hold ns_lock shared (exclusively for dir_remove), and
+ * pass the name the entry was looked up by, so that an entry that has been
+ * replaced in the meantime is not touched. A NULL name accepts any entry at
+ * that offset. Operations that add or remove entries also take the directory
+ * they are in.
+ */
+
+/* Fill in `st` for `entry`, or for the root directory if `entry` is NULL. */
+static void fill_stat(const struct sfs_entry *entry, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+
+    st->st_atime = time(NULL);
+    st->st_mtime = time(NULL);
+
+    if (!entry || (entry->size & SFS_DIRECTORY)) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = entry->size & SFS_SIZEMASK;
+    }
+}
+
+
+/*
+ * Read up to `size` bytes at `offset` of open file `f` into `buf`.
+ * Returns the number of bytes read, or < 0 on error.
+ */
+static int file_read(struct sfs_file *f, const char *name, char *buf,
+                     size_t size, off_t offset)
+{
+    struct sfs_entry entry;
+    size_t file_size;
+    int res;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    /* Shared: reads of the same file run in parallel, but not with writes. */
+    pthread_rwlock_rdlock(&f->lock);
+    if ((res = entry_reload(f->entry_off, name, &entry)) == 0) {
+        file_size = entry.size & SFS_SIZEMASK;
+        if ((size_t)offset >= file_size)
+            size = 0;
+        else if (size > file_size - offset)
+            size = file_size - offset;
+        file_readahead(f, &entry, size, offset);
+        res = file_pread(f, &entry, buf, size, offset);
+    }
+    pthread_rwlock_unlock(&f->lock);
+    return res;
+}
+
+
+/*
+ * Write `size` bytes of `buf` at `offset` of open file `f`, growing it if
+ * necessary. If `src` is not NULL, the data is instead copied by libfuse from
+ * `src` straight into the file's blocks on disk, bypassing the block cache
+ * (which must not hold dirty data for this file).
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int file_write(struct sfs_file *f, const char *name, const char *buf,
+                      struct fuse_bufvec *src, size_t size, off_t offset)
+{
+    struct sfs_entry entry;
+    size_t old_size, end;
+    int res, grown = 0;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    end = offset + size;
+    if (end > SFS_SIZEMASK)
+        return -EFBIG;
+
+    /* Writers of the same file are serialized; other files proceed. */
+    pthread_rwlock_wrlock(&f->lock);
+    pthread_rwlock_rdlock(&txn_lock);
+    if ((res = entry_reload(f->entry_off, name, &entry)))
+        goto out;
+
+    old_size = entry.size & SFS_SIZEMASK;
+
+    /* Blocks shared with clones are copied before they change, and all
+     * blocks needed to grow the file are allocated up front. */
+    if ((res = file_unshare(f, &entry, (size_t)offset < old_size
+                                       ? (size_t)offset : old_size, end)) ||
+            (res = file_reserve(f, &entry, end)))
+        goto out;
+
+    /* A hole between the old end of the file and `offset` reads as zeroes. */
+    if ((size_t)offset > old_size)
+        file_pwrite(f, &entry, NULL, offset - old_size, old_size);
+
+    if (src) {
+        struct fuse_bufvec *dst = file_bufvec(f, &entry, size, offset);
+        ssize_t n = dst ? fuse_buf_copy(dst, src, 0) : -ENOMEM;
+
+        bufvec_free(dst);
+
+        /* On a short copy, keep what was written and give back the rest of
+         * the blocks reserved above. */
+        if (n < 0 || (size_t)n < size) {
+            size = n < 0 ? 0 : n;
+            end = size ? offset + size : old_size;
+            file_shrink(f, &entry, end > old_size ? end : old_size);
+            if (n < 0)
+                res = n;
+        }
+    } else
+        file_pwrite(f, &entry, buf, size, offset);
+
+    /* The block table and entry are written once for the whole call. */
+    if (end > old_size) {
+        entry.size = (entry.size & ~SFS_SIZEMASK) | end;
+        entry_lock(f->entry_off, 1);
+        put_entry(f->entry_off, &entry);
+        entry_unlock(f->entry_off);
+        grown = 1;
+    }
+    if (res == 0)
+        res = size;
+
+out:
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&f->lock);
+    if (grown)
+        meta_commit();
+    return res;
+}
+
+
+/*
+ * Write the contents of `src` at `offset` of open file `f`. Data arriving in a
+ * pipe (spliced from /dev/fuse) is moved into the image with splice; anything
+ * else takes the normal write path through the block cache.
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int file_write_buf(struct sfs_file *f, const char *name,
+                          struct fuse_bufvec *src, off_t offset)
+{
+    size_t size = fuse_buf_size(src);
+    struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+    int res;
+
+    if (src->count == 1 && !(src->buf[0].flags & FUSE_BUF_IS_FD))
+        return file_write(f, name, src->buf[0].mem, NULL, size, offset);
+
+    /* With --writeback the cache may hold newer data than the disk, so it
+     * cannot be bypassed. */
+    if (!options.writeback)
+        return file_write(f, name, NULL, src, size, offset);
+
+    tmp.buf[0].mem = malloc(size ? size : 1);
+    if (!tmp.buf[0].mem)
+        return -ENOMEM;
+
+    res = fuse_buf_copy(&tmp, src, 0);
+    if (res >= 0)
+        res = file_write(f, name, tmp.buf[0].mem, NULL, res, offset);
+    free(tmp.buf[0].mem);
+    return res;
+}
+
+
+/*
+ * Shrink or grow open file `f` to `size` bytes; added bytes read as zeroes.
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_truncate(struct sfs_file *f, const char *name, off_t size)
+{
+    struct sfs_entry entry;
+    size_t old_size;
+    int res;
+
+    if (size < 0)
+        return -EINVAL;
+
+    if ((size_t)size > SFS_SIZEMASK)
+        return -EFBIG;
+
+    pthread_rwlock_wrlock(&f->lock);
+    pthread_rwlock_rdlock(&txn_lock);
+    if ((res = entry_reload(f->entry_off, name, &entry)))
+        goto out;
+
+    old_size = entry.size & SFS_SIZEMASK;
+
+    if ((size_t)size > old_size) {
+        if ((res = file_unshare(f, &entry, old_size, size)) ||
+                (res = file_reserve(f, &entry, size)))
+            goto out;
+        file_pwrite(f, &entry, NULL, size - old_size, old_size);
+    } else {
+        if ((res = file_unshare_cut(f, &entry, size)))
+            goto out;
+        file_shrink(f, &entry, size);
+    }
+
+    entry.size = (entry.size & ~SFS_SIZEMASK) | size;
+    entry_lock(f->entry_off, 1);
+    put_entry(f->entry_off, &entry);
+    entry_unlock(f->entry_off);
+
+out:
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&f->lock);
+    if (res == 0)
+        meta_commit();
+    return res;
+}
+
+
+/*
+ * Make open file `dst`, called `name` (or any file, if `name` is NULL), a
+ * clone of the file at `src_off` called `src_name`: it takes over its size
+ * and shares all of its blocks, until file_unshare() copies those that either
+ * of them changes. Of a file mapped by extents, only the list is copied. The
+ * previous contents of `dst` are released.
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_clone(struct sfs_file *dst, const char *name, off_t src_off,
+                      const char *src_name)
+{
+    struct sfs_entry entry, src_entry;
+    struct file_extent *ext = NULL;
+    struct sfs_extent *buf = NULL;
+    blockidx_t first, list = SFS_BLOCKIDX_END;
+    unsigned n = 0, nlist = 0, i;
+    struct sfs_file *src;
+    int res = 0;
+
+    if (!block_refs)
+        return -EOPNOTSUPP;
+    if (src_off == dst->entry_off)
+        return -EINVAL;
+    if (!(src = file_get(src_off)))
+        return -ENOMEM;
+
+    if (src_off < dst->entry_off) {
+        pthread_rwlock_rdlock(&src->lock);
+        pthread_rwlock_wrlock(&dst->lock);
+    } else {
+        pthread_rwlock_wrlock(&dst->lock);
+        pthread_rwlock_rdlock(&src->lock);
+    }
+    pthread_rwlock_rdlock(&txn_lock);
+    if ((res = entry_reload(dst->entry_off, name, &entry)) ||
+            (res = entry_reload(src_off, src_name, &src_entry)))
+        goto out;
+    first = entry_block(&src_entry);
+
+    if (src_entry.size & SFS_EXTENTS) {
+        pthread_mutex_lock(&src->idx_lock);
+        if (first != src->first_block)
+            res = ext_load(src, &src_entry);
+        if (res == 0 && (n = src->nextents)) {
+            if ((ext = malloc(n * sizeof(*ext))))
+                memcpy(ext, src->ext, n * sizeof(*ext));
+            else
+                res = -ENOMEM;
+        }
+        pthread_mutex_unlock(&src->idx_lock);
+
+        nlist = DIV_ROUND_UP(n, EXT_PER_BLOCK);
+        if (res == 0 && nlist && !(buf = malloc(geom.block_size)))
+            res = -ENOMEM;
+        if (res)
+            goto out;
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+    if (!(src_entry.size & SFS_EXTENTS)) {
+        res = chain_ref(first);
+    } else if (nlist > free_count) {
+        res = -ENOSPC;
+    } else {
+        for (i = 0; i < n && (res = chain_ref(ext[i].start)) == 0; i++)
+            ;
+        if (res)
+            while (i--)
+                free_chain(ext[i].start);
+        else if (nlist)
+            list = alloc_blocks(nlist, ext[0].start, 0);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (res)
+        goto out;
+
+    file_shrink(dst, &entry, 0);
+    i = 0;
+    for (blockidx_t lb = list; lb < geom.nblocks; lb = block_table[lb]) {
+        for (unsigned j = 0; j < EXT_PER_BLOCK; j++, i++)
+            buf[j] = i < n ? (struct sfs_extent){ ext[i].start, ext[i].len }
+                           : (struct sfs_extent){ 0, 0 };
+        meta_write(buf, geom.block_size, block_off(lb));
+    }
+
+    entry_set_block(&entry, src_entry.size & SFS_EXTENTS ? list : first);
+    entry.size = src_entry.size;
+    entry_lock(dst->entry_off, 1);
+    put_entry(dst->entry_off, &entry);
+    entry_unlock(dst->entry_off);
+    file_invalidate(dst->entry_off);
+
+out:
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&dst->lock);
+    pthread_rwlock_unlock(&src->lock);
+    file_put(src);
+    free(ext);
+    free(buf);
+    if (res == 0)
+        meta_commit();
+    return res;
+}
+
+
+/*
+ * Add an empty file or directory called `name` to `dir`, and return the new
+ * entry and its disk offset. If `path` is not NULL, the entry is also added to
+ * the dentry cache under it.
+ * Returns 0 on success, < 0 on error.
+ */
+static int dir_add(struct sfs_dir *dir, const char *name, int is_dir,
+                   const char *path, struct sfs_entry *ret_entry,
+                   off_t *ret_entry_off)
+{
+    struct sfs_entry entry = empty_entry;
+    blockidx_t first_block = SFS_BLOCKIDX_END;
+    uint32_t slot, hash;
+    int res;
+
+    if (strlen(name) >= geom.filename_max)
+        return -ENAMETOOLONG;
+    if (dir->off == geom.rootdir_off && stats_name(name))
+        return -EEXIST;
+
+    /* The free slot is claimed under the directory's exclusive lock. */
+    pthread_rwlock_rdlock(&txn_lock);
+    if ((res = dir_lock(dir, 1))) {
+        pthread_rwlock_unlock(&txn_lock);
+        return res;
+    }
+    if ((res = dir_find_free(dir, name, &slot, &hash)))
+        goto out;
+    *ret_entry_off = dir_slot_off(dir, slot);
+
+    if (is_dir) {
+        /* The first segment of the new directory has to be stored in
+         * consecutive blocks. */
+        pthread_mutex_lock(&alloc_lock);
+        first_block = alloc_blocks(DIR_SEG_BLOCKS, 0, 1);
+        pthread_mutex_unlock(&alloc_lock);
+
+        if (first_block == SFS_BLOCKIDX_EMPTY) {
+            res = -ENOSPC;
+            goto out;
+        }
+        data_rw(1, dir_seg_empty, DIR_SEG_SIZE, block_off(first_block));
+    }
+
+    strcpy(entry.filename, name);
+    entry_set_block(&entry, first_block);
+    entry.size = is_dir ? SFS_DIRECTORY : options.extents ? SFS_EXTENTS : 0;
+    entry_lock(*ret_entry_off, 1);
+    put_entry(*ret_entry_off, &entry);
+    entry_unlock(*ret_entry_off);
+    dir->nfree--;
+    dir_insert(dir, slot, hash);
+    if (path)
+        dcache_insert(path, &entry, *ret_entry_off);
+    *ret_entry = entry;
+
+out:
+    dir_unlock(dir);
+    pthread_rwlock_unlock(&txn_lock);
+    if (res == 0)
+        meta_commit();
+    return res;
+}
+
+
+/*
+ * Remove the file at `entry_off` and release its blocks, once reads and writes
+ * of it that are still in progress have finished.
+ * Returns 0 on success, < 0 on error.
+ */
+static int file_remove(struct sfs_dir *dir, off_t entry_off, const char *name)
+{
+    struct sfs_entry entry;
+    struct sfs_file *f;
+    int res = 0;
+
+    if (!(f = file_get(entry_off)))
+        return -ENOMEM;
+    pthread_rwlock_wrlock(&f->lock);
+    pthread_rwlock_rdlock(&txn_lock);
+    if ((res = dir_lock(dir, 1)))
+        goto out;
+
+    entry_lock(entry_off, 1);
+    entry_read(entry_off, &entry);
+    if (entry.filename[0] == '\0' ||
+            (name && strcmp(entry.filename, name) != 0))
+        res = -ENOENT;
+    else if (entry.size & SFS_DIRECTORY)
+        res = -EISDIR;
+    else
+        put_entry(entry_off, &empty_entry);
+    entry_unlock(entry_off);
+    if (res == 0)
+        dir_unlink(dir, entry.filename, entry_off);
+    dir_unlock(dir);
+
+    if (res == 0) {
+        file_shrink(f, &entry, 0);
+        file_invalidate(entry_off);
+    }
+
+out:
+    pthread_rwlock_unlock(&txn_lock);
+    pthread_rwlock_unlock(&f->lock);
+    file_put(f);
+    if (res == 0)
+        meta_commit();
+    return res;
+}
+
+
+/*
+ * Remove the empty directory at `entry_off`. The caller holds ns_lock
+ * exclusively, so nothing but meta_flush() runs concurrently.
+ * Returns 0 on success, < 0 on error.
+ */
+static int dir_remove(struct sfs_dir *dir, off_t entry_off, const char *name)
+{
+    struct sfs_entry entry;
+    struct sfs_dir *sub;
+    unsigned nused;
+    int res;
+
+    entry_read(entry_off, &entry);
+    if (entry.filename[0] == '\0' ||
+            (name && strcmp(entry.filename, name) != 0))
+        return -ENOENT;
+    if (!(entry.size & SFS_DIRECTORY))
+        return -ENOTDIR;
+
+    if (!(sub = dir_get(block_off(entry_block(&entry)))))
+        return -ENOMEM;
+    if ((res = dir_lock(sub, 0)))
+        return res;
+    nused = sub->nused;
+    dir_unlock(sub);
+    if (nused)
+        return -ENOTEMPTY;
+
+    pthread_rwlock_rdlock(&txn_lock);
+    if ((res = dir_lock(dir, 1))) {
+        pthread_rwlock_unlock(&txn_lock);
+        return res;
+    }
+    entry_lock(entry_off, 1);
+    put_entry(entry_off, &empty_entry);
+    entry_unlock(entry_off);
+    dir_unlink(dir, entry.filename, entry_off);
+    dir_unlock(dir);
+
+    /* This releases all of its segments. */
+    pthread_mutex_lock(&alloc_lock);
+    free_chain(entry_block(&entry));
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_rwlock_unlock(&txn_lock);
+    dir_forget(sub->off);
+
+    /* The journal may still hold changes to the directory's blocks, which
+     * must not be replayed once they are reused. */
+    if (options.journal)
+        meta_checkpoint();
+    else
+        meta_commit();
+    return 0;
+}
+
+
+static int sfs_getattr(const char *path,
+                       struct stat *st)
+{
+    OP_STATS(OP_GETATTR);
+    OP_TRACE(path, 0, 0);
+
+    int res = 0;  
+    struct sfs_entry entry;
+    off_t entry_off; 
+    enum stats_format format;
+
+    if(strcmp(path, "/") == 0) {
+        fill_stat(NULL, st);
+    } 
+    else if((format = stats_path(path)))
+        res = stats_stat(format, st);
+    else { 
+        pthread_rwlock_rdlock(&ns_lock);
+        res = get_entry(path, &entry, &entry_off);
+        pthread_rwlock_unlock(&ns_lock);
+
+        if(res == 0) 
+            fill_stat(&entry, st);
+        else 
+            res = -ENOENT;  
+    }
+    return OP_RESULT(res);
+}
+
+static int sfs_readdir(const char *path,
+                       void *buf,
+                       fuse_fill_dir_t filler,
+                       off_t offset,
+                       struct fuse_file_info *fi)
+{
+    (void)offset, (void)fi;
+    OP_STATS(OP_READDIR);
+    OP_TRACE(path, 0, 0);
+
+    struct sfs_entry *scratch = malloc(DIR_SEG_SIZE);
+    const struct sfs_entry *entries;
+    struct sfs_dir *dir;
+    int res;
+
+    if(!scratch) 
+        return OP_RESULT(-ENOMEM);
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if((res = get_dir(path, &dir)) == 0 && (res = dir_lock(dir, 0)) == 0) {
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+
+        for(unsigned seg = 0; seg < dir->nsegs; seg++) {
+            entries = dir_seg_get(dir, seg, scratch);
+            for(unsigned i = 0; i < dir_seg_len(dir, seg); i++) {
+                if(entries[i].filename[0] == '\0') 
+                    continue; 
+                filler(buf, entries[i].filename, NULL, 0);
+            }
+            dir_seg_put(dir, seg);
+        }
+        dir_unlock(dir);
+    } 
+    else if(res != -ENOMEM) 
+        res = -ENOENT;
+
+    free(scratch);
+
+    pthread_rwlock_unlock(&ns_lock);
+    return OP_RESULT(res);  
+}
+
+/*
+ * Open the file at `path`, setting up the state in fi->fh that later reads and
+ * writes on this handle use.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_open(const char *path, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_OPEN);
+    OP_TRACE(path, 0, 0);
+    OP_TRACE_ARGS(fi, fi->flags);
+
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_file *f;
+    enum stats_format format;
+    int res = 0;
+
+    if((format = stats_path(path)))
+        return OP_RESULT(stats_open(format, fi));
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if(get_entry(path, &entry, &entry_off) != 0) 
+        res = -ENOENT;
+    else if(entry.size & SFS_DIRECTORY) 
+        res = -EISDIR;
+    else if(!(f = file_get(entry_off))) 
+        res = -ENOMEM;
+    else 
+        fi->fh = (uintptr_t)f;
+
+    pthread_rwlock_unlock(&ns_lock);
+    return OP_RESULT(res);
+}
+
+
+static int sfs_release(const char *path, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_RELEASE);
+    OP_TRACE(path, 0, 0);
+    OP_TRACE_ARGS(fi, 0);
+
+    if(stats_path(path)) 
+        stats_free((struct stats_snap *)(uintptr_t)fi->fh);
+    else if(fi->fh) 
+        file_put((struct sfs_file *)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
+
+/* Return the open file state for the entry at `entry_off`: that of handle `fi`
+ * if it refers to the same file, otherwise a new reference (which the caller
+ * has to drop again if it differs from fi->fh). */
+static struct sfs_file *file_from_fi(struct fuse_file_info *fi,
+                                     off_t entry_off)
+{
+    struct sfs_file *f = fi ? (struct sfs_file *)(uintptr_t)fi->fh : NULL;
+
+    if (f && f->entry_off == entry_off)
+        return f;
+    return file_get(entry_off);
+}
+
+static void file_done(struct fuse_file_info *fi, struct sfs_file *f)
+{
+    if (!fi || (struct sfs_file *)(uintptr_t)fi->fh != f)
+        file_put(f);
+}
+
+
+static int sfs_read(const char *path,
+                    char *buf,
+                    size_t size,
+                    off_t offset,
+                    struct fuse_file_info *fi)
+{
+    OP_STATS(OP_READ);
+    OP_TRACE(path, offset, size);
+    OP_TRACE_ARGS(fi, 0);
+
+    struct sfs_entry entry;
+    off_t entry_offset;
+    struct sfs_file *f;
+    enum stats_format format;
+    int res = -EISDIR;
+
+    if((format = stats_path(path)))
+        return OP_RESULT(stats_read(format, fi, buf, size, offset));
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if(get_entry(path, &entry, &entry_offset) == 0 && !(entry.size & SFS_DIRECTORY)) {
+        if((f = file_from_fi(fi, entry_offset))) {
+            res = file_read(f, strrchr(path, '/') + 1, buf, size, offset);
+            file_done(fi, f);
+        } 
+        else 
+            res = -ENOMEM;
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+    return OP_RESULT(res); 
+}
+
+
+static int sfs_mkdir(const char *path,
+                     mode_t mode)
+{
+    OP_STATS(OP_MKDIR);
+    OP_TRACE(path, 0, 0);
+    OP_TRACE_ARGS(NULL, mode);
+
+    const char *name;
+    char *parent_path = split_path(path, &name);
+    struct sfs_dir *parent;
+    struct sfs_entry entry;
+    off_t entry_off;
+    int res;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if((res = get_dir(parent_path, &parent)) == 0) 
+        res = dir_add(parent, name, 1, path, &entry, &entry_off);
+
+    pthread_rwlock_unlock(&ns_lock);
+    free(parent_path);
+    return OP_RESULT(res);
+}
+
+static int sfs_rmdir(const char *path)
+{
+    OP_STATS(OP_RMDIR);
+    OP_TRACE(path, 0, 0);
+
+    const char *name;
+    char *parent_path = split_path(path, &name);
+    struct sfs_dir *parent;
+    struct sfs_entry dir_entry;
+    off_t dir_entry_offset;
+    int res;
+
+    /* Exclusive, so no other operation is using a path through it. */
+    pthread_rwlock_wrlock(&ns_lock);
+
+    if(get_entry(path, &dir_entry, &dir_entry_offset) != 0) 
+        res = -ENOENT;
+    else if((res = get_dir(parent_path, &parent)) == 0) 
+        res = dir_remove(parent, dir_entry_offset, name);
+
+    pthread_rwlock_unlock(&ns_lock);
+    free(parent_path);
+    return OP_RESULT(res); 
+}
+
+static int sfs_unlink(const char *path)
+{
+    OP_STATS(OP_UNLINK);
+    OP_TRACE(path, 0, 0);
+
+    const char *name;
+    char *parent_path;
+    struct sfs_dir *parent;
+    struct sfs_entry file_entry;
+    off_t file_entry_offset;
+    int res;
+
+    if(stats_path(path)) 
+        return OP_RESULT(-EACCES);
+
+    parent_path = split_path(path, &name);
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if(get_entry(path, &file_entry, &file_entry_offset) != 0) 
+        res = -ENOENT;
+    else if(file_entry.size & SFS_DIRECTORY) 
+        res = -EISDIR;
+    else if((res = get_dir(parent_path, &parent)) == 0) 
+        res = file_remove(parent, file_entry_offset, name);
+
+    pthread_rwlock_unlock(&ns_lock);
+    free(parent_path);
+    return OP_RESULT(res); 
+}
+
+
+static int sfs_create(const char *path,
+                      mode_t mode,
+                      struct fuse_file_info *fi)
+{
+    OP_STATS(OP_CREATE);
+    OP_TRACE(path, 0, 0);
+    OP_TRACE_ARGS(fi, mode);
+
+    const char *file;
+    char *parent_path = split_path(path, &file);
+    struct sfs_dir *parent;
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_file *f;
+    int res;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if((res = get_dir(parent_path, &parent)) == 0 &&
+       (res = dir_add(parent, file, 0, path, &entry, &entry_off)) == 0) {
+        if(!(f = file_get(entry_off))) 
+            res = -ENOMEM;
+        else 
+            fi->fh = (uintptr_t)f;
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+    free(parent_path);
+    return OP_RESULT(res); 
+}
+
+
+/*
+ * Shrink or grow the file at `path` to `size` bytes.
+ * Excess bytes are thrown away, whereas any bytes added in the process should
+ * be nil (\0).
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_ftruncate(const char *path, off_t size,
+                         struct fuse_file_info *fi)
+{
+    OP_STATS(OP_TRUNCATE);
+    OP_TRACE(path, size, 0);
+    OP_TRACE_ARGS(fi, 0);
+
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_file *f;
+    int res;
+
+    if(stats_path(path)) 
+        return OP_RESULT(-EACCES);
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if(get_entry(path, &entry, &entry_off) != 0) 
+        res = -ENOENT;
+    else if(entry.size & SFS_DIRECTORY) 
+        res = -EISDIR;
+    else if(!(f = file_from_fi(fi, entry_off))) 
+        res = -ENOMEM;
+    else {
+        res = file_truncate(f, strrchr(path, '/') + 1, size);
+        file_done(fi, f);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+    return OP_RESULT(res);
+}
+
+static int sfs_truncate(const char *path, off_t size)
+{
+    return sfs_ftruncate(path, size, NULL);
+}
+
+
+/*
+ * Write contents of `buf` (of `size` bytes) to the file at `path`.
+ * The file is grown if nessecary, and any bytes already present are overwritten
+ * (whereas any other data is left intact). The `offset` argument specifies how
+ * many bytes should be skipped in the file, after which `size` bytes from
+ * buffer are written.
+ * This means that the new file size will be max(old_size, offset + size).
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int sfs_write(const char *path,
+                     const char *buf,
+                     size_t size,
+                     off_t offset,
+                     struct fuse_file_info *fi)
+{
+    OP_STATS(OP_WRITE);
+    OP_TRACE(path, offset, size);
+    OP_TRACE_ARGS(fi, 0);
+
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_file *f;
+    int res;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if(get_entry(path, &entry, &entry_off) != 0) 
+        res = -ENOENT;
+    else if(entry.size & SFS_DIRECTORY) 
+        res = -EISDIR;
+    else if(!(f = file_from_fi(fi, entry_off))) 
+        res = -ENOMEM;
+    else {
+        res = file_write(f, strrchr(path, '/') + 1, buf, NULL, size,
+                         offset);
+        file_done(fi, f);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+    return OP_RESULT(res);
+}
+
+
+/*
+ * Zero-copy variant of sfs_write, taking the data from `buf`, which may refer
+ * to a pipe holding the request's payload.
+ * Returns the number of bytes written, or < 0 on error.
+ */
+static int sfs_write_buf(const char *path,
+                         struct fuse_bufvec *buf,
+                         off_t offset,
+                         struct fuse_file_info *fi)
+{
+    OP_STATS(OP_WRITE);
+    OP_TRACE(path, offset, fuse_buf_size(buf));
+    OP_TRACE_ARGS(fi, 1);
+
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_file *f;
+    int res;
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if (get_entry(path, &entry, &entry_off) != 0)
+        res = -ENOENT;
+    else if (entry.size & SFS_DIRECTORY)
+        res = -EISDIR;
+    else if (!(f = file_from_fi(fi, entry_off)))
+        res = -ENOMEM;
+    else {
+        res = file_write_buf(f, strrchr(path, '/') + 1, buf, offset);
+        file_done(fi, f);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+    return OP_RESULT(res);
+}
+
+
+/*
+ * Move/rename the file at `path` to `newpath`.
+ * Returns 0 on succes, < 0 on error.
+ */
+static int sfs_rename(const char *path,
+                      const char *newpath)
+{
+    /* Implementing this function is optional, and not worth any points. */
+    (void)path, (void)newpath;
+
+    return -ENOSYS;
+}
+
+
+/*
+ * Called when the filesystem is mounted: load the metadata we keep resident.
+ */
+static void *sfs_init(struct fuse_conn_info *conn)
+{
+    /* Let the kernel hand over the data of writes in pipes, which write_buf can
+     * then splice into the image. Reads are answered from memory. */
+    if (conn)
+        conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+
+    disk_get_geometry(&geom);
+    locks_init();
+    bcache_init();
+    meta_load();
+
+    /* Journaled directory blocks are held in the block cache. */
+    if (options.journal && !bcache_nslots) {
+        fprintf(stderr, "--journal needs the block cache, not journaling\n");
+        options.journal = 0;
+    }
+    if (options.journal)
+        disk_journal_open();
+
+    if (options.extents && geom.version == 1) {
+        fprintf(stderr, "--extents needs a version 2 image, not using "
+                "extents\n");
+        options.extents = 0;
+    }
+
+    trace_start();
+    defrag_start();
+    return NULL;
+}
+
+
+/*
+ * Called on every close() of a file. Like any modifying operation, this writes
+ * back what is only cached in memory once the --writeback interval has passed;
+ * closing a file does not make it durable, fsync does.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_FLUSH);
+    OP_TRACE(path, 0, 0);
+    OP_TRACE_ARGS(fi, 0);
+
+    meta_commit();
+    return 0;
+}
+
+
+/*
+ * Write back any pending metadata and flush the image to stable storage.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_FSYNC);
+    OP_TRACE(path, 0, 0);
+    OP_TRACE_ARGS(fi, datasync);
+
+    meta_flush();
+    disk_sync();
+    return 0;
+}
+
+
+/*
+ * Make the open file at `path` a clone of the file named in the argument (see
+ * SFS_IOC_CLONE): its old contents are dropped and it shares all blocks of the
+ * source, which is not changed. Only the clone ioctl is known.
+ * Returns 0 on success, < 0 on error.
+ */
+static int sfs_ioctl(const char *path, int cmd, void *arg,
+                     struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    const struct sfs_clone_arg *clone = data;
+    struct sfs_entry entry, src_entry;
+    off_t entry_off, src_off;
+    struct sfs_file *f;
+    int res;
+
+    (void)arg, (void)flags;
+    if ((unsigned)cmd != SFS_IOC_CLONE)
+        return -ENOTTY;
+
+    OP_STATS(OP_CLONE);
+    OP_TRACE(path, 0, 0);
+    OP_TRACE_ARGS(fi, 0);
+
+    if (stats_path(path))
+        return OP_RESULT(-EACCES);
+    if (!memchr(clone->path, '\0', sizeof(clone->path)))
+        return OP_RESULT(-ENAMETOOLONG);
+    if (clone->path[0] != '/')
+        return OP_RESULT(-EINVAL);
+
+    pthread_rwlock_rdlock(&ns_lock);
+
+    if (get_entry(path, &entry, &entry_off) != 0 ||
+            get_entry(clone->path, &src_entry, &src_off) != 0)
+        res = -ENOENT;
+    else if ((entry.size | src_entry.size) & SFS_DIRECTORY)
+        res = -EISDIR;
+    else if (!(f = file_from_fi(fi, entry_off)))
+        res = -ENOMEM;
+    else {
+        res = file_clone(f, strrchr(path, '/') + 1, src_off,
+                         strrchr(clone->path, '/') + 1);
+        file_done(fi, f);
+    }
+
+    pthread_rwlock_unlock(&ns_lock);
+    return OP_RESULT(res);
+}
+
+
+/*
+ * Called when the filesystem is unmounted: make sure everything we wrote
+ * reaches the image.
+ */
+static void sfs_destroy(void *private_data)
+{
+    (void)private_data;
+
+    defrag_stop();
+    meta_checkpoint();
+    disk_sync();
+    trace_stop();
+
+    /* With -v, end the trace with the final cache and disk counters. */
+    if (options.verbose)
+        stats_print(stdout);
+}
+
+
+static const struct fuse_operations sfs_oper = {
+    .getattr    = sfs_getattr,
+    .readdir    = sfs_readdir,
+    .open       = sfs_open,
+    .release    = sfs_release,
+    .read       = sfs_read,
+    .mkdir      = sfs_mkdir,
+    .rmdir      = sfs_rmdir,
+    .unlink     = sfs_unlink,
+    .create     = sfs_create,
+    .truncate   = sfs_truncate,
+    .ftruncate  = sfs_ftruncate,
+    .write      = sfs_write,
+    .write_buf  = sfs_write_buf,
+    .rename     = sfs_rename,
+    .flush      = sfs_flush,
+    .fsync      = sfs_fsync,
+    .ioctl      = sfs_ioctl,
+    .init       = sfs_init,
+    .destroy    = sfs_destroy,
+};
 
-struct options {
-    const char *img;
-    int background;
-    int verbose;
-    int show_help;
-    int show_fuse_help;
-} options;
 
+/*
+ * Alternative engine on the low-level FUSE API (--lowlevel). The kernel refers
+ * to files by inode number instead of by path, and the inode number of a file
+ * is simply the disk offset of its entry (the root directory, which has no
+ * entry, is FUSE_ROOT_ID). A lookup therefore only scans a single directory,
+ * and operations on an inode never resolve a path at all. The kernel caches
+ * entries and attributes for LL_TIMEOUT seconds.
+ *
+ * When an entry slot is reused after its file has been removed, the new file
+ * gets another generation number, so the kernel cannot mistake it for the old
+ * one.
+ */
+#define LL_TIMEOUT 1.0
+#define LL_UNKNOWN_INO 0xffffffffu
 
-#define log(fmt, ...) \
-    do { \
-        if (options.verbose) \
-            printf(" # " fmt, ##__VA_ARGS__); \
-    } while (0)
+#define LL_NSLOTS ((geom.data_off - geom.rootdir_off) / sizeof(struct sfs_entry) \
+                   + (size_t)geom.nblocks * (geom.block_size \
+                                             / sizeof(struct sfs_entry)))
 
+/* Generation numbers by entry slot, in chunks of LL_GEN_CHUNK slots that are
+ * only allocated once one of their slots is reused; on large images most
+ * slots lie in file data and never hold an entry. */
+#define LL_GEN_CHUNK 1024u
 
-const char* __asan_default_options() { return "detect_leaks=0"; }
+static uint32_t **ll_gen;
 
+/* The statistics files (see STATS_NAME) get the inode numbers after the root,
+ * which no entry offset can have. */
+#define LL_STATS_INO(format) (FUSE_ROOT_ID + (format))
 
-static int get_entry_rec(const char *path, const struct sfs_entry *parent,
-                         size_t parent_nentries, blockidx_t parent_blockidx,
-                         struct sfs_entry *ret_entry, unsigned *ret_entry_off) {
 
-    if(!path || !parent) 
-        return -EINVAL;  
+static inline size_t ll_slot(fuse_ino_t ino)
+{
+    return (ino - geom.rootdir_off) / sizeof(struct sfs_entry);
+}
 
-    char *path_copy = strdup(path);  
-    char *current = strtok(path_copy, "/");  
-    char *next = strtok(NULL, ""); 
+static uint32_t ll_gen_get(size_t slot)
+{
+    uint32_t *chunk = __atomic_load_n(&ll_gen[slot / LL_GEN_CHUNK],
+                                      __ATOMIC_ACQUIRE);
 
-    struct sfs_entry root_dir[SFS_ROOTDIR_NENTRIES];
-    struct sfs_entry sub_dir[SFS_DIR_NENTRIES];
-
-    if(parent_nentries == SFS_ROOTDIR_NENTRIES) {
-        disk_read(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-
-        for(size_t i = 0; i < SFS_ROOTDIR_NENTRIES; i++) {
-            if(strcmp(current, root_dir[i].filename) == 0) {
-                if(!next) {  
-                    *ret_entry = root_dir[i];
-                    *ret_entry_off = SFS_ROOTDIR_OFF + i * sizeof(struct sfs_entry);
-                    return 0;
-                } 
-                else 
-                    return get_entry_rec(next, root_dir, SFS_DIR_NENTRIES, root_dir[i].first_block, ret_entry, ret_entry_off);
-            }
+    return chunk ? __atomic_load_n(&chunk[slot % LL_GEN_CHUNK],
+                                   __ATOMIC_RELAXED) : 0;
+}
+
+static void ll_gen_bump(size_t slot)
+{
+    uint32_t **pp = &ll_gen[slot / LL_GEN_CHUNK];
+    uint32_t *chunk = __atomic_load_n(pp, __ATOMIC_ACQUIRE), *old = NULL;
+
+    if (!chunk) {
+        if (!(chunk = calloc(LL_GEN_CHUNK, sizeof(uint32_t)))) {
+            fprintf(stderr, "Could not allocate generation numbers\n");
+            exit(1);
         }
-        return -1;
-    } 
-    else if(parent_nentries == SFS_DIR_NENTRIES) {
-        disk_read(sub_dir, SFS_DIR_SIZE, SFS_DATA_OFF + parent_blockidx * SFS_BLOCK_SIZE);
-
-        for(size_t i = 0; i < SFS_DIR_NENTRIES; i++) {
-            if(strcmp(current, sub_dir[i].filename) == 0) {
-                if(!next) {  
-                    *ret_entry = sub_dir[i];
-                    *ret_entry_off = SFS_DATA_OFF + parent_blockidx * SFS_BLOCK_SIZE + i * sizeof(struct sfs_entry);
-                    return 0;
-                } 
-                else 
-                    return get_entry_rec(next, sub_dir, SFS_DIR_NENTRIES, sub_dir[i].first_block, ret_entry, ret_entry_off);
-            }
+        if (!__atomic_compare_exchange_n(pp, &old, chunk, 0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            free(chunk);
+            chunk = old;
         }
-        return -1;
     }
-    return -ENOENT;
+    __atomic_fetch_add(&chunk[slot % LL_GEN_CHUNK], 1, __ATOMIC_RELAXED);
 }
 
+static enum stats_format ll_stats_format(fuse_ino_t ino)
+{
+    if (ino == LL_STATS_INO(STATS_TEXT))
+        return STATS_TEXT;
+    if (ino == LL_STATS_INO(STATS_JSON))
+        return STATS_JSON;
+    return STATS_NONE;
+}
 
-static int get_entry(const char *path, struct sfs_entry *ret_entry,
-                     unsigned *ret_entry_off)
+/* Check that `ino` is the disk offset of a root or subdirectory entry. */
+static int ll_valid(fuse_ino_t ino)
 {
-    struct sfs_entry root_dir[SFS_ROOTDIR_NENTRIES];
-    disk_read(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-    return get_entry_rec(path, root_dir, SFS_ROOTDIR_NENTRIES, 0, ret_entry, ret_entry_off);
+    if (ino < (fuse_ino_t)geom.rootdir_off || ll_slot(ino) >= LL_NSLOTS ||
+            (ino - geom.rootdir_off) % sizeof(struct sfs_entry))
+        return 0;
+    return ino < (fuse_ino_t)ROOTDIR_END || ino >= (fuse_ino_t)geom.data_off;
 }
 
 
-static int sfs_getattr(const char *path,
-                       struct stat *st)
+/* Read the entry of inode `ino` (which is not the root). */
+static int ll_entry(fuse_ino_t ino, struct sfs_entry *entry)
 {
-    log("getattr %s\n", path);
+    if (!ll_valid(ino))
+        return -ESTALE;
 
-    int res = 0;  
+    entry_lock(ino, 0);
+    entry_read(ino, entry);
+    entry_unlock(ino);
+    return entry->filename[0] != '\0' ? 0 : -ENOENT;
+}
+
+
+/* Look up the index of directory inode `ino`. */
+static int ll_dir(fuse_ino_t ino, struct sfs_dir **ret_dir)
+{
     struct sfs_entry entry;
-    unsigned entry_off; 
+    off_t off = geom.rootdir_off;
+    int res;
 
-    memset(st, 0, sizeof(struct stat));
+    if (ino != FUSE_ROOT_ID) {
+        if ((res = ll_entry(ino, &entry)))
+            return res;
+        if (!(entry.size & SFS_DIRECTORY))
+            return -ENOTDIR;
+        off = block_off(entry_block(&entry));
+    }
 
-    st->st_uid = getuid();  
-    st->st_gid = getgid();  
+    *ret_dir = dir_get(off);
+    return *ret_dir ? 0 : -ENOMEM;
+}
 
-    st->st_atime = time(NULL);  
-    st->st_mtime = time(NULL);  
 
-    if(strcmp(path, "/") == 0) {
-        st->st_mode = S_IFDIR | 0755;  
-        st->st_nlink = 2;  
-    } 
-    else { 
-        res = get_entry(path, &entry, &entry_off);
+/* Reply to a lookup, mkdir or (if `fi` is set) create with `entry`. */
+static void ll_reply_entry(fuse_req_t req, const struct sfs_entry *entry,
+                           off_t entry_off, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
 
-        if(res == 0) {
-            if(entry.size & SFS_DIRECTORY) {
-                st->st_mode = S_IFDIR | 0755; 
-                st->st_nlink = 2;  
-            } 
-            else {
-                st->st_mode = S_IFREG | 0644; 
-                st->st_nlink = 1;  
-                st->st_size = entry.size & SFS_SIZEMASK;  
-            }
-        } 
-        else 
-            res = -ENOENT;  
-    }
-    return res;
+    memset(&e, 0, sizeof(e));
+    e.ino = entry_off;
+    e.generation = ll_gen_get(ll_slot(entry_off));
+    fill_stat(entry, &e.attr);
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = LL_TIMEOUT;
+    e.entry_timeout = LL_TIMEOUT;
+
+    if (fi)
+        fuse_reply_create(req, &e, fi);
+    else
+        fuse_reply_entry(req, &e);
 }
 
-static int sfs_readdir(const char *path,
-                       void *buf,
-                       fuse_fill_dir_t filler,
-                       off_t offset,
-                       struct fuse_file_info *fi)
-{
-    (void)offset, (void)fi;
-    log("readdir %s\n", path);
 
-    struct sfs_entry root_dir[SFS_ROOTDIR_NENTRIES];
-    struct sfs_entry sub_dir[SFS_DIR_NENTRIES];
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    OP_STATS(OP_LOOKUP);
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_dir *dir;
+    enum stats_format format;
+    int res;
 
-    if(strcmp(path, "/") == 0) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
+    OP_TRACE_INO(parent, 0, 0);
 
-        disk_read(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+    if (parent == FUSE_ROOT_ID && (format = stats_name(name))) {
+        struct fuse_entry_param e;
 
-        for(size_t i = 0; i < SFS_ROOTDIR_NENTRIES; i++) {
-            if(root_dir[i].filename[0] == '\0') 
-                continue; 
-            filler(buf, root_dir[i].filename, NULL, 0);
+        memset(&e, 0, sizeof(e));
+        if ((res = stats_stat(format, &e.attr))) {
+            fuse_reply_err(req, -res);
+            return;
         }
-        return 0;
-    } 
-    else {
-        struct sfs_entry entry;
-        unsigned entry_off;
-
-        if(get_entry(path, &entry, &entry_off) == 0) {
-            if(entry.size & SFS_DIRECTORY) {
-                disk_read(sub_dir, SFS_DIR_SIZE, SFS_DATA_OFF + entry.first_block * SFS_BLOCK_SIZE);
-
-                filler(buf, ".", NULL, 0);
-                filler(buf, "..", NULL, 0);
-
-                for(size_t i = 0; i < SFS_DIR_NENTRIES; i++) {
-                    if (sub_dir[i].filename[0] == '\0') continue;  
-                    filler(buf, sub_dir[i].filename, NULL, 0);
-                }
-                return 0;
-            } 
-        } 
+        e.ino = e.attr.st_ino = LL_STATS_INO(format);
+        e.entry_timeout = LL_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
     }
-    return -ENOENT;  
+
+    pthread_rwlock_rdlock(&ns_lock);
+    if ((res = ll_dir(parent, &dir)) == 0)
+        res = dir_lookup(dir, name, &entry, &entry_off);
+    pthread_rwlock_unlock(&ns_lock);
+
+    OP_RESULT(res);
+    if (res == -ENOENT) {
+        /* Let the kernel cache that the name does not exist (inode 0). */
+        struct fuse_entry_param e;
+
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = LL_TIMEOUT;
+        fuse_reply_entry(req, &e);
+    } else if (res)
+        fuse_reply_err(req, -res);
+    else
+        ll_reply_entry(req, &entry, entry_off, NULL);
 }
 
-static int sfs_read(const char *path,
-                    char *buf,
-                    size_t size,
-                    off_t offset,
-                    struct fuse_file_info *fi)
+
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                          unsigned long nlookup)
 {
-    (void)fi;
-    log("read %s size=%zu offset=%ld\n", path, size, offset);
+    (void)ino, (void)nlookup;
+    fuse_reply_none(req);
+}
 
+
+/* Reply with the attributes of `ino`; returns the result. */
+static int sfs_ll_reply_attr(fuse_req_t req, fuse_ino_t ino)
+{
     struct sfs_entry entry;
-    unsigned entry_offset;
+    struct stat st;
+    enum stats_format format = STATS_NONE;
+    int res = 0;
 
-    if(get_entry(path, &entry, &entry_offset) != 0 || (entry.size & SFS_DIRECTORY)) 
-        return -EISDIR; 
+    if (ino == FUSE_ROOT_ID)
+        fill_stat(NULL, &st);
+    else if ((format = ll_stats_format(ino)))
+        res = stats_stat(format, &st);
+    else if ((res = ll_entry(ino, &entry)) == 0)
+        fill_stat(&entry, &st);
 
-    size_t file_size = entry.size & SFS_SIZEMASK;
+    if (res) {
+        fuse_reply_err(req, -res);
+        return res;
+    }
+    st.st_ino = ino;
+    /* The size of a statistics file changes with every operation. */
+    fuse_reply_attr(req, &st, format ? 0 : LL_TIMEOUT);
+    return 0;
+}
 
-    if((size_t)offset >= file_size) 
-        return 0; 
 
-    if(size + (size_t)offset > file_size) 
-        size = file_size - offset;
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi)
+{
+    (void)fi;
+    OP_STATS(OP_GETATTR);
+    OP_TRACE_INO(ino, 0, 0);
+
+    pthread_rwlock_rdlock(&ns_lock);
+    OP_RESULT(sfs_ll_reply_attr(req, ino));
+    pthread_rwlock_unlock(&ns_lock);
+}
 
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
-    size_t buffer_offset = 0;
-    char block_buffer[SFS_BLOCK_SIZE];
 
-    blockidx_t block = entry.first_block;
-    size_t block_offset = offset % SFS_BLOCK_SIZE; 
-    off_t block_index = offset / SFS_BLOCK_SIZE; 
+/* Only the size can be changed; other attributes are not stored. */
+static void sfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                           int to_set, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_TRUNCATE);
+    struct sfs_file *f;
+    int res = 0;
 
-    while(block_index > 0 && block != SFS_BLOCKIDX_END) {
-        block = block_table[block];
-        block_index--; 
+    OP_TRACE_INO(ino, attr->st_size, 0);
 
-        if(block == SFS_BLOCKIDX_END) 
-            break; 
+    pthread_rwlock_rdlock(&ns_lock);
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (ino == FUSE_ROOT_ID)
+            res = -EISDIR;
+        else if (ll_stats_format(ino))
+            res = -EACCES;
+        else if (!ll_valid(ino))
+            res = -ESTALE;
+        else if (!(f = file_from_fi(fi, ino)))
+            res = -ENOMEM;
+        else {
+            res = file_truncate(f, NULL, attr->st_size);
+            file_done(fi, f);
+        }
     }
 
-    while(size > 0 && block != SFS_BLOCKIDX_END) {
-        disk_read(block_buffer, SFS_BLOCK_SIZE, SFS_DATA_OFF + block * SFS_BLOCK_SIZE);
-        size_t bytes_block = SFS_BLOCK_SIZE - block_offset;
+    OP_RESULT(res);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        sfs_ll_reply_attr(req, ino);
+    pthread_rwlock_unlock(&ns_lock);
+}
+
 
-        if(bytes_block > size) 
-            bytes_block = size;
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    OP_STATS(OP_OPEN);
+    struct sfs_entry entry;
+    struct sfs_file *f;
+    enum stats_format format;
+    int res = -EISDIR;
 
-        memcpy(buf + buffer_offset, block_buffer + block_offset, bytes_block);
+    OP_TRACE_INO(ino, 0, 0);
 
-        size -= bytes_block;
-        buffer_offset += bytes_block;
-        block_offset = 0; 
-        block = block_table[block];
+    pthread_rwlock_rdlock(&ns_lock);
+    if ((format = ll_stats_format(ino))) {
+        res = stats_open(format, fi);
+    } else if (ino != FUSE_ROOT_ID && (res = ll_entry(ino, &entry)) == 0) {
+        if (entry.size & SFS_DIRECTORY)
+            res = -EISDIR;
+        else if (!(f = file_get(ino)))
+            res = -ENOMEM;
+        else
+            fi->fh = (uintptr_t)f;
     }
-    return buffer_offset; 
+    pthread_rwlock_unlock(&ns_lock);
+
+    OP_RESULT(res);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_open(req, fi);
 }
 
 
-static int sfs_mkdir(const char *path,
-                     mode_t mode)
+static void sfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi)
 {
-    log("mkdir %s mode=%o\n", path, mode);
+    OP_STATS(OP_RELEASE);
+    OP_TRACE_INO(ino, 0, 0);
+
+    if (ll_stats_format(ino))
+        stats_free((struct stats_snap *)(uintptr_t)fi->fh);
+    else
+        file_put((struct sfs_file *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
 
-    char *path_copy = strdup(path);
-    char *path_end = strrchr(path_copy, '/'); 
-    *path_end = '\0';
-    char *parent_path = path_copy; 
-    char *new_dir = path_end + 1; 
 
-    if(strlen(parent_path) == 0) 
-        parent_path = "/";
+static void sfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_READ);
+    char *buf = malloc(size ? size : 1);
+    enum stats_format format;
+    int res = -ENOMEM;
 
-    if(strlen(new_dir) >= SFS_FILENAME_MAX) 
-        return -ENAMETOOLONG; 
+    OP_TRACE_INO(ino, off, size);
 
-    struct sfs_entry root_dir[SFS_ROOTDIR_NENTRIES]; 
-    disk_read(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF); 
-    
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+    pthread_rwlock_rdlock(&ns_lock);
+    if (!buf)
+        ;
+    else if ((format = ll_stats_format(ino)))
+        res = stats_read(format, fi, buf, size, off);
+    else
+        res = file_read((struct sfs_file *)(uintptr_t)fi->fh, NULL, buf, size,
+                        off);
+    pthread_rwlock_unlock(&ns_lock);
 
-    blockidx_t first_block = SFS_BLOCKIDX_EMPTY; 
-    blockidx_t second_block = SFS_BLOCKIDX_EMPTY;
+    OP_RESULT(res);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, res);
+    free(buf);
+}
 
-    for(unsigned int i = 0; i < SFS_BLOCKTBL_NENTRIES - 1; i++) { 
-        if(block_table[i] == SFS_BLOCKIDX_EMPTY && block_table[i + 1] == SFS_BLOCKIDX_EMPTY) {
-            first_block = i;
-            second_block = i + 1;
-            block_table[first_block] = second_block; 
-            block_table[second_block] = SFS_BLOCKIDX_END; 
-            disk_write(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
-            break;
-        }
-    }
 
-    if(strcmp(parent_path, "/") == 0) { 
-        for(unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; ++i) { 
-            if(strlen(root_dir[i].filename) == 0) { 
-                root_dir[i].first_block = first_block;
-                root_dir[i].size = SFS_DIRECTORY;
-                strcpy(root_dir[i].filename, new_dir); 
-                disk_write(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+static void sfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                         size_t size, off_t off, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_WRITE);
+    int res;
 
-                struct sfs_entry new_entries[SFS_DIR_NENTRIES];
+    OP_TRACE_INO(ino, off, size);
 
-                for(unsigned i = 0; i < SFS_DIR_NENTRIES; i++) {
-                    new_entries[i].size = 0;
-                    new_entries[i].first_block = SFS_BLOCKIDX_EMPTY;
-                    strcpy(new_entries[i].filename, "\0");
-                }
-                disk_write(new_entries, SFS_DIR_SIZE, SFS_DATA_OFF + first_block * SFS_BLOCK_SIZE);
-                return 0;
-            }
-        }
-    }
-    else { 
-        struct sfs_entry new_entry;
-        unsigned new_entry_offset;
-        int parent_entry = get_entry(parent_path, &new_entry, &new_entry_offset); 
-
-        if(parent_entry == 0) {
-            struct sfs_entry entries[SFS_DIR_NENTRIES];
-            disk_read(entries, SFS_DIR_SIZE, SFS_DATA_OFF + new_entry.first_block * SFS_BLOCK_SIZE);
-
-            for(unsigned i = 0; i < SFS_DIR_NENTRIES; ++i) {
-                if(strlen(entries[i].filename) == 0) {
-                    entries[i].first_block = first_block;
-                    entries[i].size = SFS_DIRECTORY;
-                    strcpy(entries[i].filename, new_dir);
-                    disk_write(entries, SFS_DIR_SIZE, SFS_DATA_OFF + new_entry.first_block * SFS_BLOCK_SIZE);
-
-                    struct sfs_entry new_entries[SFS_DIR_NENTRIES];
-                    
-                    for(unsigned i = 0; i < SFS_DIR_NENTRIES; i++) {
-                        new_entries[i].size = 0;
-                        new_entries[i].first_block = SFS_BLOCKIDX_EMPTY;
-                        strcpy(new_entries[i].filename, "\0");
-                    }
-                    disk_write(new_entries, SFS_DIR_SIZE, SFS_DATA_OFF + first_block * SFS_BLOCK_SIZE);
-                    return 0;
-                }
-            }
-        }
-    }
-    return -1;
+    pthread_rwlock_rdlock(&ns_lock);
+    res = file_write((struct sfs_file *)(uintptr_t)fi->fh, NULL, buf, NULL,
+                     size, off);
+    pthread_rwlock_unlock(&ns_lock);
+
+    OP_RESULT(res);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
 }
 
-static int sfs_rmdir(const char *path)
+
+static void sfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_bufvec *bufv, off_t off,
+                             struct fuse_file_info *fi)
 {
-    log("rmdir %s\n", path);
-    
-    char *path_copy = strdup(path);
-    char *path_end = strrchr(path_copy, '/');
-    *path_end = '\0';
-    char *parent_path = path_copy;
-    char *dir = path_end + 1;
-    
-    if(strlen(parent_path) == 0) 
-        parent_path = "/";
+    OP_STATS(OP_WRITE);
+    int res;
 
-    struct sfs_entry root_dir[SFS_ROOTDIR_NENTRIES];
-    disk_read(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+    OP_TRACE_INO(ino, off, fuse_buf_size(bufv));
 
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
+    pthread_rwlock_rdlock(&ns_lock);
+    res = file_write_buf((struct sfs_file *)(uintptr_t)fi->fh, NULL, bufv,
+                         off);
+    pthread_rwlock_unlock(&ns_lock);
 
-    struct sfs_entry dir_entry;
-    unsigned dir_entry_offset;
-    int res = get_entry(path, &dir_entry, &dir_entry_offset);
+    OP_RESULT(res);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+
+/*
+ * List directory inode `ino`. Directory offsets are 1 for ".", 2 for ".." and
+ * 3 + i for slot i, so a listing can be resumed at any slot.
+ */
+static void sfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_READDIR);
+    struct sfs_entry *scratch = malloc(DIR_SEG_SIZE);
+    const struct sfs_entry *entries = NULL;
+    unsigned seg = 0, first = 0;
+    struct sfs_dir *dir;
+    char *buf = malloc(size);
+    size_t pos = 0;
+    int res;
 
-    struct sfs_entry dir_entries[SFS_DIR_NENTRIES];
-    disk_read(dir_entries, SFS_DIR_SIZE, SFS_DATA_OFF + dir_entry.first_block * SFS_BLOCK_SIZE);
+    (void)fi;
+    OP_TRACE_INO(ino, off, size);
 
-    for(unsigned i = 0; i < SFS_DIR_NENTRIES; ++i) {
-        if(dir_entries[i].filename[0] != '\0') 
-            return -ENOTEMPTY; 
+    if (!buf || !scratch) {
+        fuse_reply_err(req, ENOMEM);
+        free(buf);
+        free(scratch);
+        return;
     }
 
-    if(strcmp(parent_path, "/") == 0) {
-        for(unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; ++i) {
-            if(strcmp(root_dir[i].filename, dir) == 0) {
-                root_dir[i].first_block = SFS_BLOCKIDX_EMPTY;
-                root_dir[i].size = 0;
-                strcpy(root_dir[i].filename, "\0"); 
-                disk_write(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-                break;
-            }
-        }
-    } 
-    else {
-        struct sfs_entry parent_entry;
-        unsigned parent_entry_offset;
-        res = get_entry(parent_path, &parent_entry, &parent_entry_offset);
-
-        if(res != 0) 
-            return -ENOENT; 
-        
-        struct sfs_entry parent_entries[SFS_DIR_NENTRIES];
-        disk_read(parent_entries, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry.first_block * SFS_BLOCK_SIZE);
-
-        for(unsigned i = 0; i < SFS_DIR_NENTRIES; ++i) {
-            if(strcmp(parent_entries[i].filename, dir) == 0) {
-                parent_entries[i].first_block = SFS_BLOCKIDX_EMPTY;
-                parent_entries[i].size = 0;
-                strcpy(parent_entries[i].filename, "\0"); 
-                disk_write(parent_entries, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry.first_block * SFS_BLOCK_SIZE);
-                break;
-            }
+    pthread_rwlock_rdlock(&ns_lock);
+    if ((res = ll_dir(ino, &dir)) || (res = dir_lock(dir, 0)))
+        goto out;
+
+    /* Offsets 0 and 1 are "." and "..", the slots of the directory follow. */
+    for (off_t i = off; i < 2 + (off_t)dir->nslots; i++) {
+        const struct sfs_entry *entry = NULL;
+        const char *name;
+        struct stat st;
+        size_t n;
+
+        if (i >= 2 && (!entries ||
+                       i - 2 >= first + dir_seg_len(dir, seg))) {
+            if (entries)
+                dir_seg_put(dir, seg);
+            seg = dir_slot_seg(dir, i - 2);
+            first = dir_seg_first(dir, seg);
+            entries = dir_seg_get(dir, seg, scratch);
         }
-    }
+        if (i >= 2)
+            entry = &entries[i - 2 - first];
+        name = i == 0 ? "." : i == 1 ? ".." : entry->filename;
 
-    blockidx_t block = dir_entry.first_block;
-    while(block != SFS_BLOCKIDX_END) {
-        blockidx_t next = block_table[block];
-        block_table[block] = SFS_BLOCKIDX_EMPTY;
-        block = next;
+        if (entry && entry->filename[0] == '\0')
+            continue;
+
+        memset(&st, 0, sizeof(st));
+        st.st_mode = !entry || (entry->size & SFS_DIRECTORY) ? S_IFDIR
+                                                             : S_IFREG;
+        st.st_ino = i == 0 ? ino : i == 1 ? LL_UNKNOWN_INO
+                  : (fuse_ino_t)dir_slot_off(dir, i - 2);
+
+        n = fuse_add_direntry(req, buf + pos, size - pos, name, &st, i + 1);
+        if (n > size - pos)
+            break;
+        pos += n;
     }
+    if (entries)
+        dir_seg_put(dir, seg);
+    dir_unlock(dir);
 
-    disk_write(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
-    return 0; 
+out:
+    pthread_rwlock_unlock(&ns_lock);
+    OP_RESULT(res);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, pos);
+    free(buf);
+    free(scratch);
 }
 
-static int sfs_unlink(const char *path)
+
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode)
 {
-    log("unlink %s\n", path);
+    OP_STATS(OP_MKDIR);
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_dir *dir;
+    int res;
 
-    char *path_copy = strdup(path);
-    char *path_end = strrchr(path_copy, '/');
-    *path_end = '\0';
-    char *parent_path = path_copy;
-    char *file = path_end + 1;
+    (void)mode;
+    OP_TRACE_INO(parent, 0, 0);
 
-    if(strlen(parent_path) == 0)
-        parent_path = "/";
+    pthread_rwlock_rdlock(&ns_lock);
+    if ((res = ll_dir(parent, &dir)) == 0)
+        res = dir_add(dir, name, 1, NULL, &entry, &entry_off);
+    pthread_rwlock_unlock(&ns_lock);
 
-    struct sfs_entry root_dir[SFS_ROOTDIR_NENTRIES];
-    disk_read(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
+    OP_RESULT(res);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        ll_reply_entry(req, &entry, entry_off, NULL);
+}
 
-    blockidx_t block_table[SFS_BLOCKTBL_NENTRIES];
-    disk_read(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
 
-    struct sfs_entry file_entry;
-    unsigned file_entry_offset;
-    int res = get_entry(path, &file_entry, &file_entry_offset);
-   
-    if(strcmp(parent_path, "/") == 0) {
-        for(unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; ++i) {
-            if (strcmp(root_dir[i].filename, file) == 0) {
-                root_dir[i].filename[0] = '\0'; 
-                root_dir[i].first_block = SFS_BLOCKIDX_EMPTY;
-                root_dir[i].size = 0;
-                disk_write(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-                break;
-            }
-        }
-    } 
-    else {
-        struct sfs_entry parent_entry;
-        unsigned parent_entry_offset;
-        res = get_entry(parent_path, &parent_entry, &parent_entry_offset);
-
-        if(res != 0) 
-            return -ENOENT; 
-
-        struct sfs_entry parent_entries[SFS_DIR_NENTRIES];
-        disk_read(parent_entries, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry.first_block * SFS_BLOCK_SIZE);
-
-        for (unsigned i = 0; i < SFS_DIR_NENTRIES; ++i) {
-            if (strcmp(parent_entries[i].filename, file) == 0) {
-                parent_entries[i].filename[0] = '\0';
-                parent_entries[i].first_block = SFS_BLOCKIDX_EMPTY;
-                parent_entries[i].size = 0;
-                disk_write(parent_entries, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry.first_block * SFS_BLOCK_SIZE);
-                break;
-            }
-        }
-    }
+static void sfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, struct fuse_file_info *fi)
+{
+    OP_STATS(OP_CREATE);
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_dir *dir;
+    struct sfs_file *f;
+    int res;
 
-    blockidx_t block = file_entry.first_block;
-    while(block != SFS_BLOCKIDX_END) {
-        blockidx_t next = block_table[block];
-        block_table[block] = SFS_BLOCKIDX_EMPTY;
-        block = next;
+    (void)mode;
+    OP_TRACE_INO(parent, 0, 0);
+
+    pthread_rwlock_rdlock(&ns_lock);
+    if ((res = ll_dir(parent, &dir)) == 0 &&
+            (res = dir_add(dir, name, 0, NULL, &entry, &entry_off)) == 0) {
+        if (!(f = file_get(entry_off)))
+            res = -ENOMEM;
+        else
+            fi->fh = (uintptr_t)f;
     }
+    pthread_rwlock_unlock(&ns_lock);
 
-    disk_write(block_table, SFS_BLOCKTBL_SIZE, SFS_BLOCKTBL_OFF);
-    return 0; 
+    OP_RESULT(res);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        ll_reply_entry(req, &entry, entry_off, fi);
 }
 
 
-static int sfs_create(const char *path,
-                      mode_t mode,
-                      struct fuse_file_info *fi)
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    (void)fi; 
-    log("create %s mode=%o\n", path, mode);
+    OP_STATS(OP_UNLINK);
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_dir *dir;
+    int res;
 
-    char *path_copy = strdup(path);
-    char *path_end = strrchr(path_copy, '/');
-    *path_end = '\0';
-    char *parent_path = path_copy;
-    char *file = path_end + 1;
+    OP_TRACE_INO(parent, 0, 0);
 
-    if(strlen(file) >= SFS_FILENAME_MAX) 
-        return -ENAMETOOLONG;
+    pthread_rwlock_rdlock(&ns_lock);
+    if ((res = ll_dir(parent, &dir)) == 0 &&
+            (res = dir_lookup(dir, name, &entry, &entry_off)) == 0 &&
+            (res = file_remove(dir, entry_off, name)) == 0)
+        ll_gen_bump(ll_slot(entry_off));
+    pthread_rwlock_unlock(&ns_lock);
 
-    if (strlen(parent_path) == 0)
-        parent_path = "/";
+    OP_RESULT(res);
+    fuse_reply_err(req, -res);
+}
 
-    struct sfs_entry root_dir[SFS_ROOTDIR_NENTRIES];
-    disk_read(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
 
-    if(strcmp(parent_path, "/") == 0) {
-        for(unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; ++i) {
-            if(strlen(root_dir[i].filename) == 0) {
-                root_dir[i].first_block = SFS_BLOCKIDX_END;
-                root_dir[i].size = 0; 
-                strcpy(root_dir[i].filename, file);
-                disk_write(root_dir, SFS_ROOTDIR_SIZE, SFS_ROOTDIR_OFF);
-                return 0; 
-            }
-        }
-    } 
-    else {
-        struct sfs_entry parent_entry;
-        unsigned parent_entry_offset;
-        int res = get_entry(parent_path, &parent_entry, &parent_entry_offset);
-
-        if(res != 0) 
-            return -ENOENT; 
-
-        struct sfs_entry parent_entries[SFS_DIR_NENTRIES];
-        disk_read(parent_entries, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry.first_block * SFS_BLOCK_SIZE);
-
-        for (unsigned i = 0; i < SFS_DIR_NENTRIES; ++i) {
-            if (strlen(parent_entries[i].filename) == 0) { 
-                parent_entries[i].first_block = SFS_BLOCKIDX_END; 
-                parent_entries[i].size = 0; 
-                strcpy(parent_entries[i].filename, file);
-                disk_write(parent_entries, SFS_DIR_SIZE, SFS_DATA_OFF + parent_entry.first_block * SFS_BLOCK_SIZE);
-                return 0;
-            }
-        }
-    }
-    return -ENOSPC; 
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    OP_STATS(OP_RMDIR);
+    struct sfs_entry entry;
+    off_t entry_off;
+    struct sfs_dir *dir;
+    int res;
+
+    OP_TRACE_INO(parent, 0, 0);
+
+    pthread_rwlock_wrlock(&ns_lock);
+    if ((res = ll_dir(parent, &dir)) == 0 &&
+            (res = dir_lookup(dir, name, &entry, &entry_off)) == 0 &&
+            (res = dir_remove(dir, entry_off, name)) == 0)
+        ll_gen_bump(ll_slot(entry_off));
+    pthread_rwlock_unlock(&ns_lock);
+
+    OP_RESULT(res);
+    fuse_reply_err(req, -res);
 }
 
 
-/*
- * Shrink or grow the file at `path` to `size` bytes.
- * Excess bytes are thrown away, whereas any bytes added in the process should
- * be nil (\0).
- * Returns 0 on success, < 0 on error.
- */
-static int sfs_truncate(const char *path, off_t size)
+static void sfs_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi)
 {
-    log("truncate %s size=%ld\n", path, size);
+    (void)fi;
+    OP_STATS(OP_FLUSH);
+    OP_TRACE_INO(ino, 0, 0);
 
-    return -ENOSYS;
+    meta_commit();
+    fuse_reply_err(req, 0);
 }
 
 
-/*
- * Write contents of `buf` (of `size` bytes) to the file at `path`.
- * The file is grown if nessecary, and any bytes already present are overwritten
- * (whereas any other data is left intact). The `offset` argument specifies how
- * many bytes should be skipped in the file, after which `size` bytes from
- * buffer are written.
- * This means that the new file size will be max(old_size, offset + size).
- * Returns the number of bytes written, or < 0 on error.
- */
-static int sfs_write(const char *path,
-                     const char *buf,
-                     size_t size,
-                     off_t offset,
-                     struct fuse_file_info *fi)
+static void sfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *fi)
 {
-    (void)fi;
-    log("write %s data='%.*s' size=%zu offset=%ld\n", path, (int)size, buf,
-        size, offset);
+    (void)datasync, (void)fi;
+    OP_STATS(OP_FSYNC);
+    OP_TRACE_INO(ino, 0, 0);
 
-    return -ENOSYS;
+    meta_flush();
+    disk_sync();
+    fuse_reply_err(req, 0);
 }
 
 
-/*
- * Move/rename the file at `path` to `newpath`.
- * Returns 0 on succes, < 0 on error.
- */
-static int sfs_rename(const char *path,
-                      const char *newpath)
+static void sfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                         struct fuse_file_info *fi, unsigned flags,
+                         const void *in_buf, size_t in_bufsz,
+                         size_t out_bufsz)
 {
-    /* Implementing this function is optional, and not worth any points. */
-    log("rename %s %s\n", path, newpath);
+    const struct sfs_clone_arg *clone = in_buf;
+    struct sfs_entry src_entry;
+    off_t src_off;
+    struct sfs_file *f;
+    int res;
 
-    return -ENOSYS;
+    (void)arg, (void)flags, (void)out_bufsz;
+    if ((unsigned)cmd != SFS_IOC_CLONE) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+
+    OP_STATS(OP_CLONE);
+    OP_TRACE_INO(ino, 0, 0);
+
+    pthread_rwlock_rdlock(&ns_lock);
+    if (ino == FUSE_ROOT_ID)
+        res = -EISDIR;
+    else if (ll_stats_format(ino))
+        res = -EACCES;
+    else if (!ll_valid(ino))
+        res = -ESTALE;
+    else if (in_bufsz < sizeof(*clone) ||
+             !memchr(clone->path, '\0', sizeof(clone->path)))
+        res = -ENAMETOOLONG;
+    else if (clone->path[0] != '/')
+        res = -EINVAL;
+    else if (get_entry(clone->path, &src_entry, &src_off) != 0)
+        res = -ENOENT;
+    else if (src_entry.size & SFS_DIRECTORY)
+        res = -EISDIR;
+    else if (!(f = file_from_fi(fi, ino)))
+        res = -ENOMEM;
+    else {
+        res = file_clone(f, NULL, src_off, strrchr(clone->path, '/') + 1);
+        file_done(fi, f);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+
+    OP_RESULT(res);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_ioctl(req, 0, NULL, 0);
 }
 
 
-static const struct fuse_operations sfs_oper = {
-    .getattr    = sfs_getattr,
-    .readdir    = sfs_readdir,
-    .read       = sfs_read,
-    .mkdir      = sfs_mkdir,
-    .rmdir      = sfs_rmdir,
-    .unlink     = sfs_unlink,
-    .create     = sfs_create,
-    .truncate   = sfs_truncate,
-    .write      = sfs_write,
-    .rename     = sfs_rename,
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void)userdata;
+    sfs_init(conn);
+
+    ll_gen = calloc(LL_NSLOTS / LL_GEN_CHUNK + 1, sizeof(*ll_gen));
+    if (!ll_gen) {
+        fprintf(stderr, "Could not allocate generation numbers\n");
+        exit(1);
+    }
+}
+
+
+static const struct fuse_lowlevel_ops sfs_ll_oper = {
+    .init       = sfs_ll_init,
+    .destroy    = sfs_destroy,
+    .lookup     = sfs_ll_lookup,
+    .forget     = sfs_ll_forget,
+    .getattr    = sfs_ll_getattr,
+    .setattr    = sfs_ll_setattr,
+    .mkdir      = sfs_ll_mkdir,
+    .unlink     = sfs_ll_unlink,
+    .rmdir      = sfs_ll_rmdir,
+    .open       = sfs_ll_open,
+    .read       = sfs_ll_read,
+    .write      = sfs_ll_write,
+    .write_buf  = sfs_ll_write_buf,
+    .flush      = sfs_ll_flush,
+    .release    = sfs_ll_release,
+    .fsync      = sfs_ll_fsync,
+    .ioctl      = sfs_ll_ioctl,
+    .readdir    = sfs_ll_readdir,
+    .create     = sfs_ll_create,
 };
 
 
+/* Mount and serve the file system with the low-level engine, the way
+ * fuse_main does for the high-level one. */
+static int sfs_ll_main(struct fuse_args *args)
+{
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                           &foreground) == -1)
+        return 1;
+
+    if ((ch = fuse_mount(mountpoint, args))) {
+        se = fuse_lowlevel_new(args, &sfs_ll_oper, sizeof(sfs_ll_oper), NULL);
+        if (se) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                err = multithreaded ? fuse_session_loop_mt(se)
+                                    : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+    return err ? 1 : 0;
+}
+
+
 #define OPTION(t, p)                            \
     { t, offsetof(struct options, p), 1 }
 #define LOPTION(s, l, p)                        \
@@ -603,6 +6487,19 @@ static const struct fuse_opt option_spec[] = {
     LOPTION("-i %s",    "--img=%s",     img),
     LOPTION("-b",       "--background", background),
     LOPTION("-v",       "--verbose",    verbose),
+    LOPTION("-m",       "--mmap",       mmap),
+    LOPTION("-u",       "--io-uring",   uring),
+    LOPTION("-l",       "--lowlevel",   lowlevel),
+    LOPTION("-j",       "--journal",    journal),
+    LOPTION("-e",       "--extents",    extents),
+    OPTION(             "--defrag=%u",  defrag),
+    OPTION(             "--trace=%s",   trace),
+    OPTION(             "--record=%s",  record),
+    OPTION(             "--dump-trace=%s", dump_trace),
+    OPTION(             "--writeback=%u", writeback),
+    OPTION(             "--dcache=%u",  dcache),
+    OPTION(             "--cache-mb=%u", cache_mb),
+    OPTION(             "--readahead=%u", readahead),
     LOPTION("-h",       "--help",       show_help),
     OPTION(             "--fuse-help",  show_fuse_help),
     FUSE_OPT_END
@@ -619,10 +6516,47 @@ static void show_help(const char *progname)
            "    -i, --img=FILE      filename of SFS image to mount\n"
            "                        (default: \"%s\")\n"
            "    -b, --background    run fuse in background\n"
-           "    -v, --verbose       print debug information\n"
+           "    -v, --verbose       trace every operation to stdout, and\n"
+           "                        print the statistics at unmount\n"
+           "    -m, --mmap          access the image through mmap instead of\n"
+           "                        pread/pwrite\n"
+           "    -u, --io-uring      submit batched block reads and writes\n"
+           "                        through io_uring, so they run in parallel\n"
+           "    -l, --lowlevel      use the inode-based low-level FUSE API\n"
+           "                        instead of path-based callbacks\n"
+           "    -j, --journal       append metadata changes to <img>.journal,\n"
+           "                        and write them to the image lazily\n"
+           "    -e, --extents       map new files by extents instead of block\n"
+           "                        chains (version 2 images only)\n"
+           "        --writeback=SECS\n"
+           "                        keep metadata changes in memory, and write\n"
+           "                        them back at most every SECS seconds\n"
+           "                        (default: write through)\n"
+           "        --dcache=N      cache up to N path lookups (default: %u,\n"
+           "                        0 disables the cache)\n"
+           "        --cache-mb=N    size of the data block cache in MiB\n"
+           "                        (default: %u, 0 disables the cache)\n"
+           "        --readahead=N   read up to N blocks ahead of sequential reads\n"
+           "                        into the block cache (default: %u, 0\n"
+           "                        disables readahead, as does --cache-mb=0)\n"
+           "        --defrag=MBPS   move fragmented files to contiguous blocks in\n"
+           "                        the background, copying at most MBPS MiB\n"
+           "                        per second (default: off)\n"
+           "        --trace=FILE    trace every operation to FILE, in binary\n"
+           "        --record=FILE   trace every operation to FILE with its full\n"
+           "                        arguments, for replaying with sfs-replay\n"
+           "        --dump-trace=FILE\n"
+           "                        print the operations traced in FILE, and\n"
+           "                        exit\n"
            "    -h, --help          show this summarized help\n"
            "        --fuse-help     show full FUSE help\n"
-           "\n", default_img);
+           "\n", default_img, DEFAULT_DCACHE, DEFAULT_CACHE_MB,
+           DEFAULT_READAHEAD);
+    printf("Operation latencies and disk, cache and allocator statistics can\n"
+           "be read from <mountpoint>/" STATS_NAME " (or " STATS_NAME
+           ".json).\n"
+           "SIGUSR1 switches tracing on or off; without -v or --trace, the\n"
+           "operations are traced to <img>.trace.\n\n");
 }
 
 int main(int argc, char **argv)
@@ -630,6 +6564,9 @@ int main(int argc, char **argv)
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
     options.img = strdup(default_img);
+    options.dcache = DEFAULT_DCACHE;
+    options.cache_mb = DEFAULT_CACHE_MB;
+    options.readahead = DEFAULT_READAHEAD;
 
     fuse_opt_parse(&args, &options, option_spec, NULL);
 
@@ -638,6 +6575,10 @@ int main(int argc, char **argv)
         return 0;
     }
 
+    if (options.dump_trace)
+        return trace_dump(options.dump_trace);
+    signal(SIGUSR1, trace_toggle);
+
     if (options.show_fuse_help) {
         assert(fuse_opt_add_arg(&args, "--help") == 0);
         args.argv[0][0] = '\0';
@@ -646,7 +6587,12 @@ int main(int argc, char **argv)
     if (!options.background)
         assert(fuse_opt_add_arg(&args, "-f") == 0);
 
-    disk_open_image(options.img);
+    disk_open_image(options.img,
+                    options.mmap ? DISK_MODE_MMAP :
+                    options.uring ? DISK_MODE_URING : DISK_MODE_PREAD);
+    trace_set_path();
 
+    if (options.lowlevel)
+        return sfs_ll_main(&args);
     return fuse_main(args.argc, args.argv, &sfs_oper, NULL);
 }
@@ -2,6 +2,7 @@
 #define SFS_H
 
 #include <stdint.h>
+#include <sys/ioctl.h>
 
 /*
  * This file defines all data structures and other information about the SFS
@@ -31,6 +32,9 @@
  *    partition (image).
  *  - The _NENTRIES values represent the logical number of entries in that area
  *    (e.g., number of directory entries, number of blockidx values).
+ *
+ * These constants describe version 1 of the format. Version 2 images (see
+ * struct sfs_superblock below) record their own geometry instead.
  */
 
 #define SFS_MAGIC_SIZE 16u
@@ -40,7 +44,7 @@
 #define SFS_ROOTDIR_OFF       SFS_MAGIC_SIZE
 
 #define SFS_BLOCKTBL_NENTRIES 0x4000
-#define SFS_BLOCKTBL_SIZE     (sizeof(blockidx_t) * SFS_BLOCKTBL_NENTRIES)
+#define SFS_BLOCKTBL_SIZE     (sizeof(uint16_t) * SFS_BLOCKTBL_NENTRIES)
 #define SFS_BLOCKTBL_OFF      (SFS_ROOTDIR_OFF + SFS_ROOTDIR_SIZE)
 
 #define SFS_DATA_OFF          (SFS_BLOCKTBL_OFF + SFS_BLOCKTBL_SIZE)
@@ -52,12 +56,17 @@
 #define SFS_BLOCK_SIZE      512u
 
 /* Special blockidx values (that may not be used normally) */
-#define SFS_BLOCKIDX_EMPTY  0xffff  /* Block unused */
-#define SFS_BLOCKIDX_END    0xfffe  /* End of chain */
+#define SFS_BLOCKIDX_EMPTY  0xffffffffu /* Block unused */
+#define SFS_BLOCKIDX_END    0xfffffffeu /* End of chain */
+
+/* The same values in the 16-bit block indices of version 1 images. */
+#define SFS_V1_BLOCKIDX_EMPTY 0xffff
+#define SFS_V1_BLOCKIDX_END   0xfffe
 
 /* Bitsmasks in the size field of directory entries. */
 #define SFS_SIZEMASK        ((1u << 28) - 1) /* Mask away top 4 bits (flags) */
 #define SFS_DIRECTORY       (1u << 31)
+#define SFS_EXTENTS         (1u << 30) /* File mapped by extents (v2 only) */
 
 #define SFS_FILENAME_MAX    58u
 
@@ -68,13 +77,118 @@ static const char sfs_magic[SFS_MAGIC_SIZE] = "**VUOS SFS IMG**";
  * you're dealing with special blockidx values (e.g., that
  * SFS_BLOCKIDX_{EMPTY,END} may occur and that you will need to subtract 1 to
  * obtain the block index within the data area. */
-typedef uint16_t blockidx_t;
+typedef uint32_t blockidx_t;
 
-/* Directory entry (in rootdir or subdir), referring to a file or subdir. */
+/* Directory entry (in rootdir or subdir), referring to a file or subdir. In
+ * version 2 images, names are at most SFS_V2_FILENAME_MAX bytes long
+ * (including the terminating nul), and the last two bytes of `filename` hold
+ * the upper 16 bits of the first block. */
 struct sfs_entry {
     char filename[SFS_FILENAME_MAX];
-    blockidx_t first_block;
+    uint16_t first_block;
     uint32_t size;
 } __attribute__((__packed__));
 
+#define SFS_ENTRY_SIZE      64u
+
+
+/*
+ * Version 2 of the format has a superblock right after the magic numbers,
+ * which records the geometry of the image:
+ * +------------------------+
+ * | Magic numbers          |  16 bytes (sfs_magic, as in version 1)
+ * +------------------------+
+ * | Superblock             |  struct sfs_superblock
+ * +------------------------+
+ * | Root directory entries |  at rootdir_off
+ * +------------------------+
+ * | Block table            |  at blocktbl_off, nblocks 32-bit blockidx values
+ * +------------------------+
+ * | Reference counts       |  at refcnt_off (if not 0), nblocks 32-bit counts
+ * +------------------------+
+ * | Data area              |  at data_off, nblocks blocks of block_size bytes
+ * +------------------------+
+ *
+ * A version 1 image has its first root directory entry where the superblock
+ * would be, and its name cannot contain the '/' in SFS_SB_MAGIC.
+ *
+ * Directories in version 2 images grow as entries are added. A subdirectory is
+ * a chain of segments of SFS_V2_DIR_NENTRIES(block_size) entries, each stored
+ * in consecutive blocks; the root directory continues in a chain of such
+ * segments that starts at rootdir_next. Unused entries have an empty name.
+ *
+ * Files can share blocks (see SFS_IOC_CLONE) on images with a reference count
+ * table. It counts, for each block, the chains that lead through it beyond
+ * the first, so it is 0 for a block of a single file and for a free block.
+ * Only a tail of a chain can be shared, which is also what keeps the shared
+ * links in the block table valid for every file that uses them.
+ */
+#define SFS_SB_OFF          SFS_MAGIC_SIZE
+#define SFS_SB_MAGIC        "SFS/sb2"
+#define SFS_VERSION         2u
+
+#define SFS_V2_FILENAME_MAX 56u
+#define SFS_V2_ROOTDIR_OFF  512u
+
+#define SFS_BLOCK_SIZE_MIN  512u
+#define SFS_BLOCK_SIZE_MAX  65536u
+
+/* Entries per directory segment: a block, but at least SFS_DIR_NENTRIES. */
+#define SFS_V2_DIR_NENTRIES(block_size) \
+    ((block_size) > SFS_DIR_SIZE ? (block_size) / SFS_ENTRY_SIZE \
+                                 : SFS_DIR_NENTRIES)
+
+/* Block indices must stay below SFS_BLOCKIDX_END. */
+#define SFS_V2_NBLOCKS_MAX  0xfffffff0u
+
+struct sfs_superblock {
+    char magic[8];              /* SFS_SB_MAGIC */
+    uint32_t version;           /* SFS_VERSION */
+    uint32_t block_size;        /* Power of two, SFS_BLOCK_SIZE_{MIN,MAX} */
+    uint32_t nblocks;           /* Blocks in the data area */
+    uint32_t rootdir_nentries;
+    uint64_t rootdir_off;
+    uint64_t blocktbl_off;
+    uint64_t data_off;
+    uint32_t rootdir_next;      /* Further root segments, or SFS_BLOCKIDX_END */
+    uint64_t refcnt_off;        /* Reference count table, or 0 if none */
+} __attribute__((__packed__));
+
+
+/*
+ * A run of `len` consecutive data blocks starting at block `start`.
+ *
+ * In version 2 images, a file whose size has SFS_EXTENTS set is described by a
+ * list of extents rather than by a chain: its first_block is the first block
+ * of the list, which fills whole blocks (block_size / sizeof(struct
+ * sfs_extent) extents each) that are chained in the block table like any
+ * file. The extents are in file order, and the list ends once they cover the
+ * file's size, at an extent of length 0, or at the end of its chain. The blocks
+ * of each extent are also chained (in ascending order) in the block table, so
+ * that the table alone still tells which blocks are in use.
+ */
+struct sfs_extent {
+    uint32_t start;
+    uint32_t len;
+} __attribute__((__packed__));
+
+
+/*
+ * ioctl that makes the file it is issued on (opened for writing) a clone of
+ * the file at `path`, given from the root of the file system: it gets the
+ * size and contents of that file by sharing all of its blocks, which are only
+ * copied once either file changes them. The file keeps its name and loses its
+ * previous contents. Needs an image with a reference count table.
+ *
+ * The kernel handles FICLONE and copy_file_range for FUSE itself, without
+ * passing them on, so a clone is requested this way instead (see sfs-clone).
+ */
+#define SFS_CLONE_PATH_MAX 1024u
+
+struct sfs_clone_arg {
+    char path[SFS_CLONE_PATH_MAX];
+};
+
+#define SFS_IOC_CLONE _IOW('S', 1, struct sfs_clone_arg)
+
 #endif
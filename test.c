@@ -0,0 +1,911 @@
+/*
+ * Regression tests of the SFS engine, alongside the tests of a mounted sfs in
+ * check.py. The FUSE handlers of sfs.c are called directly, as in bench.c, on
+ * fresh images made with sfs-mkfs (or mkfs.sfs), which are checked with
+ * sfs-fsck after each test. sfs.c keeps its state in globals, so every test
+ * runs in a process of its own; a test can crash by exiting from a child
+ * process without unmounting. The tests run once for each disk backend, but
+ * not on io_uring where the kernel does not support it.
+ *
+ * Build and run with `make -f tools.mk test`.
+ */
+#define main sfs_main
+#include "sfs.c"
+#undef main
+
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+
+#define TEST_IMG "_test.img"
+#define TEST_JOURNAL TEST_IMG ".journal"
+
+struct test {
+    const char *name;
+    void (*func)(void);
+};
+
+static const char *mkfs_path = "./sfs-mkfs";
+static const char *mkfs_v1_path = "./mkfs.sfs";
+static const char *fsck_path = "./sfs-fsck";
+
+
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    fflush(stdout);
+    _exit(1);
+}
+
+
+/* Run `cmd`, and return its exit status. */
+static int run(const char *fmt, ...)
+{
+    char cmd[1024];
+    va_list ap;
+    int status;
+
+    va_start(ap, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, ap);
+    va_end(ap);
+
+    status = system(cmd);
+    if (status == -1 || !WIFEXITED(status))
+        fail("could not run %s", cmd);
+    return WEXITSTATUS(status);
+}
+
+
+/* Create a fresh version 2 image, with sfs-mkfs options `args`. */
+static void mkimg(const char *args)
+{
+    unlink(TEST_JOURNAL);
+    if (run("%s -q %s %s", mkfs_path, args, TEST_IMG))
+        fail("%s %s failed", mkfs_path, args);
+}
+
+
+/* Whether files are created with extent lists rather than chains. */
+static int use_extents;
+
+/* The disk backend the tests currently run on. */
+static enum disk_mode test_mode;
+
+static void mount_img(int journal)
+{
+    memset(&options, 0, sizeof(options));
+    options.dcache = DEFAULT_DCACHE;
+    options.cache_mb = DEFAULT_CACHE_MB;
+    options.journal = journal;
+    options.extents = use_extents;
+    disk_open_image(TEST_IMG, test_mode);
+    sfs_oper.init(NULL);
+}
+
+
+static void umount_img(void)
+{
+    sfs_oper.destroy(NULL);
+}
+
+
+/* Run `func` in a child process, and return whether it succeeded. */
+static int in_child(void (*func)(void))
+{
+    pid_t pid = fork();
+    int status;
+
+    if (pid == -1)
+        fail("fork: %s", strerror(errno));
+    if (pid == 0) {
+        func();
+        fflush(stdout);
+        _exit(0);
+    }
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+}
+
+
+/* Contents of test files: `size` bytes that depend on `seed`. */
+static char *pattern(size_t size, unsigned seed)
+{
+    char *data = malloc(size ? size : 1);
+    uint32_t x = seed * 2654435761u + 1;
+
+    if (!data)
+        fail("out of memory");
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x;
+    }
+    return data;
+}
+
+
+static void create_file(const char *path)
+{
+    struct fuse_file_info fi;
+    int res;
+
+    memset(&fi, 0, sizeof(fi));
+    if ((res = sfs_oper.create(path, 0644, &fi)))
+        fail("create %s: %s", path, strerror(-res));
+    sfs_oper.release(path, &fi);
+}
+
+
+static void write_file(const char *path, const char *data, size_t size,
+                       off_t offset)
+{
+    int res = sfs_oper.write(path, data, size, offset, NULL);
+
+    if (res != (int)size)
+        fail("write of %zu bytes at %jd to %s: %d", size, (intmax_t)offset,
+             path, res);
+}
+
+
+/* Check that `path` holds exactly `size` bytes of `data`. */
+static void check_file(const char *path, const char *data, size_t size)
+{
+    char *buf = malloc(size + 1);
+    struct stat st;
+    ssize_t res;
+
+    if (!buf)
+        fail("out of memory");
+    if ((res = sfs_oper.getattr(path, &st)))
+        fail("getattr %s: %s", path, strerror(-res));
+    if ((size_t)st.st_size != size)
+        fail("%s has size %jd instead of %zu", path, (intmax_t)st.st_size,
+             size);
+
+    res = sfs_oper.read(path, buf, size + 1, 0, NULL);
+    if (res != (ssize_t)size)
+        fail("read of %s returned %zd instead of %zu", path, res, size);
+    for (size_t i = 0; i < size; i++)
+        if (buf[i] != data[i])
+            fail("%s differs at byte %zu", path, i);
+    free(buf);
+}
+
+
+static void check_missing(const char *path)
+{
+    struct stat st;
+
+    if (sfs_oper.getattr(path, &st) != -ENOENT)
+        fail("%s exists", path);
+}
+
+
+static int count_filler(void *buf, const char *name, const struct stat *st,
+                        off_t off)
+{
+    (void)name;
+    (void)st;
+    (void)off;
+    (*(unsigned *)buf)++;
+    return 0;
+}
+
+/* Check that directory `path` has `n` entries, besides "." and "..". */
+static void check_dir_size(const char *path, unsigned n)
+{
+    unsigned count = 0;
+    int res;
+
+    if ((res = sfs_oper.readdir(path, &count, count_filler, 0, NULL)))
+        fail("readdir %s: %s", path, strerror(-res));
+    if (count != n + 2)
+        fail("%s has %u entries instead of %u", path, count - 2, n);
+}
+
+
+/* Check the image with sfs-fsck, outside of the tests' end. */
+static void fsck_img(void)
+{
+    if (run("%s -q %s", fsck_path, TEST_IMG))
+        fail("%s reports problems", fsck_path);
+}
+
+
+/*
+ * Version 2 images: geometries chosen by sfs-mkfs, 32-bit block indices and
+ * directories that grow. Version 1 images made by mkfs.sfs still work.
+ */
+
+static unsigned v2_version;
+static size_t v2_size;
+static unsigned v2_nfiles;
+
+static void v2_write(void)
+{
+    char *data = pattern(v2_size, 3);
+
+    mount_img(0);
+    if (geom.version != v2_version)
+        fail("image has version %u", geom.version);
+    create_file("/file");
+    write_file("/file", data, v2_size, 0);
+    umount_img();
+}
+
+static void v2_read(void)
+{
+    char *data = pattern(v2_size, 3);
+
+    mount_img(0);
+    check_file("/file", data, v2_size);
+    umount_img();
+}
+
+static void test_v2_geometry(void)
+{
+    static const struct {
+        const char *args;
+        size_t size;
+    } geoms[] = {
+        { "-b 512 -s 1M",     5 * 512 / 2 },
+        { "-b 4096 -s 64M",   (1u << 20) + 123 },
+        { "-b 65536 -n 16",   3 * 65536 + 1 },
+    };
+
+    for (size_t i = 0; i < sizeof(geoms) / sizeof(geoms[0]); i++) {
+        mkimg(geoms[i].args);
+        fsck_img();
+        v2_version = 2;
+        v2_size = geoms[i].size;
+        if (!in_child(v2_write) || !in_child(v2_read))
+            fail("file lost on an image made with %s", geoms[i].args);
+        fsck_img();
+    }
+}
+
+/* A file that uses blocks past those 16-bit indices can address. */
+static void v2_large_write(void)
+{
+    char *data = pattern(v2_size, 4);
+    struct sfs_entry entry;
+    struct sfs_file *f;
+    blockidx_t last;
+    off_t off;
+
+    mount_img(0);
+    create_file("/file");
+    write_file("/file", data, v2_size, 0);
+    if (get_entry("/file", &entry, &off))
+        fail("/file not found");
+    f = file_get(off);
+    last = file_block(f, &entry, (v2_size - 1) / geom.block_size);
+    file_put(f);
+    if (last == SFS_BLOCKIDX_END || last <= SFS_V1_BLOCKIDX_EMPTY)
+        fail("last block of /file is %u", last);
+    umount_img();
+}
+
+static void v2_large_read(void)
+{
+    char *data = pattern(v2_size, 4);
+
+    mount_img(0);
+    check_file("/file", data, v2_size);
+    umount_img();
+}
+
+static void test_v2_large(void)
+{
+    mkimg("-b 512 -s 48M");
+    v2_size = 40u << 20;
+    if (!in_child(v2_large_write) || !in_child(v2_large_read))
+        fail("large file lost");
+}
+
+/* More files than fit in the initial root directory and in one segment of a
+ * subdirectory, half of which are removed again. */
+static void v2_dirs_create(void)
+{
+    char path[64];
+
+    mount_img(0);
+    sfs_oper.mkdir("/sub", 0755);
+    for (unsigned i = 0; i < v2_nfiles; i++) {
+        snprintf(path, sizeof(path), "/f%u", i);
+        create_file(path);
+        snprintf(path, sizeof(path), "/sub/f%u", i);
+        create_file(path);
+    }
+    for (unsigned i = 0; i < v2_nfiles; i += 2) {
+        snprintf(path, sizeof(path), "/f%u", i);
+        sfs_oper.unlink(path);
+        snprintf(path, sizeof(path), "/sub/f%u", i);
+        sfs_oper.unlink(path);
+    }
+    umount_img();
+}
+
+static void v2_dirs_check(void)
+{
+    char path[64];
+
+    mount_img(0);
+    check_dir_size("/", v2_nfiles / 2 + 1);
+    check_dir_size("/sub", v2_nfiles / 2);
+    for (unsigned i = 0; i < v2_nfiles; i++) {
+        snprintf(path, sizeof(path), "/sub/f%u", i);
+        if (i % 2)
+            check_file(path, NULL, 0);
+        else
+            check_missing(path);
+    }
+    umount_img();
+}
+
+static void test_v2_dirs(void)
+{
+    mkimg("-b 512 -s 16M -r 64");
+    v2_nfiles = 300;
+    if (!in_child(v2_dirs_create) || !in_child(v2_dirs_check))
+        fail("directory contents lost");
+}
+
+static void test_v1_compat(void)
+{
+    unlink(TEST_JOURNAL);
+    if (run("%s %s >/dev/null", mkfs_v1_path, TEST_IMG))
+        fail("%s failed", mkfs_v1_path);
+    v2_version = 1;
+    v2_size = 20000;
+    if (!in_child(v2_write) || !in_child(v2_read))
+        fail("file lost on a version 1 image");
+}
+
+
+/*
+ * Clones (SFS_IOC_CLONE): a clone shares the blocks of its source, but
+ * changes to either of them, through writes, truncation or removal, must
+ * never show in the other.
+ */
+
+#define CLONE_SIZE 50000
+
+static void clone_file(const char *dst, const char *src)
+{
+    struct sfs_clone_arg arg;
+    int res;
+
+    memset(&arg, 0, sizeof(arg));
+    strcpy(arg.path, src);
+    if ((res = sfs_oper.ioctl(dst, SFS_IOC_CLONE, &arg, NULL, 0, &arg)))
+        fail("clone of %s to %s: %s", src, dst, strerror(-res));
+}
+
+/* What /a and /b hold after clone_write. */
+static void clone_expected(char **data, char **copy)
+{
+    char *change = pattern(1000, 6);
+
+    *data = pattern(CLONE_SIZE, 5);
+    *copy = pattern(CLONE_SIZE, 5);
+    memcpy(*data, change, 100);
+    memcpy(*copy + 20000, change, 1000);
+}
+
+static void clone_write(void)
+{
+    char *data = pattern(CLONE_SIZE, 5), *copy = pattern(CLONE_SIZE, 5);
+    char *change = pattern(1000, 6);
+
+    mount_img(0);
+    create_file("/a");
+    write_file("/a", data, CLONE_SIZE, 0);
+    create_file("/b");
+    clone_file("/b", "/a");
+    if (!shared_count)
+        fail("no blocks shared after the clone");
+    check_file("/b", data, CLONE_SIZE);
+
+    /* A write in the middle of the clone, across a block boundary. */
+    write_file("/b", change, 1000, 20000);
+    memcpy(copy + 20000, change, 1000);
+    check_file("/a", data, CLONE_SIZE);
+    check_file("/b", copy, CLONE_SIZE);
+
+    /* And one into the source, at its start. */
+    write_file("/a", change, 100, 0);
+    memcpy(data, change, 100);
+    check_file("/a", data, CLONE_SIZE);
+    check_file("/b", copy, CLONE_SIZE);
+    umount_img();
+}
+
+/* The same after a remount. */
+static void clone_check(void)
+{
+    char *data, *copy;
+
+    clone_expected(&data, &copy);
+    mount_img(0);
+    check_file("/a", data, CLONE_SIZE);
+    check_file("/b", copy, CLONE_SIZE);
+    umount_img();
+}
+
+static void test_clone_write(void)
+{
+    mkimg("-b 512 -s 16M");
+    use_extents = 0;
+    if (!in_child(clone_write) || !in_child(clone_check))
+        fail("chains");
+    fsck_img();
+
+    mkimg("-b 512 -s 16M");
+    use_extents = 1;
+    if (!in_child(clone_write) || !in_child(clone_check))
+        fail("extents");
+}
+
+static void clone_resize(void)
+{
+    char *data = pattern(CLONE_SIZE, 7), *zero = calloc(1, CLONE_SIZE);
+    unsigned nfree;
+
+    mount_img(0);
+    nfree = free_count;
+    create_file("/a");
+    write_file("/a", data, CLONE_SIZE, 0);
+
+    /* Shrinking or growing the clone leaves the source alone. */
+    create_file("/b");
+    clone_file("/b", "/a");
+    if (sfs_oper.truncate("/b", 1234) || sfs_oper.truncate("/b", 30000))
+        fail("truncate of /b failed");
+    memcpy(zero, data, 1234);
+    check_file("/a", data, CLONE_SIZE);
+    check_file("/b", zero, 30000);
+
+    /* Removing the source leaves a clone that overwrote an older one. */
+    create_file("/c");
+    write_file("/c", data, 4000, 0);
+    clone_file("/c", "/a");
+    sfs_oper.unlink("/a");
+    check_file("/c", data, CLONE_SIZE);
+
+    sfs_oper.unlink("/b");
+    sfs_oper.unlink("/c");
+    if (shared_count || free_count != nfree)
+        fail("%u blocks still shared, %u not freed", shared_count,
+             nfree - free_count);
+    umount_img();
+}
+
+static void test_clone_resize(void)
+{
+    mkimg("-b 512 -s 16M");
+    use_extents = 0;
+    if (!in_child(clone_resize))
+        fail("chains");
+    fsck_img();
+
+    mkimg("-b 512 -s 16M");
+    use_extents = 1;
+    if (!in_child(clone_resize))
+        fail("extents");
+}
+
+
+/*
+ * Defragmentation: a pass moves fragmented files to single runs of blocks,
+ * without changing what they hold.
+ */
+
+#define DEFRAG_BLOCKS 20
+
+/* The number of runs of consecutive blocks that `path` is stored in. */
+static unsigned file_nruns(const char *path)
+{
+    struct sfs_entry entry;
+    struct sfs_file *f;
+    unsigned nblocks, runs;
+    off_t off;
+
+    if (get_entry(path, &entry, &off))
+        fail("%s not found", path);
+    f = file_get(off);
+    pthread_rwlock_rdlock(&f->lock);
+    runs = file_runs(f, &entry, &nblocks);
+    pthread_rwlock_unlock(&f->lock);
+    file_put(f);
+    return runs;
+}
+
+static void defrag_check(void)
+{
+    char *a = pattern(DEFRAG_BLOCKS * 512, 9);
+    char *b = pattern(DEFRAG_BLOCKS * 512, 10);
+
+    mount_img(0);
+    check_file("/a", a, DEFRAG_BLOCKS * 512);
+    check_file("/b", b, DEFRAG_BLOCKS * 512);
+    if (file_nruns("/a") != 1 || file_nruns("/b") != 1)
+        fail("files are in %u and %u runs", file_nruns("/a"),
+             file_nruns("/b"));
+    umount_img();
+}
+
+static void defrag_write(void)
+{
+    char *a = pattern(DEFRAG_BLOCKS * 512, 9);
+    char *b = pattern(DEFRAG_BLOCKS * 512, 10);
+    struct defrag_ctx ctx = { .budget = UINT64_MAX };
+
+    mount_img(0);
+    create_file("/a");
+    create_file("/b");
+    /* Appending to both in turn interleaves their blocks. */
+    for (unsigned i = 0; i < DEFRAG_BLOCKS; i++) {
+        write_file("/a", a + i * 512, 512, i * 512);
+        write_file("/b", b + i * 512, 512, i * 512);
+    }
+    if (file_nruns("/a") < 2 || file_nruns("/b") < 2)
+        fail("files are not fragmented");
+
+    defrag_pass(&ctx);
+    if (ctx.moved != 2)
+        fail("%lu files moved instead of 2", ctx.moved);
+    umount_img();
+}
+
+static void test_defrag(void)
+{
+    mkimg("-b 512 -s 16M");
+    use_extents = 0;
+    if (!in_child(defrag_write) || !in_child(defrag_check))
+        fail("chains");
+    fsck_img();
+
+    mkimg("-b 512 -s 16M");
+    use_extents = 1;
+    if (!in_child(defrag_write) || !in_child(defrag_check))
+        fail("extents");
+}
+
+/*
+ * Journal recovery: with --journal, metadata changes only reach their home
+ * locations at a checkpoint. After a crash, the committed transactions have
+ * to be replayed when the image is opened again.
+ */
+
+#define JOURNAL_FILE_SIZE 100000
+
+static void journal_crash(void)
+{
+    char *data = pattern(JOURNAL_FILE_SIZE, 1);
+
+    mount_img(1);
+    sfs_oper.mkdir("/dir", 0755);
+    create_file("/dir/file");
+    write_file("/dir/file", data, JOURNAL_FILE_SIZE, 0);
+    create_file("/gone");
+    sfs_oper.unlink("/gone");
+    /* Crash, with everything above committed to the journal only. */
+    _exit(0);
+}
+
+static void journal_check(void)
+{
+    char *data = pattern(JOURNAL_FILE_SIZE, 1);
+
+    mount_img(0);
+    check_file("/dir/file", data, JOURNAL_FILE_SIZE);
+    check_missing("/gone");
+    umount_img();
+}
+
+static off_t journal_size(void)
+{
+    struct stat st;
+
+    return stat(TEST_JOURNAL, &st) == 0 ? st.st_size : 0;
+}
+
+static void test_journal_replay(void)
+{
+    mkimg("-b 512 -s 16M");
+    if (!in_child(journal_crash))
+        fail("journaled operations failed");
+    if (journal_size() == 0)
+        fail("nothing was left in the journal to replay");
+    if (!in_child(journal_check))
+        fail("changes were lost");
+    if (journal_size() != 0)
+        fail("journal not emptied after the replay");
+}
+
+/* Sizes of the journal before and after the last transaction of journal_torn,
+ * shared with the parent process. */
+static off_t *torn_sizes;
+
+/* Like journal_crash, followed by one more transaction that creates /late. */
+static void journal_torn(void)
+{
+    char *data = pattern(JOURNAL_FILE_SIZE, 1);
+
+    mount_img(1);
+    sfs_oper.mkdir("/dir", 0755);
+    create_file("/dir/file");
+    write_file("/dir/file", data, JOURNAL_FILE_SIZE, 0);
+    create_file("/gone");
+    sfs_oper.unlink("/gone");
+    torn_sizes[0] = journal_size();
+    sfs_oper.mkdir("/late", 0755);
+    torn_sizes[1] = journal_size();
+    _exit(0);
+}
+
+static void journal_torn_check(void)
+{
+    char *data = pattern(JOURNAL_FILE_SIZE, 1);
+
+    mount_img(0);
+    check_file("/dir/file", data, JOURNAL_FILE_SIZE);
+    check_missing("/gone");
+    check_missing("/late");
+    umount_img();
+}
+
+/* A transaction that was only partly written when the system crashed, or
+ * whose payload was corrupted, is discarded; those before it are replayed. */
+static void test_journal_torn(void)
+{
+    off_t mid;
+    char c;
+    int fd;
+
+    torn_sizes = mmap(NULL, 2 * sizeof(off_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (torn_sizes == MAP_FAILED)
+        fail("mmap: %s", strerror(errno));
+
+    /* Cut off in the middle of the last transaction. */
+    mkimg("-b 512 -s 16M");
+    if (!in_child(journal_torn))
+        fail("journaled operations failed");
+    if (torn_sizes[1] <= torn_sizes[0])
+        fail("mkdir /late was not journaled");
+    mid = torn_sizes[0] + (torn_sizes[1] - torn_sizes[0]) / 2;
+    if (truncate(TEST_JOURNAL, mid) == -1)
+        fail("could not truncate the journal: %s", strerror(errno));
+    if (!in_child(journal_torn_check))
+        fail("torn transaction: wrong contents after the replay");
+
+    /* Complete, but with a byte of its payload flipped. */
+    mkimg("-b 512 -s 16M");
+    if (!in_child(journal_torn))
+        fail("journaled operations failed");
+    mid = torn_sizes[0] + (torn_sizes[1] - torn_sizes[0]) / 2;
+    if ((fd = open(TEST_JOURNAL, O_RDWR)) == -1 || pread(fd, &c, 1, mid) != 1)
+        fail("could not read the journal: %s", strerror(errno));
+    c ^= 0x40;
+    if (pwrite(fd, &c, 1, mid) != 1 || close(fd) == -1)
+        fail("could not change the journal: %s", strerror(errno));
+    if (!in_child(journal_torn_check))
+        fail("corrupted transaction: wrong contents after the replay");
+}
+
+/* After a clean unmount, the journal is empty and the image complete. */
+static void journal_clean(void)
+{
+    char *data = pattern(JOURNAL_FILE_SIZE, 2);
+
+    mount_img(1);
+    create_file("/file");
+    write_file("/file", data, JOURNAL_FILE_SIZE, 0);
+    umount_img();
+}
+
+static void test_journal_checkpoint(void)
+{
+    mkimg("-b 512 -s 16M");
+    if (!in_child(journal_clean))
+        fail("journaled operations failed");
+    if (journal_size() != 0)
+        fail("journal not emptied at unmount");
+}
+
+
+/*
+ * sfs-fsck: without -r it changes nothing, not even the journal; with -r it
+ * replays the journal first, and repairs a damaged image. Its exit status is
+ * 0 for a consistent image, 1 if every problem was repaired and 4 if some
+ * were not.
+ */
+
+#define FSCK_FILE_BLOCKS 10
+
+/* FNV-1a hash of the contents of file `path`. */
+static uint64_t file_hash(const char *path)
+{
+    uint64_t h = 14695981039346656037ull;
+    FILE *in = fopen(path, "rb");
+    int c;
+
+    if (!in)
+        fail("could not open %s: %s", path, strerror(errno));
+    while ((c = getc(in)) != EOF)
+        h = (h ^ (unsigned char)c) * 1099511628211ull;
+    fclose(in);
+    return h;
+}
+
+/* Run sfs-fsck with `args`, and check that it exits with `status` without
+ * changing the image or the journal, unless `args` asks for repairs. */
+static void fsck_expect(const char *args, int status)
+{
+    uint64_t img = file_hash(TEST_IMG);
+    off_t journal = journal_size();
+    int res = run("%s -q %s %s >/dev/null 2>&1", fsck_path, args, TEST_IMG);
+
+    if (res != status)
+        fail("%s %s exited with %d instead of %d", fsck_path, args, res,
+             status);
+    if (!strstr(args, "-r") && (file_hash(TEST_IMG) != img ||
+                                journal_size() != journal))
+        fail("%s %s changed the image", fsck_path, args);
+}
+
+static void test_fsck_journal(void)
+{
+    mkimg("-b 512 -s 16M");
+    if (!in_child(journal_crash))
+        fail("journaled operations failed");
+    fsck_expect("", 4);
+    if (journal_size() == 0)
+        fail("journal emptied without -r");
+    fsck_expect("-r", 0);
+    if (journal_size() != 0)
+        fail("journal not replayed with -r");
+    if (!in_child(journal_check))
+        fail("changes were lost");
+}
+
+/* Write /a and /b, then cut the chain of /b short with a block index outside
+ * the data area, and mark a free block as used. */
+static void fsck_damage(void)
+{
+    char *data = pattern(FSCK_FILE_BLOCKS * 512, 8);
+    struct sfs_entry entry;
+    struct sfs_file *f;
+    blockidx_t block;
+    off_t off;
+
+    mount_img(0);
+    create_file("/a");
+    write_file("/a", data, FSCK_FILE_BLOCKS * 512, 0);
+    create_file("/b");
+    write_file("/b", data, FSCK_FILE_BLOCKS * 512, 0);
+
+    if (get_entry("/b", &entry, &off))
+        fail("/b not found");
+    f = file_get(off);
+    block = file_block(f, &entry, 3);
+    file_put(f);
+    pthread_mutex_lock(&alloc_lock);
+    blocktbl_set(block, geom.nblocks + 7);
+    for (block = geom.nblocks - 1; block_table[block] != SFS_BLOCKIDX_EMPTY;
+         block--)
+        ;
+    blocktbl_set(block, SFS_BLOCKIDX_END);
+    pthread_mutex_unlock(&alloc_lock);
+    umount_img();
+}
+
+/* /a is untouched, and /b ends where its chain was cut. */
+static void fsck_repaired(void)
+{
+    char *data = pattern(FSCK_FILE_BLOCKS * 512, 8);
+
+    mount_img(0);
+    check_file("/a", data, FSCK_FILE_BLOCKS * 512);
+    check_file("/b", data, 4 * 512);
+    umount_img();
+}
+
+static void test_fsck_repair(void)
+{
+    mkimg("-b 512 -s 16M");
+    use_extents = 0;
+    if (!in_child(fsck_damage))
+        fail("could not damage the image");
+    fsck_expect("", 4);
+    fsck_expect("-r", 1);
+    fsck_expect("", 0);
+    if (!in_child(fsck_repaired))
+        fail("repaired image has the wrong contents");
+}
+
+
+static const struct test tests[] = {
+    { "v2: geometries",                 test_v2_geometry },
+    { "v2: 32-bit block indices",       test_v2_large },
+    { "v2: growing directories",        test_v2_dirs },
+    { "v1: images of mkfs.sfs",         test_v1_compat },
+    { "clone: writes stay private",     test_clone_write },
+    { "clone: truncate and unlink",     test_clone_resize },
+    { "defrag: files become one run",   test_defrag },
+    { "journal: replay after a crash",  test_journal_replay },
+    { "journal: torn last transaction", test_journal_torn },
+    { "journal: checkpoint at unmount", test_journal_checkpoint },
+    { "fsck: journal left alone",       test_fsck_journal },
+    { "fsck: repair of a broken chain", test_fsck_repair },
+};
+
+#define NTESTS (sizeof(tests) / sizeof(tests[0]))
+
+static const struct {
+    const char *name;
+    enum disk_mode mode;
+} modes[] = {
+    { "pread",    DISK_MODE_PREAD },
+    { "mmap",     DISK_MODE_MMAP },
+    { "io_uring", DISK_MODE_URING },
+};
+
+#define NMODES (sizeof(modes) / sizeof(modes[0]))
+
+/* Fail unless test_mode can be used, rather than fall back to pread. */
+static void mode_probe(void)
+{
+    mkimg("-b 512 -s 1M");
+    disk_open_image(TEST_IMG, test_mode);
+    if (disk_get_mode() != test_mode)
+        _exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned failed = 0, ran = 0;
+
+    if (argc > 1)
+        mkfs_path = argv[1];
+    if (argc > 2)
+        fsck_path = argv[2];
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (size_t m = 0; m < NMODES; m++) {
+        test_mode = modes[m].mode;
+        if (!in_child(mode_probe)) {
+            printf("%s: not supported, skipped\n", modes[m].name);
+            continue;
+        }
+
+        for (size_t i = 0; i < NTESTS; i++) {
+            int ok;
+
+            ok = in_child(tests[i].func);
+            if (ok && run("%s -q %s", fsck_path, TEST_IMG)) {
+                printf("%s reports problems\n", fsck_path);
+                ok = 0;
+            }
+            printf("%s: %s: %s\n", modes[m].name, tests[i].name,
+                   ok ? "OK" : "FAIL");
+            failed += !ok;
+            ran++;
+        }
+    }
+
+    unlink(TEST_IMG);
+    unlink(TEST_JOURNAL);
+    printf("%u of %u tests failed\n", failed, ran);
+    return failed != 0;
+}
@@ -0,0 +1,70 @@
+# Tools built from the file system sources, kept out of the Makefile because
+# that is replaced during testing. Build them with `make -f tools.mk [TARGET]`.
+
+include Makefile
+
+.DEFAULT_GOAL := tools
+
+# Built optimized and without ASan, so benchmark numbers are meaningful.
+TOOLS_CFLAGS = -O2 -g -std=gnu99 -Wall -Wextra -D_FILE_OFFSET_BITS=64
+TOOLS_LDFLAGS = -lfuse -lpthread
+
+TOOLS = sfs-bench sfs-replay sfs-mkfs sfs-fsck sfs-pack sfs-defrag sfs-clone \
+	sfs-test
+
+.PHONY: tools tools-clean bench replay mkfs fsck pack defrag clone test
+
+tools: $(TOOLS)
+
+# In-process benchmark of the handlers.
+bench: sfs-bench
+	./sfs-bench $(BENCH_ARGS)
+
+sfs-bench: bench.c $(SOURCES) $(HEADERS)
+	$(CC) $(TOOLS_CFLAGS) -o $@ bench.c diskio.c $(TOOLS_LDFLAGS)
+
+# Replay of a workload recorded with --record.
+replay: sfs-replay
+
+sfs-replay: replay.c $(SOURCES) $(HEADERS)
+	$(CC) $(TOOLS_CFLAGS) -o $@ replay.c diskio.c $(TOOLS_LDFLAGS)
+
+# Creation of (version 2) images with a configurable geometry.
+mkfs: sfs-mkfs
+
+sfs-mkfs: mkfs.c diskio.c $(HEADERS)
+	$(CC) $(TOOLS_CFLAGS) -o $@ mkfs.c diskio.c -lpthread
+
+# Parallel consistency checker (and repairer) for version 1 and 2 images.
+fsck: sfs-fsck
+
+sfs-fsck: fsck.c diskio.c $(HEADERS)
+	$(CC) $(TOOLS_CFLAGS) -o $@ fsck.c diskio.c -lpthread
+
+# Offline creation of images with the contents of a host directory tree.
+pack: sfs-pack
+
+sfs-pack: pack.c diskio.c $(HEADERS)
+	$(CC) $(TOOLS_CFLAGS) -o $@ pack.c diskio.c -lpthread
+
+# Offline defragmentation, with the same code as sfs --defrag.
+defrag: sfs-defrag
+
+sfs-defrag: defrag.c $(SOURCES) $(HEADERS)
+	$(CC) $(TOOLS_CFLAGS) -o $@ defrag.c diskio.c $(TOOLS_LDFLAGS)
+
+# Cloning of files on a mounted file system (see SFS_IOC_CLONE).
+clone: sfs-clone
+
+sfs-clone: clone.c sfs.h
+	$(CC) $(TOOLS_CFLAGS) -o $@ clone.c
+
+# Regression tests of the engine, on images made and checked with the tools.
+test: sfs-test sfs-mkfs sfs-fsck
+	./sfs-test
+
+sfs-test: test.c $(SOURCES) $(HEADERS)
+	$(CC) $(TOOLS_CFLAGS) -o $@ test.c diskio.c $(TOOLS_LDFLAGS)
+
+tools-clean:
+	rm -f $(TOOLS) bench.img bench.img.journal _test.img _test.img.journal